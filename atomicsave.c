@@ -0,0 +1,218 @@
+/*
+ * Detection of atomic saves
+ *
+ * Editors save a file by writing a temporary file (".file.swp", "file~",
+ * "file.tmp"...) and renaming it over the file. Done naively, the
+ * temporary file is added to the annex and committed, then moved and
+ * committed again. Instead, when a file that looks temporary is released
+ * shortly after being created, its commit is held back for
+ * ATOMICSAVE_WINDOW seconds: if it gets renamed meanwhile, the rename is
+ * committed as a new version of the target only, and if it gets removed
+ * nothing is committed at all. Otherwise it is committed when the window
+ * closes.
+ */
+
+#include "atomicsave.h"
+
+#include <time.h>
+
+#define ATOMICSAVE_WINDOW  5   /* seconds between release and rename */
+#define ATOMICSAVE_CREATED 60  /* seconds between creation and release */
+
+typedef struct entry entry;
+struct entry
+{
+    char path[FILENAME_MAX];
+    time_t since;
+    bool released;              /* else only created */
+    sha256 hash;
+    bool hashed;
+    bool written;               /* by one of the releases */
+    entry *next;
+};
+
+static struct {
+    entry *entries;
+    void (*commit)(const char *path, sha256 *hash, bool written);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running, stop;
+} as = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *suffixes[] = { "~", ".tmp", ".swp", ".swx", ".bak", NULL };
+
+static int temporary(const char *path)
+{
+    const char *name;
+    size_t len;
+    int i;
+
+    name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    len = strlen(name);
+    /* hidden files are how most programs write their temporary copies,
+       4913 is how vim checks that it can create files */
+    if (name[0] == '.' || name[0] == '#' || strcmp(name, "4913") == 0)
+        return 1;
+    for (i = 0; suffixes[i] != NULL; i++)
+        if (len > strlen(suffixes[i])
+                && strcmp(name + len - strlen(suffixes[i]), suffixes[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* called with as.lock held */
+static entry *lookup(const char *path)
+{
+    entry *e;
+    for (e = as.entries; e != NULL; e = e->next)
+        if (strcmp(e->path, path) == 0)
+            return e;
+    return NULL;
+}
+
+/* called with as.lock held */
+static void unlink_entry(entry *e)
+{
+    entry **p;
+    for (p = &as.entries; *p != e; p = &(*p)->next)
+        ;
+    *p = e->next;
+}
+
+/* commits the released files whose window closed */
+static void *expirer(void *arg)
+{
+    struct timespec ts;
+    entry *e, *next, *expired;
+    time_t now;
+    (void) arg;
+
+    pthread_mutex_lock(&as.lock);
+    while (!as.stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&as.cond, &as.lock, &ts);
+
+        now = time(NULL);
+        expired = NULL;
+        for (e = as.entries; e != NULL; e = next) {
+            next = e->next;
+            if (as.stop || now - e->since >
+                    (e->released ? ATOMICSAVE_WINDOW : ATOMICSAVE_CREATED)) {
+                unlink_entry(e);
+                e->next = expired;
+                expired = e;
+            }
+        }
+        pthread_mutex_unlock(&as.lock);
+        for (e = expired; e != NULL; e = next) {
+            next = e->next;
+            if (e->released)
+                as.commit(e->path, e->hashed ? &e->hash : NULL, e->written);
+            free(e);
+        }
+        pthread_mutex_lock(&as.lock);
+    }
+    pthread_mutex_unlock(&as.lock);
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+void atomicsave_init(void (*commit)(const char *path, sha256 *hash,
+            bool written))
+{
+    as.commit = commit;
+    as.stop = false;
+    as.running = pthread_create(&as.thread, NULL, expirer, NULL) == 0;
+}
+
+/*
+ * Commits what is still held back.
+ */
+void atomicsave_destroy(void)
+{
+    if (!as.running)
+        return;
+    pthread_mutex_lock(&as.lock);
+    as.stop = true;
+    pthread_cond_signal(&as.cond);
+    pthread_mutex_unlock(&as.lock);
+    pthread_join(as.thread, NULL);
+    as.running = false;
+}
+
+void atomicsave_created(const char *path)
+{
+    entry *e;
+
+    if (!as.running || !temporary(path))
+        return;
+    pthread_mutex_lock(&as.lock);
+    if ((e = lookup(path)) == NULL) {
+        e = calloc(1, sizeof(entry));
+        strncpy(e->path, path, FILENAME_MAX - 1);
+        e->next = as.entries;
+        as.entries = e;
+    }
+    e->since = time(NULL);
+    pthread_mutex_unlock(&as.lock);
+}
+
+/*
+ * To be called on release. Returns 1 if path was created recently and
+ * its commit is held back; hash, if not NULL, is kept for the commit, and
+ * so is whether the handle released wrote to it.
+ */
+int atomicsave_defer(const char *path, const sha256 *hash, bool written)
+{
+    entry *e;
+
+    pthread_mutex_lock(&as.lock);
+    if ((e = lookup(path)) != NULL) {
+        e->released = true;
+        e->since = time(NULL);
+        e->hashed = hash != NULL;
+        if (hash)
+            e->hash = *hash;
+        e->written = e->written || written;
+    }
+    pthread_mutex_unlock(&as.lock);
+    return e != NULL;
+}
+
+int atomicsave_pending(const char *path)
+{
+    entry *e;
+    pthread_mutex_lock(&as.lock);
+    e = lookup(path);
+    pthread_mutex_unlock(&as.lock);
+    return e != NULL;
+}
+
+/*
+ * To be called when path is renamed or removed. Returns 1 if path was
+ * held back, in which case it is now up to the caller to commit it; its
+ * hash is given in hash if hashed is set.
+ */
+int atomicsave_take(const char *path, sha256 *hash, bool *hashed)
+{
+    entry *e;
+
+    pthread_mutex_lock(&as.lock);
+    if ((e = lookup(path)) != NULL) {
+        unlink_entry(e);
+        *hashed = e->hashed;
+        if (e->hashed)
+            *hash = e->hash;
+        free(e);
+    }
+    pthread_mutex_unlock(&as.lock);
+    return e != NULL;
+}
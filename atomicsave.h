@@ -0,0 +1,14 @@
+/*
+ * atomicsave.h
+ */
+
+#include "common.h"
+#include "sha256.h"
+
+void atomicsave_init(void (*commit)(const char *path, sha256 *hash,
+            bool written));
+void atomicsave_destroy(void);
+void atomicsave_created(const char *path);
+int atomicsave_defer(const char *path, const sha256 *hash, bool written);
+int atomicsave_pending(const char *path);
+int atomicsave_take(const char *path, sha256 *hash, bool *hashed);
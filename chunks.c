@@ -0,0 +1,682 @@
+/*
+ * Chunked store of large annexed objects
+ *
+ * Each version of a large file is a full annex object, even when it only
+ * differs from the previous one by a few bytes. Objects of chunk_min bytes
+ * or more are cut instead into chunks at content defined boundaries, and
+ * kept as a manifest (offset, length and SHA-256 of each chunk) over a
+ * store of chunks named after their hash:
+ *
+ *     .git/sharebox/chunks/manifests/KEY
+ *     .git/sharebox/chunks/ab/abcdef...
+ *
+ * Boundaries are found with FastCDC: a gear hash rolls over the content,
+ * and a chunk ends where its top bits are zero. A harder mask before the
+ * average chunk size and an easier one after it keep chunk sizes close to
+ * the average, and nothing is looked at below the minimum size. An edit
+ * only moves the boundaries around it, so a new version of a file shares
+ * all its other chunks with the previous one.
+ *
+ * Reads reassemble the requested range from the chunks covering it,
+ * through a cache of recently used chunks.
+ *
+ * Getting an object back removes its manifest but not its chunks, which
+ * other manifests may share. A collector thread sweeps the chunks no
+ * manifest refers to any more, every CHUNK_COLLECT seconds when there may
+ * be some: it marks the chunks of every manifest, then removes the others
+ * one directory at a time, giving up for this pass if an object was put
+ * in the meantime since its chunks may not have been marked.
+ */
+
+#define _GNU_SOURCE
+
+#include "chunks.h"
+#include "sha256.h"
+#include "qos.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+
+#define CHUNK_MIN       (16 << 10)
+#define CHUNK_AVG       (64 << 10)
+#define CHUNK_MAX       (256 << 10)
+#define CHUNK_MASK_S    0xffffc00000000000ULL   /* 18 bits, before AVG */
+#define CHUNK_MASK_L    0xfffc000000000000ULL   /* 14 bits, after AVG */
+#define CHUNK_CACHE     64      /* chunks kept in memory */
+#define CHUNK_MANIFESTS 8       /* manifests kept in memory */
+#define CHUNK_COLLECT   60      /* seconds between collection passes */
+
+typedef struct chunk chunk;
+struct chunk
+{
+    uint64_t offset;
+    uint32_t length;
+    uint32_t pad;
+    char hex[64];
+};
+
+typedef struct manifest manifest;
+struct manifest
+{
+    char magic[8];
+    uint64_t length;
+    uint64_t count;
+    chunk chunks[];
+};
+
+typedef struct cached cached;
+struct cached
+{
+    char hex[65];
+    char *data;
+    uint32_t length;
+    unsigned long used;
+};
+
+typedef struct loaded loaded;
+struct loaded
+{
+    char key[FILENAME_MAX];
+    manifest *m;
+    unsigned long used;
+};
+
+static struct {
+    char dir[FILENAME_MAX - 80];    /* leaves room for the chunk names */
+    off_t min;
+    uint64_t gear[256];
+    cached cache[CHUNK_CACHE];
+    loaded manifests[CHUNK_MANIFESTS];
+    unsigned long clock;
+    pthread_mutex_t lock;
+    unsigned long long seen, stored;
+    unsigned long puts;         /* objects put so far */
+    bool garbage;               /* chunks may have lost their manifests */
+    pthread_t collector;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+    unsigned long collected;
+} ck;
+
+static store chunks;
+
+/*
+ * Cutting
+ */
+
+/* the gear table has to stay the same forever for chunks to be shared */
+static void init_gear(void)
+{
+    uint64_t x, z;
+    int i;
+
+    x = 0x5348415245424f58ULL;
+    for (i = 0; i < 256; i++) {
+        /* splitmix64 */
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        ck.gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* length of the chunk starting at p, n bytes being left */
+static size_t cut(const unsigned char *p, size_t n)
+{
+    uint64_t h;
+    size_t i, normal, end;
+
+    if (n <= CHUNK_MIN)
+        return n;
+    end = n < CHUNK_MAX ? n : CHUNK_MAX;
+    normal = end < CHUNK_AVG ? end : CHUNK_AVG;
+    h = 0;
+    for (i = CHUNK_MIN; i < normal; i++) {
+        h = (h << 1) + ck.gear[p[i]];
+        if (!(h & CHUNK_MASK_S))
+            return i + 1;
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + ck.gear[p[i]];
+        if (!(h & CHUNK_MASK_L))
+            return i + 1;
+    }
+    return end;
+}
+
+/*
+ * Chunks and manifests (called with ck.lock held)
+ */
+
+static void chunk_path(char path[FILENAME_MAX], const char *hex)
+{
+    snprintf(path, FILENAME_MAX, "%s/%.2s/%.64s", ck.dir, hex, hex);
+}
+
+/* returns -1 if the path of the manifest of key does not fit */
+static int manifest_path(char path[FILENAME_MAX], const char *key)
+{
+    if (snprintf(path, FILENAME_MAX, "%s/manifests/%s", ck.dir, key)
+            >= FILENAME_MAX)
+        return -1;
+    return 0;
+}
+
+/* writes a chunk unless it is already there, without syncing it */
+static int write_chunk(const char *hex, const unsigned char *data,
+        size_t length)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX + 8];
+    int fd, res;
+
+    chunk_path(path, hex);
+    ck.seen += length;
+    if (access(path, F_OK) == 0)
+        return 0;
+    snprintf(tmp, sizeof tmp, "%s/%.2s", ck.dir, hex);
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1)
+        return -1;
+    res = write(fd, data, length) == (ssize_t) length ? 0 : -1;
+    if (close(fd) == -1 || res == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    ck.stored += length;
+    return 0;
+}
+
+/* reads and checks a chunk, through the cache */
+static cached *get_chunk(const chunk *c)
+{
+    char path[FILENAME_MAX], hex[65];
+    cached *e, *lru;
+    sha256 hash;
+    int fd, i;
+    ssize_t n;
+
+    lru = &ck.cache[0];
+    for (i = 0; i < CHUNK_CACHE; i++) {
+        e = &ck.cache[i];
+        if (e->data && strncmp(e->hex, c->hex, 64) == 0) {
+            e->used = ++ck.clock;
+            return e;
+        }
+        if (e->used < lru->used)
+            lru = e;
+    }
+
+    chunk_path(path, c->hex);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+    free(lru->data);
+    lru->data = malloc(c->length ? c->length : 1);
+    n = pread(fd, lru->data, c->length, 0);
+    close(fd);
+    sha256_init(&hash);
+    if (n == c->length)
+        sha256_update(&hash, lru->data, n);
+    sha256_hex(&hash, hex);
+    if (n != c->length || strncmp(hex, c->hex, 64) != 0) {
+        fprintf(stderr, "%s: corrupted chunk\n", path);
+        free(lru->data);
+        lru->data = NULL;
+        lru->used = 0;
+        return NULL;
+    }
+    strcpy(lru->hex, hex);
+    lru->length = c->length;
+    lru->used = ++ck.clock;
+    return lru;
+}
+
+static manifest *get_manifest(const char *key)
+{
+    char path[FILENAME_MAX];
+    struct stat st;
+    loaded *l, *lru;
+    manifest *m;
+    int fd, i;
+
+    lru = &ck.manifests[0];
+    for (i = 0; i < CHUNK_MANIFESTS; i++) {
+        l = &ck.manifests[i];
+        if (l->m && strcmp(l->key, key) == 0) {
+            l->used = ++ck.clock;
+            return l->m;
+        }
+        if (l->used < lru->used)
+            lru = l;
+    }
+
+    if (manifest_path(path, key) == -1
+            || (fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+    m = NULL;
+    if (fstat(fd, &st) != -1 && (size_t) st.st_size >= sizeof(manifest)) {
+        m = malloc(st.st_size);
+        if (pread(fd, m, st.st_size, 0) != st.st_size
+                || memcmp(m->magic, "SBXCHNK1", 8) != 0
+                || sizeof(manifest) + m->count * sizeof(chunk)
+                != (size_t) st.st_size) {
+            free(m);
+            m = NULL;
+        }
+    }
+    close(fd);
+    if (m == NULL)
+        return NULL;
+    free(lru->m);
+    strcpy(lru->key, key);
+    lru->m = m;
+    lru->used = ++ck.clock;
+    return m;
+}
+
+static void forget_manifest(const char *key)
+{
+    int i;
+    for (i = 0; i < CHUNK_MANIFESTS; i++) {
+        if (ck.manifests[i].m && strcmp(ck.manifests[i].key, key) == 0) {
+            free(ck.manifests[i].m);
+            ck.manifests[i].m = NULL;
+            ck.manifests[i].used = 0;
+        }
+    }
+}
+
+/* index of the chunk holding offset */
+static uint64_t find_chunk(const manifest *m, uint64_t offset)
+{
+    uint64_t lo, hi, mid;
+    lo = 0;
+    hi = m->count;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (m->chunks[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Collection
+ */
+
+static int compare_hex(const void *a, const void *b)
+{
+    return memcmp(a, b, 64);
+}
+
+/*
+ * Appends the chunk names of every manifest to *marks, sorted and without
+ * duplicates. Returns -1 if a manifest could not be read.
+ */
+static int mark(char (**marks)[64], size_t *n)
+{
+    char path[FILENAME_MAX];
+    size_t cap, i, j;
+    struct dirent *d;
+    struct stat st;
+    manifest *m;
+    int fd, res;
+    DIR *dir;
+
+    *marks = NULL;
+    *n = cap = 0;
+    manifest_path(path, "");
+    if ((dir = opendir(path)) == NULL)
+        return -1;
+    res = 0;
+    while (res == 0 && (d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.' || manifest_path(path, d->d_name) == -1)
+            continue;
+        if ((fd = open(path, O_RDONLY)) == -1) {
+            /* got back since it was listed */
+            res = errno == ENOENT ? 0 : -1;
+            continue;
+        }
+        m = NULL;
+        if (fstat(fd, &st) == -1) {
+            res = -1;
+        } else if ((size_t) st.st_size >= sizeof(manifest)) {
+            m = malloc(st.st_size);
+            if (pread(fd, m, st.st_size, 0) != st.st_size)
+                res = -1;
+        }
+        close(fd);
+        /* what is not a whole manifest is one being written */
+        if (res == 0 && m && memcmp(m->magic, "SBXCHNK1", 8) == 0
+                && sizeof(manifest) + m->count * sizeof(chunk)
+                == (size_t) st.st_size) {
+            for (i = 0; i < m->count; i++) {
+                if (*n == cap) {
+                    cap = cap ? 2 * cap : 4096;
+                    *marks = realloc(*marks, cap * 64);
+                }
+                memcpy((*marks)[(*n)++], m->chunks[i].hex, 64);
+            }
+        }
+        free(m);
+    }
+    closedir(dir);
+
+    if (*n > 0)
+        qsort(*marks, *n, 64, compare_hex);
+    for (i = j = 0; i < *n; i++)
+        if (j == 0 || memcmp((*marks)[j - 1], (*marks)[i], 64) != 0)
+            memmove((*marks)[j++], (*marks)[i], 64);
+    *n = j;
+    return res;
+}
+
+static bool is_hex(const char *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+            return false;
+    return true;
+}
+
+/* removes the chunks of the directory prefix that are not marked, and
+   the files left by interrupted writes (ck.lock held) */
+static void sweep(const char *prefix, char (*marks)[64], size_t n)
+{
+    char path[FILENAME_MAX];
+    struct dirent *d;
+    DIR *dir;
+
+    snprintf(path, FILENAME_MAX, "%s/%s", ck.dir, prefix);
+    if ((dir = opendir(path)) == NULL)
+        return;
+    while ((d = readdir(dir)) != NULL) {
+        /* chunks, and the chunks being written with a mkstemp() suffix */
+        if (d->d_name[0] == '.' || !is_hex(d->d_name, 64)
+                || strlen(d->d_name) > 64 + 7
+                || (d->d_name[64] == '\0' && n > 0
+                    && bsearch(d->d_name, marks, n, 64, compare_hex)))
+            continue;
+        snprintf(path, FILENAME_MAX, "%s/%s/%.71s", ck.dir, prefix,
+                d->d_name);
+        if (unlink(path) == 0)
+            ck.collected++;
+    }
+    closedir(dir);
+}
+
+/* a pass of collection, if chunks may have lost their manifests */
+static void collect(void)
+{
+    char (*marks)[64], prefix[3];
+    unsigned long puts;
+    size_t n;
+    int i;
+
+    pthread_mutex_lock(&ck.lock);
+    puts = ck.puts;
+    if (!ck.garbage) {
+        pthread_mutex_unlock(&ck.lock);
+        return;
+    }
+    ck.garbage = false;
+    pthread_mutex_unlock(&ck.lock);
+
+    if (mark(&marks, &n) == -1) {
+        free(marks);
+        pthread_mutex_lock(&ck.lock);
+        ck.garbage = true;
+        pthread_mutex_unlock(&ck.lock);
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        qos_wait(QOS_COMPACT, -1);
+        pthread_mutex_lock(&ck.lock);
+        if (ck.puts != puts) {
+            /* its chunks may have been there, unmarked */
+            ck.garbage = true;
+            pthread_mutex_unlock(&ck.lock);
+            break;
+        }
+        snprintf(prefix, sizeof prefix, "%02x", i);
+        sweep(prefix, marks, n);
+        pthread_mutex_unlock(&ck.lock);
+    }
+    free(marks);
+}
+
+static void *collector(void *arg)
+{
+    struct timespec deadline;
+    (void) arg;
+
+    pthread_mutex_lock(&ck.stop_lock);
+    while (!ck.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHUNK_COLLECT;
+        pthread_cond_timedwait(&ck.stop_cond, &ck.stop_lock, &deadline);
+        if (ck.stop)
+            break;
+        pthread_mutex_unlock(&ck.stop_lock);
+        collect();
+        pthread_mutex_lock(&ck.stop_lock);
+    }
+    pthread_mutex_unlock(&ck.stop_lock);
+    return NULL;
+}
+
+/*
+ * Store operations
+ */
+
+static int chunks_put(const char *key, const char *object, off_t size)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX + 8];
+    unsigned char *data;
+    manifest *m;
+    chunk *c;
+    sha256 hash;
+    off_t off;
+    size_t len, mlen;
+    int fd, res;
+
+    if (size < ck.min || manifest_path(path, key) == -1)
+        return -1;
+    if ((fd = open(object, O_RDONLY)) == -1)
+        return -1;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    mlen = sizeof(manifest) + (size / CHUNK_MIN + 1) * sizeof(chunk);
+    m = calloc(1, mlen);
+    memcpy(m->magic, "SBXCHNK1", 8);
+    m->length = size;
+
+    res = 0;
+    pthread_mutex_lock(&ck.lock);
+    ck.puts++;
+    for (off = 0; off < size && res == 0; off += len) {
+        len = cut(data + off, size - off);
+        c = &m->chunks[m->count++];
+        c->offset = off;
+        c->length = len;
+        sha256_init(&hash);
+        sha256_update(&hash, data + off, len);
+        sha256_hex(&hash, tmp);
+        memcpy(c->hex, tmp, 64);
+        res = write_chunk(tmp, data + off, len);
+    }
+    munmap(data, size);
+    close(fd);
+
+    /* the chunks have to be on disk before the manifest pointing at them */
+    mlen = sizeof(manifest) + m->count * sizeof(chunk);
+    manifest_path(path, key);
+    snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+    if (res == 0 && (fd = mkstemp(tmp)) != -1) {
+        if (syncfs(fd) == -1 || write(fd, m, mlen) != (ssize_t) mlen
+                || fsync(fd) == -1)
+            res = -1;
+        if (close(fd) == -1 || res == -1 || rename(tmp, path) == -1) {
+            unlink(tmp);
+            res = -1;
+        }
+    } else {
+        res = -1;
+    }
+    pthread_mutex_unlock(&ck.lock);
+    free(m);
+    return res;
+}
+
+static int chunks_has(const char *key)
+{
+    char path[FILENAME_MAX];
+    return manifest_path(path, key) == 0 && access(path, F_OK) == 0;
+}
+
+static ssize_t chunks_read(const char *key, char *buf, size_t size,
+        off_t offset)
+{
+    manifest *m;
+    cached *e;
+    uint64_t i, skip;
+    size_t done, len;
+    ssize_t res;
+
+    pthread_mutex_lock(&ck.lock);
+    if ((m = get_manifest(key)) == NULL) {
+        pthread_mutex_unlock(&ck.lock);
+        errno = ENOENT;
+        return -1;
+    }
+    if ((uint64_t) offset >= m->length) {
+        pthread_mutex_unlock(&ck.lock);
+        return 0;
+    }
+    if (offset + size > m->length)
+        size = m->length - offset;
+
+    res = 0;
+    done = 0;
+    for (i = find_chunk(m, offset); done < size && i < m->count; i++) {
+        if ((e = get_chunk(&m->chunks[i])) == NULL) {
+            errno = EIO;
+            res = -1;
+            break;
+        }
+        skip = offset + done - m->chunks[i].offset;
+        len = e->length - skip;
+        if (len > size - done)
+            len = size - done;
+        memcpy(buf + done, e->data + skip, len);
+        done += len;
+    }
+    pthread_mutex_unlock(&ck.lock);
+    return res == -1 ? -1 : (ssize_t) done;
+}
+
+static int chunks_get(const char *key, const char *object)
+{
+    char path[FILENAME_MAX];
+    manifest *m;
+    cached *e;
+    uint64_t i;
+    int fd, res;
+
+    pthread_mutex_lock(&ck.lock);
+    if ((m = get_manifest(key)) == NULL
+            || (fd = open(object, O_WRONLY | O_CREAT | O_EXCL, 0444)) == -1) {
+        pthread_mutex_unlock(&ck.lock);
+        return -1;
+    }
+    res = 0;
+    for (i = 0; i < m->count && res == 0; i++) {
+        if ((e = get_chunk(&m->chunks[i])) == NULL
+                || pwrite(fd, e->data, e->length, m->chunks[i].offset)
+                != e->length)
+            res = -1;
+    }
+    if (res == 0 && fsync(fd) == -1)
+        res = -1;
+    if (close(fd) == -1 || res == -1) {
+        unlink(object);
+        res = -1;
+    }
+    if (res == 0) {
+        /* chunks may be shared with other manifests, the collector
+           finds out */
+        if (manifest_path(path, key) == 0)
+            unlink(path);
+        forget_manifest(key);
+        ck.garbage = true;
+    }
+    pthread_mutex_unlock(&ck.lock);
+    return res;
+}
+
+static void chunks_destroy(void)
+{
+    int i;
+
+    pthread_mutex_lock(&ck.stop_lock);
+    ck.stop = true;
+    pthread_cond_signal(&ck.stop_cond);
+    pthread_mutex_unlock(&ck.stop_lock);
+    pthread_join(ck.collector, NULL);
+
+    printf("chunks: %llu bytes chunked, %llu stored, %lu chunks collected\n",
+            ck.seen, ck.stored, ck.collected);
+    for (i = 0; i < CHUNK_CACHE; i++)
+        free(ck.cache[i].data);
+    for (i = 0; i < CHUNK_MANIFESTS; i++)
+        free(ck.manifests[i].m);
+}
+
+/*
+ * Returns the chunk store of the repository, for objects of min bytes or
+ * more, or NULL if min is 0.
+ */
+store *chunks_store(const char *repodir, off_t min)
+{
+    char path[FILENAME_MAX];
+
+    if (min <= 0)
+        return NULL;
+    memset(&ck, 0, sizeof(ck));
+    ck.min = min;
+    pthread_mutex_init(&ck.lock, NULL);
+    init_gear();
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox", repodir);
+    mkdir(path, 0755);
+    if (snprintf(ck.dir, sizeof ck.dir, "%s/.git/sharebox/chunks", repodir)
+            >= (int) sizeof ck.dir)
+        return NULL;
+    mkdir(ck.dir, 0755);
+    manifest_path(path, "");
+    mkdir(path, 0755);
+
+    /* a first pass for what an unmount left */
+    ck.garbage = true;
+    pthread_mutex_init(&ck.stop_lock, NULL);
+    pthread_cond_init(&ck.stop_cond, NULL);
+    pthread_create(&ck.collector, NULL, collector, NULL);
+
+    chunks.name = "chunks";
+    chunks.put = chunks_put;
+    chunks.has = chunks_has;
+    chunks.read = chunks_read;
+    chunks.get = chunks_get;
+    chunks.destroy = chunks_destroy;
+    return &chunks;
+}
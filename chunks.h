@@ -0,0 +1,7 @@
+/*
+ * chunks.h
+ */
+
+#include "store.h"
+
+store *chunks_store(const char *repodir, off_t min);
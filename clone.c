@@ -0,0 +1,154 @@
+/*
+ * Copies that share extents when the filesystem allows it
+ *
+ * On copy-on-write filesystems (btrfs, XFS) a FICLONE ioctl makes the copy
+ * of a whole file in constant time. Otherwise copy_file_range lets the
+ * kernel copy (or share) the data without bouncing it through userspace,
+ * and plain read/write is the last resort. What works is remembered per
+ * device, so that a filesystem refusing clones is not asked again, and
+ * the time taken by each copy is reported.
+ */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "clone.h"
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <linux/fs.h>
+
+#define CLONE_DEVS 16
+
+enum { METHOD_CLONE, METHOD_RANGE, METHOD_RW };
+
+static const char *method_names[] = { "reflink", "copy_file_range", "copy" };
+
+static struct {
+    dev_t dev;
+    int method;     /* best method known to work on dev */
+} devs[CLONE_DEVS];
+static int ndevs;
+static pthread_mutex_t devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int known_method(dev_t dev)
+{
+    int i, res;
+    res = METHOD_CLONE;
+    pthread_mutex_lock(&devs_lock);
+    for (i = 0; i < ndevs; i++)
+        if (devs[i].dev == dev)
+            res = devs[i].method;
+    pthread_mutex_unlock(&devs_lock);
+    return res;
+}
+
+static void remember_method(dev_t dev, int method)
+{
+    int i;
+    pthread_mutex_lock(&devs_lock);
+    for (i = 0; i < ndevs && devs[i].dev != dev; i++)
+        ;
+    if (i == ndevs && ndevs < CLONE_DEVS)
+        ndevs++;
+    if (i < CLONE_DEVS) {
+        devs[i].dev = dev;
+        devs[i].method = method;
+    }
+    pthread_mutex_unlock(&devs_lock);
+}
+
+static int copy_range(int in, int out, off_t size)
+{
+    off_t inoff, outoff;
+    ssize_t n;
+
+    inoff = outoff = 0;
+    while (inoff < size) {
+        n = copy_file_range(in, &inoff, out, &outoff, size - inoff, 0);
+        /* the source ending early is a failure, not a shorter copy */
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int copy_rw(int in, int out)
+{
+    char buf[1 << 16];
+    ssize_t n, w, done;
+    off_t off;
+
+    off = 0;
+    while ((n = pread(in, buf, sizeof buf, off)) > 0) {
+        for (done = 0; done < n; done += w)
+            if ((w = pwrite(out, buf + done, n - done, off + done)) == -1)
+                return -1;
+        off += n;
+    }
+    return n == -1 ? -1 : 0;
+}
+
+/*
+ * Copies the size bytes of in to the empty file out.
+ */
+int clone_fd(int in, int out, off_t size)
+{
+    struct stat st;
+    struct timespec start, end;
+    int method, res;
+
+    if (fstat(out, &st) == -1)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    method = known_method(st.st_dev);
+    res = -1;
+    if (method == METHOD_CLONE) {
+        if ((res = ioctl(out, FICLONE, in)) == -1)
+            method = METHOD_RANGE;
+    }
+    if (res == -1 && method == METHOD_RANGE) {
+        if ((res = copy_range(in, out, size)) == -1) {
+            if (ftruncate(out, 0) == -1)
+                return -1;
+            method = METHOD_RW;
+        }
+    }
+    if (res == -1 && method == METHOD_RW)
+        res = copy_rw(in, out);
+    if (res == -1)
+        return -1;
+
+    remember_method(st.st_dev, method);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%s of %lld bytes in %.3fs\n", method_names[method],
+            (long long) size, (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
+
+/*
+ * Copies src to the new file dst, created with the given mode.
+ */
+int clone_file(const char *src, const char *dst, mode_t mode)
+{
+    struct stat st;
+    int in, out, res;
+
+    if ((in = open(src, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(in, &st) == -1 ||
+            (out = open(dst, O_WRONLY | O_CREAT | O_EXCL, mode)) == -1) {
+        close(in);
+        return -1;
+    }
+    res = clone_fd(in, out, st.st_size);
+    close(in);
+    if (close(out) == -1 || res == -1) {
+        unlink(dst);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,8 @@
+/*
+ * clone.h
+ */
+
+#include <sys/types.h>
+
+int clone_fd(int in, int out, off_t size);
+int clone_file(const char *src, const char *dst, mode_t mode);
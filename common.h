@@ -5,8 +5,8 @@
 #define FUSE_USE_VERSION 26
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite(), scandir() and st_mtim */
+#define _XOPEN_SOURCE 700
 #endif
 
 #include <stdio.h>
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 typedef struct dir dir;
@@ -45,6 +46,19 @@ struct sharebox
     const char *reporoot;
     bool deep_replicate;
     const char *write_callback;
+    int write_callback_delay;
+    int prefetch_depth;
+    off_t prefetch_budget;
+    off_t overlay_min;
+    off_t inline_max;
+    off_t pack_max;
+    off_t chunk_min;
+    bool compress;
+    bool sync_content;
+    int transfers;
+    int peer_transfers;
+    int qos_p99;
+    off_t background_rate;
     dirlist *dirs;
 };
 
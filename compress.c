@@ -0,0 +1,430 @@
+/*
+ * Compressed store of annexed objects
+ *
+ * Logs, CSVs and source trees compress well but are annexed as they are.
+ * With -o compress, objects are kept instead as independent zstd frames of
+ * COMPRESS_FRAME bytes of content each, behind an index of where each
+ * frame starts:
+ *
+ *     header (magic, length, frame size, frame count)
+ *     offsets of the frames, and of their end
+ *     frames
+ *
+ * in .git/sharebox/zstd/xx/KEY. A read only decompresses the frames that
+ * cover it, through a small cache of decompressed frames, so random
+ * access stays cheap. Content that does not compress, as found by
+ * compressing a few samples of it, is left loose.
+ */
+
+#include "compress.h"
+
+#include <sys/stat.h>
+#include <zstd.h>
+
+#define COMPRESS_FRAME   (512 << 10)
+#define COMPRESS_LEVEL   3
+#define COMPRESS_SAMPLE  (64 << 10)
+#define COMPRESS_SAMPLES 4
+#define COMPRESS_CACHE   8          /* decompressed frames kept */
+#define COMPRESS_OPEN    8          /* objects kept open */
+
+typedef struct header header;
+struct header
+{
+    char magic[8];
+    uint64_t length;
+    uint32_t framesize;
+    uint32_t nframes;
+};
+
+typedef struct opened opened;
+struct opened
+{
+    char key[FILENAME_MAX];
+    int fd;
+    header h;
+    uint64_t *offsets;      /* nframes + 1 of them, from the header on */
+    unsigned long used;
+};
+
+typedef struct frame frame;
+struct frame
+{
+    char key[FILENAME_MAX];
+    uint32_t index;
+    char *data;
+    size_t length;
+    unsigned long used;
+};
+
+static struct {
+    char dir[FILENAME_MAX - 8];     /* leaves room for the subdirectory */
+    opened open[COMPRESS_OPEN];
+    frame cache[COMPRESS_CACHE];
+    unsigned long clock;
+    pthread_mutex_t lock;
+    unsigned long long in, out;
+    unsigned long skipped;
+} cz;
+
+static store compress;
+
+/* returns -1 if the path of the object of key does not fit */
+static int object_path(char path[FILENAME_MAX], const char *key)
+{
+    unsigned char h = 0;
+    const char *c;
+    for (c = key; *c; c++)
+        h = h * 31 + *c;
+    if (snprintf(path, FILENAME_MAX, "%s/%02x/%s", cz.dir, h, key)
+            >= FILENAME_MAX)
+        return -1;
+    return 0;
+}
+
+/* whether a few samples of the content compress by 10% at least */
+static bool compressible(int fd, off_t size)
+{
+    char *in, *out;
+    size_t bound, sampled, compressed, res;
+    ssize_t n;
+    off_t off;
+    int i;
+
+    in = malloc(COMPRESS_SAMPLE);
+    bound = ZSTD_compressBound(COMPRESS_SAMPLE);
+    out = malloc(bound);
+    sampled = compressed = 0;
+    for (i = 0; i < COMPRESS_SAMPLES; i++) {
+        off = size / COMPRESS_SAMPLES * i;
+        if ((n = pread(fd, in, COMPRESS_SAMPLE, off)) <= 0)
+            break;
+        res = ZSTD_compress(out, bound, in, n, 1);
+        if (ZSTD_isError(res))
+            break;
+        sampled += n;
+        compressed += res;
+    }
+    free(in);
+    free(out);
+    return sampled > 0 && compressed * 10 <= sampled * 9;
+}
+
+/*
+ * Cache (called with cz.lock held)
+ */
+
+static opened *open_object(const char *key)
+{
+    char path[FILENAME_MAX];
+    opened *o, *lru;
+    size_t len;
+    int fd, i;
+
+    lru = &cz.open[0];
+    for (i = 0; i < COMPRESS_OPEN; i++) {
+        o = &cz.open[i];
+        if (o->offsets && strcmp(o->key, key) == 0) {
+            o->used = ++cz.clock;
+            return o;
+        }
+        if (o->used < lru->used)
+            lru = o;
+    }
+
+    if (object_path(path, key) == -1
+            || (fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+    if (lru->offsets) {
+        close(lru->fd);
+        free(lru->offsets);
+        lru->offsets = NULL;
+    }
+    if (pread(fd, &lru->h, sizeof(header), 0) != sizeof(header)
+            || memcmp(lru->h.magic, "SBXZSTD1", 8) != 0) {
+        close(fd);
+        return NULL;
+    }
+    len = (lru->h.nframes + 1) * sizeof(uint64_t);
+    lru->offsets = malloc(len);
+    if (pread(fd, lru->offsets, len, sizeof(header)) != (ssize_t) len) {
+        free(lru->offsets);
+        lru->offsets = NULL;
+        close(fd);
+        return NULL;
+    }
+    strcpy(lru->key, key);
+    lru->fd = fd;
+    lru->used = ++cz.clock;
+    return lru;
+}
+
+static void close_object(const char *key)
+{
+    int i;
+    for (i = 0; i < COMPRESS_OPEN; i++) {
+        if (cz.open[i].offsets && strcmp(cz.open[i].key, key) == 0) {
+            close(cz.open[i].fd);
+            free(cz.open[i].offsets);
+            cz.open[i].offsets = NULL;
+            cz.open[i].used = 0;
+        }
+    }
+    for (i = 0; i < COMPRESS_CACHE; i++) {
+        if (cz.cache[i].data && strcmp(cz.cache[i].key, key) == 0) {
+            free(cz.cache[i].data);
+            cz.cache[i].data = NULL;
+            cz.cache[i].used = 0;
+        }
+    }
+}
+
+static frame *get_frame(opened *o, uint32_t index)
+{
+    frame *f, *lru;
+    char *in;
+    size_t len, res;
+    int i;
+
+    lru = &cz.cache[0];
+    for (i = 0; i < COMPRESS_CACHE; i++) {
+        f = &cz.cache[i];
+        if (f->data && f->index == index && strcmp(f->key, o->key) == 0) {
+            f->used = ++cz.clock;
+            return f;
+        }
+        if (f->used < lru->used)
+            lru = f;
+    }
+
+    len = o->offsets[index + 1] - o->offsets[index];
+    in = malloc(len ? len : 1);
+    if (pread(o->fd, in, len, o->offsets[index]) != (ssize_t) len) {
+        free(in);
+        return NULL;
+    }
+    free(lru->data);
+    lru->data = malloc(o->h.framesize);
+    res = ZSTD_decompress(lru->data, o->h.framesize, in, len);
+    free(in);
+    if (ZSTD_isError(res)) {
+        fprintf(stderr, "%s: frame %u: %s\n", o->key, index,
+                ZSTD_getErrorName(res));
+        free(lru->data);
+        lru->data = NULL;
+        lru->used = 0;
+        return NULL;
+    }
+    strcpy(lru->key, o->key);
+    lru->index = index;
+    lru->length = res;
+    lru->used = ++cz.clock;
+    return lru;
+}
+
+/*
+ * Store operations
+ */
+
+static int compress_put(const char *key, const char *object, off_t size)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX + 8];
+    char *in, *out;
+    uint64_t *offsets, pos;
+    size_t bound, res, want;
+    ssize_t n;
+    header h;
+    uint32_t i;
+    int fd, ofd, ok;
+
+    if (size == 0 || object_path(path, key) == -1
+            || (fd = open(object, O_RDONLY)) == -1)
+        return -1;
+    if (!compressible(fd, size)) {
+        close(fd);
+        pthread_mutex_lock(&cz.lock);
+        cz.skipped++;
+        pthread_mutex_unlock(&cz.lock);
+        return -1;
+    }
+
+    memcpy(h.magic, "SBXZSTD1", 8);
+    h.length = size;
+    h.framesize = COMPRESS_FRAME;
+    h.nframes = (size + COMPRESS_FRAME - 1) / COMPRESS_FRAME;
+    offsets = malloc((h.nframes + 1) * sizeof(uint64_t));
+
+    strcpy(tmp, path);
+    *strrchr(tmp, '/') = '\0';
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+    if ((ofd = mkstemp(tmp)) == -1) {
+        free(offsets);
+        close(fd);
+        return -1;
+    }
+
+    in = malloc(COMPRESS_FRAME);
+    bound = ZSTD_compressBound(COMPRESS_FRAME);
+    out = malloc(bound);
+    pos = sizeof(header) + (h.nframes + 1) * sizeof(uint64_t);
+    ok = 1;
+    for (i = 0; i < h.nframes && ok; i++) {
+        offsets[i] = pos;
+        /* reads find frames by their index: each but the last is whole */
+        want = (off_t) i * COMPRESS_FRAME + COMPRESS_FRAME <= size
+            ? COMPRESS_FRAME : size - (off_t) i * COMPRESS_FRAME;
+        n = pread(fd, in, want, (off_t) i * COMPRESS_FRAME);
+        ok = n == (ssize_t) want;
+        res = ok ? ZSTD_compress(out, bound, in, n, COMPRESS_LEVEL) : 0;
+        ok = ok && !ZSTD_isError(res)
+            && pwrite(ofd, out, res, pos) == (ssize_t) res;
+        pos += res;
+    }
+    offsets[h.nframes] = pos;
+    ok = ok && pwrite(ofd, &h, sizeof(header), 0) == sizeof(header)
+        && pwrite(ofd, offsets, (h.nframes + 1) * sizeof(uint64_t),
+                sizeof(header)) == (ssize_t) ((h.nframes + 1)
+                    * sizeof(uint64_t))
+        && fsync(ofd) == 0;
+    free(in);
+    free(out);
+    free(offsets);
+    close(fd);
+    if (close(ofd) == -1 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cz.lock);
+    cz.in += size;
+    cz.out += pos;
+    pthread_mutex_unlock(&cz.lock);
+    return 0;
+}
+
+static int compress_has(const char *key)
+{
+    char path[FILENAME_MAX];
+    return object_path(path, key) == 0 && access(path, F_OK) == 0;
+}
+
+static ssize_t compress_read(const char *key, char *buf, size_t size,
+        off_t offset)
+{
+    opened *o;
+    frame *f;
+    uint32_t i;
+    size_t done, skip, len;
+    ssize_t res;
+
+    pthread_mutex_lock(&cz.lock);
+    if ((o = open_object(key)) == NULL) {
+        pthread_mutex_unlock(&cz.lock);
+        errno = ENOENT;
+        return -1;
+    }
+    if ((uint64_t) offset >= o->h.length) {
+        pthread_mutex_unlock(&cz.lock);
+        return 0;
+    }
+    if (offset + size > o->h.length)
+        size = o->h.length - offset;
+
+    res = 0;
+    done = 0;
+    for (i = offset / o->h.framesize; done < size && i < o->h.nframes; i++) {
+        if ((f = get_frame(o, i)) == NULL) {
+            errno = EIO;
+            res = -1;
+            break;
+        }
+        skip = offset + done - (off_t) i * o->h.framesize;
+        len = f->length - skip;
+        if (len > size - done)
+            len = size - done;
+        memcpy(buf + done, f->data + skip, len);
+        done += len;
+    }
+    pthread_mutex_unlock(&cz.lock);
+    return res == -1 ? -1 : (ssize_t) done;
+}
+
+static int compress_get(const char *key, const char *object)
+{
+    char path[FILENAME_MAX];
+    opened *o;
+    frame *f;
+    uint32_t i;
+    int fd, res;
+
+    pthread_mutex_lock(&cz.lock);
+    if ((o = open_object(key)) == NULL
+            || (fd = open(object, O_WRONLY | O_CREAT | O_EXCL, 0444)) == -1) {
+        pthread_mutex_unlock(&cz.lock);
+        return -1;
+    }
+    res = 0;
+    for (i = 0; i < o->h.nframes && res == 0; i++) {
+        if ((f = get_frame(o, i)) == NULL
+                || pwrite(fd, f->data, f->length, (off_t) i * o->h.framesize)
+                != (ssize_t) f->length)
+            res = -1;
+    }
+    if (res == 0 && fsync(fd) == -1)
+        res = -1;
+    if (close(fd) == -1 || res == -1) {
+        unlink(object);
+        res = -1;
+    }
+    if (res == 0) {
+        close_object(key);
+        if (object_path(path, key) == 0)
+            unlink(path);
+    }
+    pthread_mutex_unlock(&cz.lock);
+    return res;
+}
+
+static void compress_destroy(void)
+{
+    int i;
+    printf("zstd: %llu bytes compressed to %llu, %lu objects left loose\n",
+            cz.in, cz.out, cz.skipped);
+    for (i = 0; i < COMPRESS_OPEN; i++) {
+        if (cz.open[i].offsets) {
+            close(cz.open[i].fd);
+            free(cz.open[i].offsets);
+        }
+    }
+    for (i = 0; i < COMPRESS_CACHE; i++)
+        free(cz.cache[i].data);
+}
+
+/*
+ * Returns the compressed store of the repository, or NULL if it is not
+ * enabled.
+ */
+store *compress_store(const char *repodir, bool enabled)
+{
+    char path[FILENAME_MAX];
+
+    if (!enabled)
+        return NULL;
+    memset(&cz, 0, sizeof(cz));
+    pthread_mutex_init(&cz.lock, NULL);
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox", repodir);
+    mkdir(path, 0755);
+    if (snprintf(cz.dir, sizeof cz.dir, "%s/.git/sharebox/zstd", repodir)
+            >= (int) sizeof cz.dir)
+        return NULL;
+    mkdir(cz.dir, 0755);
+
+    compress.name = "zstd";
+    compress.put = compress_put;
+    compress.has = compress_has;
+    compress.read = compress_read;
+    compress.get = compress_get;
+    compress.destroy = compress_destroy;
+    return &compress;
+}
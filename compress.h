@@ -0,0 +1,7 @@
+/*
+ * compress.h
+ */
+
+#include "store.h"
+
+store *compress_store(const char *repodir, bool enabled);
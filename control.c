@@ -0,0 +1,446 @@
+/*
+ * /.sharebox: the control directory
+ *
+ * Files of this directory are not stored anywhere: reading them reports
+ * on the filesystem, and what is written to them is acted upon when they
+ * are closed.
+ *
+ * "import" takes a source directory and, on the next line, a destination
+ * in the mount (the root if omitted), and imports the source there in a
+ * single commit. Closing the file starts the import in a thread of its
+ * own, one at a time. Reading the file tells whether it is still running,
+ * or else gives the outcome of the last one.
+ *
+ * "events" streams the changes committed from the moment it is opened,
+ * one line each (see events.c). Reads wait for changes unless the file
+ * was opened non blocking, and it can be poll()ed. Writing a sequence
+ * number to it resumes the stream from that change.
+ *
+ * "stats" reports what the background work of the filesystem achieved
+ * so far, as of the moment it is opened.
+ */
+
+#include "control.h"
+#include "import.h"
+#include "events.h"
+#include "prefetch.h"
+#include "transfer.h"
+#include "locations.h"
+#include "qos.h"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <poll.h>
+
+#define CONTROL_IMPORT "/.sharebox/import"
+#define CONTROL_EVENTS "/.sharebox/events"
+#define CONTROL_STATS  "/.sharebox/stats"
+
+typedef struct request request;
+struct request
+{
+    char *data;
+    size_t len;
+};
+
+typedef struct import_job import_job;
+struct import_job
+{
+    char src[FILENAME_MAX];
+    char dest[FILENAME_MAX];
+};
+
+static char import_report[FILENAME_MAX + 64];
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t importer;
+static bool importing, imported;   /* running, and to be joined */
+
+static int is_root(const char *path)
+{
+    return strcmp(path, "/.sharebox") == 0;
+}
+
+static int is_import(const char *path)
+{
+    return strcmp(path, CONTROL_IMPORT) == 0;
+}
+
+static int is_events(const char *path)
+{
+    return strcmp(path, CONTROL_EVENTS) == 0;
+}
+
+static int is_stats(const char *path)
+{
+    return strcmp(path, CONTROL_STATS) == 0;
+}
+
+/* the statistics of the modules that keep some */
+static void stats(request *r)
+{
+    FILE *out;
+
+    if ((out = open_memstream(&r->data, &r->len)) == NULL)
+        return;
+    prefetch_stats(out);
+    transfer_stats(out);
+    locations_stats(out);
+    qos_stats(out);
+    fclose(out);
+}
+
+static void *import_thread(void *arg)
+{
+    import_job *job = arg;
+    char report[1024];
+
+    import_tree(sharebox.reporoot, job->src, job->dest, &sharebox.rwlock,
+            report, sizeof report);
+    printf("%s", report);
+    pthread_mutex_lock(&report_lock);
+    snprintf(import_report, sizeof import_report, "%s", report);
+    importing = false;
+    pthread_mutex_unlock(&report_lock);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Starts the import described by the request "<srcdir>\n[<dest>\n]".
+ */
+static int start_import(request *r)
+{
+    import_job *job;
+    char *data, *line;
+
+    job = malloc(sizeof(import_job));
+    data = strndup(r->data, r->len);
+    line = strtok(data, "\n");
+    if (line == NULL || realpath(line, job->src) == NULL) {
+        free(data);
+        free(job);
+        return -ENOENT;
+    }
+    line = strtok(NULL, "\n");
+    snprintf(job->dest, FILENAME_MAX, "%s", line ? line : "/");
+    free(data);
+
+    pthread_mutex_lock(&report_lock);
+    if (importing) {
+        pthread_mutex_unlock(&report_lock);
+        free(job);
+        return -EBUSY;
+    }
+    if (imported)
+        pthread_join(importer, NULL);  /* done, it only has to be reaped */
+    snprintf(import_report, sizeof import_report, "importing %s\n",
+            job->src);
+    importing = true;
+    imported = true;
+    if (pthread_create(&importer, NULL, import_thread, job) != 0) {
+        snprintf(import_report, sizeof import_report,
+                "could not start importing %s\n", job->src);
+        importing = false;
+        imported = false;
+        pthread_mutex_unlock(&report_lock);
+        free(job);
+        return -EAGAIN;
+    }
+    pthread_mutex_unlock(&report_lock);
+    return 0;
+}
+
+/*
+ * FS Operations
+ */
+
+static int control_getattr(const char *path, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    if (is_root(path)) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else if (is_import(path)) {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        pthread_mutex_lock(&report_lock);
+        stbuf->st_size = strlen(import_report);
+        pthread_mutex_unlock(&report_lock);
+    } else if (is_events(path)) {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+    } else if (is_stats(path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    } else {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static int control_access(const char *path, int mask)
+{
+    (void) mask;
+    if (is_root(path) || is_import(path) || is_events(path))
+        return 0;
+    if (is_stats(path))
+        return mask & W_OK ? -EACCES : 0;
+    return -ENOENT;
+}
+
+static int control_readlink(const char *path, char *buf, size_t size)
+{
+    (void) path;
+    (void) buf;
+    (void) size;
+    return -EINVAL;
+}
+
+static int control_readdir(const char *path, void *buf,
+        fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    (void) offset;
+    (void) fi;
+    if (!is_root(path))
+        return -ENOTDIR;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, CONTROL_IMPORT + strlen("/.sharebox/"), NULL, 0);
+    filler(buf, CONTROL_EVENTS + strlen("/.sharebox/"), NULL, 0);
+    filler(buf, CONTROL_STATS + strlen("/.sharebox/"), NULL, 0);
+    filler(buf, "peers", NULL, 0);
+    return 0;
+}
+
+static int control_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    (void) path;
+    (void) mode;
+    (void) rdev;
+    return -EACCES;
+}
+
+static int control_mkdir(const char *path, mode_t mode)
+{
+    (void) path;
+    (void) mode;
+    return -EACCES;
+}
+
+static int control_symlink(const char *target, const char *linkname)
+{
+    (void) target;
+    (void) linkname;
+    return -EACCES;
+}
+
+static int control_unlink(const char *path)
+{
+    (void) path;
+    return -EACCES;
+}
+
+static int control_rmdir(const char *path)
+{
+    (void) path;
+    return -EACCES;
+}
+
+static int control_rename(const char *from, const char *to)
+{
+    (void) from;
+    (void) to;
+    return -EACCES;
+}
+
+static int control_chmod(const char *path, mode_t mode)
+{
+    (void) path;
+    (void) mode;
+    return -EACCES;
+}
+
+static int control_chown(const char *path, uid_t uid, gid_t gid)
+{
+    (void) path;
+    (void) uid;
+    (void) gid;
+    return -EACCES;
+}
+
+static int control_truncate(const char *path, off_t size)
+{
+    (void) size;
+    return is_import(path) || is_events(path) ? 0 : -EACCES;
+}
+
+static int control_utimens(const char *path, const struct timespec ts[2])
+{
+    (void) ts;
+    return is_root(path) || is_import(path) || is_events(path)
+        || is_stats(path) ? 0 : -ENOENT;
+}
+
+static int control_open(const char *path, struct fuse_file_info *fi)
+{
+    request *r;
+
+    if (is_events(path)) {
+        fi->fh = (uintptr_t) events_open(fi->flags & O_NONBLOCK);
+        fi->direct_io = 1;
+        fi->nonseekable = 1;
+        return 0;
+    }
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        r = calloc(1, sizeof(request));
+        stats(r);
+        fi->fh = (uintptr_t) r;
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (!is_import(path))
+        return is_root(path) ? -EISDIR : -ENOENT;
+    r = calloc(1, sizeof(request));
+    fi->fh = (uintptr_t) r;
+    fi->direct_io = 1;  /* the report changes under the page cache */
+    return 0;
+}
+
+static int control_read(const char *path, char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    size_t len;
+
+    if (is_events(path))
+        return events_read((events_reader *) (uintptr_t) fi->fh, buf, size);
+    if (is_stats(path)) {
+        if (offset >= (off_t) r->len)
+            return 0;
+        if (offset + size > r->len)
+            size = r->len - offset;
+        memcpy(buf, r->data + offset, size);
+        return size;
+    }
+    pthread_mutex_lock(&report_lock);
+    len = strlen(import_report);
+    if (offset >= (off_t) len)
+        size = 0;
+    else if (offset + size > len)
+        size = len - offset;
+    memcpy(buf, import_report + offset, size);
+    pthread_mutex_unlock(&report_lock);
+    return size;
+}
+
+static int control_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    char seq[32];
+
+    if (is_events(path)) {
+        snprintf(seq, sizeof seq, "%.*s", (int) size, buf);
+        if (strspn(seq, "0123456789") == 0)
+            return -EINVAL;
+        events_seek((events_reader *) (uintptr_t) fi->fh,
+                strtoull(seq, NULL, 10));
+        return size;
+    }
+    if (offset + size > FILENAME_MAX * 2)
+        return -EFBIG;
+    if (offset + size > r->len) {
+        r->data = realloc(r->data, offset + size);
+        memset(r->data + r->len, 0, offset + size - r->len);
+        r->len = offset + size;
+    }
+    memcpy(r->data + offset, buf, size);
+    return size;
+}
+
+/* close() gets what flush returns, not what release does */
+static int control_flush(const char *path, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    int res;
+
+    if (!is_import(path) || r->len == 0)
+        return 0;
+    res = start_import(r);
+    r->len = 0;     /* flushed again for each duplicate of the handle */
+    return res;
+}
+
+static int control_release(const char *path, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+
+    if (is_events(path)) {
+        events_close((events_reader *) (uintptr_t) fi->fh);
+        return 0;
+    }
+    free(r->data);
+    free(r);
+    return 0;
+}
+
+static int control_poll(const char *path, struct fuse_file_info *fi,
+        struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+    if (!is_events(path)) {
+        /* the other files are always ready */
+        if (ph)
+            fuse_pollhandle_destroy(ph);
+        *reventsp |= POLLIN | POLLOUT;
+        return 0;
+    }
+    *reventsp |= events_poll((events_reader *) (uintptr_t) fi->fh, ph);
+    return 0;
+}
+
+/* waits for the import in progress */
+static void control_destroy(void *data)
+{
+    (void) data;
+    if (imported)
+        pthread_join(importer, NULL);
+}
+
+static int control_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+    if (statvfs(sharebox.reporoot, stbuf) == -1)
+        return -errno;
+    return 0;
+}
+
+void init_control(dir *d)
+{
+    strcpy(d->name, "/.sharebox");
+    (d->operations).getattr    = control_getattr;
+    (d->operations).access     = control_access;
+    (d->operations).readlink   = control_readlink;
+    (d->operations).readdir    = control_readdir;
+    (d->operations).mknod      = control_mknod;
+    (d->operations).mkdir      = control_mkdir;
+    (d->operations).symlink    = control_symlink;
+    (d->operations).unlink     = control_unlink;
+    (d->operations).rmdir      = control_rmdir;
+    (d->operations).rename     = control_rename;
+    (d->operations).chmod      = control_chmod;
+    (d->operations).chown      = control_chown;
+    (d->operations).truncate   = control_truncate;
+    (d->operations).utimens    = control_utimens;
+    (d->operations).open       = control_open;
+    (d->operations).read       = control_read;
+    (d->operations).write      = control_write;
+    (d->operations).flush      = control_flush;
+    (d->operations).release    = control_release;
+    (d->operations).poll       = control_poll;
+    (d->operations).statfs     = control_statfs;
+    (d->operations).destroy    = control_destroy;
+}
@@ -0,0 +1,3 @@
+#include "common.h"
+
+void init_control(dir *);
@@ -0,0 +1,337 @@
+/*
+ * Stream of the changes committed to the filesystem
+ *
+ * Each path that a commit of the filesystem changes is recorded when it
+ * is changed, and published once the commit is made (commits are batched,
+ * see git_commit), along with it, in a ring of EVENTS_RING records. Their
+ * paths go in an arena of EVENTS_ARENA bytes, each taking only its length,
+ * at offsets that only grow (the arena wraps around modulo its size).
+ *
+ * Neither takes a lock: a writer claims the next sequence number and the
+ * bytes of its path with atomic increments, fills them and then publishes
+ * the record by storing the sequence number in its slot. A reader copies
+ * the record and its path, then checks that the number did not change and
+ * that the arena did not come around over the path during the copy, or it
+ * was overwritten under it.
+ *
+ * Readers (the opens of /.sharebox/events, see control.c) each have their
+ * own cursor, and get lines of
+ *
+ *     <seq> <commit> <M|D> <path>
+ *
+ * where M is a path written or created and D a path removed. A reader
+ * that falls more than EVENTS_RING records behind gets a line of
+ * "<seq> overflow <lost>" and goes on from the oldest record left. A
+ * reader starts with the changes that come after its open, or at the
+ * sequence number it writes to its file. A read that waits gives up when
+ * it is interrupted (which FUSE only tells with -o intr).
+ */
+
+#include "events.h"
+
+#include <poll.h>
+#include <time.h>
+
+#define EVENTS_RING  4096
+#define EVENTS_ARENA (1 << 20)
+#define EVENTS_LINE  (FILENAME_MAX + 64)
+
+typedef struct record record;
+struct record
+{
+    uint64_t seq;           /* seq + 1 once published, 0 while written */
+    char kind;
+    char commit[41];
+    uint64_t off;           /* of the path in the arena */
+    size_t len;
+};
+
+struct events_reader
+{
+    uint64_t cursor;
+    bool nonblock;
+    char line[EVENTS_LINE];     /* what the last read did not take */
+    size_t len, off;
+    struct fuse_pollhandle *ph;
+    events_reader *next;
+};
+
+static struct {
+    /* the changes the next commit publishes (sharebox.rwlock) */
+    char *kinds;
+    char **paths;
+    size_t n, cap;
+    record ring[EVENTS_RING];
+    uint64_t head;              /* next sequence number */
+    char arena[EVENTS_ARENA];
+    uint64_t arena_head;        /* next offset */
+    /* waking up the readers that wait, not the ring itself */
+    events_reader *readers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+} ev = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* copies the len bytes of buf to the arena at off, wrapping around */
+static void arena_put(uint64_t off, const char *buf, size_t len)
+{
+    size_t at = off % EVENTS_ARENA;
+    size_t first = len < EVENTS_ARENA - at ? len : EVENTS_ARENA - at;
+
+    memcpy(ev.arena + at, buf, first);
+    memcpy(ev.arena, buf + first, len - first);
+}
+
+/* copies len bytes of the arena at off to buf */
+static void arena_get(uint64_t off, char *buf, size_t len)
+{
+    size_t at = off % EVENTS_ARENA;
+    size_t first = len < EVENTS_ARENA - at ? len : EVENTS_ARENA - at;
+
+    memcpy(buf, ev.arena + at, first);
+    memcpy(buf + first, ev.arena, len - first);
+}
+
+/*
+ * Copies the record seq, and its path into path (FILENAME_MAX bytes).
+ * Returns 1 if it did, 0 if it is not published yet, -1 if it was
+ * overwritten.
+ */
+static int fetch(uint64_t seq, record *out, char *path)
+{
+    record *r = &ev.ring[seq % EVENTS_RING];
+    uint64_t s;
+
+    s = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (s != seq + 1)
+        return s > seq + 1 ? -1 : 0;
+    out->kind = r->kind;
+    memcpy(out->commit, r->commit, sizeof(out->commit));
+    out->off = r->off;
+    out->len = r->len < FILENAME_MAX ? r->len : FILENAME_MAX - 1;
+    arena_get(out->off, path, out->len);
+    path[out->len] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq + 1
+            || __atomic_load_n(&ev.arena_head, __ATOMIC_RELAXED) - out->off
+            > EVENTS_ARENA)
+        return -1;
+    return 1;
+}
+
+/* formats the next line of r, 0 if there is none yet */
+static size_t next_line(events_reader *r)
+{
+    char path[FILENAME_MAX];
+    uint64_t head, lost;
+    record rec;
+    int res;
+
+    head = __atomic_load_n(&ev.head, __ATOMIC_ACQUIRE);
+    while (r->cursor < head) {
+        lost = 0;
+        if (head - r->cursor > EVENTS_RING)
+            lost = head - EVENTS_RING - r->cursor;
+        /* the records whose path the arena lost go in the same line */
+        while ((res = fetch(r->cursor + lost, &rec, path)) == -1
+                && r->cursor + lost + 1 < head)
+            lost++;
+        if (res == -1)
+            lost++;
+        else if (res == 0 && lost == 0)
+            return 0;
+        if (lost) {
+            r->len = snprintf(r->line, EVENTS_LINE, "%llu overflow %llu\n",
+                    (unsigned long long) r->cursor,
+                    (unsigned long long) lost);
+            r->cursor += lost;
+        } else {
+            r->len = snprintf(r->line, EVENTS_LINE, "%llu %s %c %s\n",
+                    (unsigned long long) r->cursor, rec.commit, rec.kind,
+                    path);
+            r->cursor++;
+        }
+        r->off = 0;
+        return r->len;
+    }
+    return 0;
+}
+
+/*
+ * Interface
+ */
+
+void events_init(void)
+{
+    ev.stop = false;
+}
+
+/* wakes up the readers waiting for a change, for unmounting */
+void events_destroy(void)
+{
+    pthread_mutex_lock(&ev.lock);
+    ev.stop = true;
+    pthread_cond_broadcast(&ev.cond);
+    pthread_mutex_unlock(&ev.lock);
+}
+
+/*
+ * Records that the path (relative to the mountpoint) was written (kind
+ * 'M') or removed ('D'), to be published with the next commit.
+ */
+void events_record(char kind, const char *path)
+{
+    if (ev.n == ev.cap) {
+        ev.cap = ev.cap ? 2 * ev.cap : 64;
+        ev.kinds = realloc(ev.kinds, ev.cap);
+        ev.paths = realloc(ev.paths, ev.cap * sizeof(char *));
+    }
+    ev.kinds[ev.n] = kind;
+    ev.paths[ev.n] = strdup(path);
+    ev.n++;
+}
+
+/* publishes the changes recorded so far as made by the commit sha */
+void events_publish(const char *sha)
+{
+    events_reader *r;
+    uint64_t seq;
+    record *rec;
+    size_t i, len;
+
+    if (ev.n == 0)
+        return;
+    for (i = 0; i < ev.n; i++) {
+        len = strnlen(ev.paths[i], FILENAME_MAX - 1);
+        seq = __atomic_fetch_add(&ev.head, 1, __ATOMIC_ACQ_REL);
+        rec = &ev.ring[seq % EVENTS_RING];
+        __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        rec->kind = ev.kinds[i];
+        snprintf(rec->commit, sizeof rec->commit, "%s", sha);
+        rec->off = __atomic_fetch_add(&ev.arena_head, len, __ATOMIC_ACQ_REL);
+        rec->len = len;
+        arena_put(rec->off, ev.paths[i], len);
+        __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+        free(ev.paths[i]);
+    }
+    ev.n = 0;
+
+    pthread_mutex_lock(&ev.lock);
+    pthread_cond_broadcast(&ev.cond);
+    for (r = ev.readers; r != NULL; r = r->next) {
+        if (r->ph) {
+            fuse_notify_poll(r->ph);
+            fuse_pollhandle_destroy(r->ph);
+            r->ph = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ev.lock);
+}
+
+events_reader *events_open(bool nonblock)
+{
+    events_reader *r;
+
+    r = calloc(1, sizeof(events_reader));
+    r->nonblock = nonblock;
+    r->cursor = __atomic_load_n(&ev.head, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&ev.lock);
+    r->next = ev.readers;
+    ev.readers = r;
+    pthread_mutex_unlock(&ev.lock);
+    return r;
+}
+
+void events_close(events_reader *r)
+{
+    events_reader **p;
+
+    pthread_mutex_lock(&ev.lock);
+    for (p = &ev.readers; *p != r; p = &(*p)->next)
+        ;
+    *p = r->next;
+    pthread_mutex_unlock(&ev.lock);
+    if (r->ph)
+        fuse_pollhandle_destroy(r->ph);
+    free(r);
+}
+
+/* moves the cursor of r to the record seq, to resume where it stopped */
+void events_seek(events_reader *r, uint64_t seq)
+{
+    uint64_t head = __atomic_load_n(&ev.head, __ATOMIC_ACQUIRE);
+    r->cursor = seq < head ? seq : head;
+    r->len = r->off = 0;
+}
+
+/*
+ * Reads whole lines, as many as fit in size (a line that does not fit is
+ * handed over in pieces). Unless r was opened non blocking, waits for a
+ * change when there is none. Returns the number of bytes read, -EAGAIN if
+ * there is nothing to read without waiting, -EINTR if the wait was
+ * interrupted.
+ */
+int events_read(events_reader *r, char *buf, size_t size)
+{
+    struct timespec ts;
+    size_t done, n;
+
+    done = 0;
+    while (done < size) {
+        if (r->off == r->len && next_line(r) == 0) {
+            if (done > 0 || r->nonblock)
+                break;
+            /* nothing yet: wait for a change */
+            pthread_mutex_lock(&ev.lock);
+            if (!ev.stop && r->cursor == __atomic_load_n(&ev.head,
+                        __ATOMIC_ACQUIRE)) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&ev.cond, &ev.lock, &ts);
+            }
+            if (ev.stop) {
+                pthread_mutex_unlock(&ev.lock);
+                break;
+            }
+            pthread_mutex_unlock(&ev.lock);
+            if (fuse_interrupted())
+                return -EINTR;
+            continue;
+        }
+        /* whole lines only, unless the line alone does not fit */
+        n = r->len - r->off;
+        if (n > size - done) {
+            if (done > 0)
+                break;
+            n = size - done;
+        }
+        memcpy(buf + done, r->line + r->off, n);
+        r->off += n;
+        done += n;
+    }
+    return done == 0 && r->nonblock && !ev.stop ? -EAGAIN : (int) done;
+}
+
+/*
+ * Whether r has something to read (POLLIN); ph is notified when it has,
+ * if it has not yet.
+ */
+unsigned events_poll(events_reader *r, struct fuse_pollhandle *ph)
+{
+    unsigned revents;
+
+    pthread_mutex_lock(&ev.lock);
+    if (ph) {
+        if (r->ph)
+            fuse_pollhandle_destroy(r->ph);
+        r->ph = ph;
+    }
+    revents = r->off < r->len || r->cursor < __atomic_load_n(&ev.head,
+            __ATOMIC_ACQUIRE) ? POLLIN : 0;
+    pthread_mutex_unlock(&ev.lock);
+    return revents;
+}
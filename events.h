@@ -0,0 +1,17 @@
+/*
+ * events.h
+ */
+
+#include "common.h"
+
+typedef struct events_reader events_reader;
+
+void events_init(void);
+void events_destroy(void);
+void events_record(char kind, const char *path);
+void events_publish(const char *sha);
+events_reader *events_open(bool nonblock);
+void events_close(events_reader *r);
+void events_seek(events_reader *r, uint64_t seq);
+int events_read(events_reader *r, char *buf, size_t size);
+unsigned events_poll(events_reader *r, struct fuse_pollhandle *ph);
@@ -1,4 +1,5 @@
 #include "git-annex.h"
+#include "clone.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -9,6 +10,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
 
 /*
  * wrapper around system() to execute a formatted command. Used as:
@@ -34,13 +40,76 @@ static int fmt_system(const char *format, ...)
     return status;
 }
 
+/*
+ * Replaces the link to the annexed object with a writable copy, the way
+ * git annex unlock does. The copy is made in .git/annex/tmp and reflinks
+ * the object when the filesystem supports it, which makes unlocking
+ * constant time on copy-on-write filesystems.
+ */
 int git_annex_unlock(const char *repodir, const char *path)
 {
+    char object[FILENAME_MAX], tmp[FILENAME_MAX];
+    struct stat st;
+    int in, out, res;
+
+    if (!git_annexed(repodir, path))
+        return -1;
+    if (realpath(path, object) == NULL || (in = open(object, O_RDONLY)) == -1)
+        goto fallback;
+    snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp", repodir);
+    mkdir(tmp, 0755);
+    strncat(tmp, "/unlock.XXXXXX", FILENAME_MAX - strlen(tmp) - 1);
+    if (fstat(in, &st) == -1 || (out = mkstemp(tmp)) == -1) {
+        close(in);
+        goto fallback;
+    }
+    res = clone_fd(in, out, st.st_size);
+    if (res != -1)
+        res = fchmod(out, (st.st_mode & 0777) | S_IWUSR);
+    close(in);
+    if (close(out) == -1)
+        res = -1;
+    if (res != -1 && rename(tmp, path) != -1)
+        return 0;
+    unlink(tmp);
+
+fallback:
     chdir(repodir);
     return fmt_system("git annex unlock -- \"%s\"",
             path + strlen(repodir) + 1);
 }
 
+/*
+ * Replaces the link to the annexed object with an empty writable file,
+ * for content that is about to be rewritten from scratch: nothing is
+ * copied, and the content does not even need to be present.
+ */
+int git_annex_unlock_empty(const char *repodir, const char *path)
+{
+    char tmp[FILENAME_MAX];
+    struct stat st;
+    mode_t mode;
+    int fd, res;
+
+    if (!git_annexed(repodir, path))
+        return -1;
+    mode = 0644;
+    if (stat(path, &st) != -1)
+        mode = (st.st_mode & 0777) | S_IWUSR;
+    snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp", repodir);
+    mkdir(tmp, 0755);
+    strncat(tmp, "/empty.XXXXXX", FILENAME_MAX - strlen(tmp) - 1);
+    if ((fd = mkstemp(tmp)) == -1)
+        return -1;
+    res = fchmod(fd, mode);
+    if (close(fd) == -1)
+        res = -1;
+    if (res != -1 && (res = rename(tmp, path)) != -1)
+        return 0;
+    unlink(tmp);
+    return -1;
+}
+
 int git_annex_add(const char *repodir, const char *path)
 {
     chdir(repodir);
@@ -48,6 +117,22 @@ int git_annex_add(const char *repodir, const char *path)
             path + strlen(repodir) + 1);
 }
 
+/*
+ * Adds path to the annex under a key computed by the caller, which spares
+ * git annex add a pass over the content.
+ */
+int git_annex_setkey(const char *repodir, const char *path, const char *key)
+{
+    int res;
+    chdir(repodir);
+    res = fmt_system("git annex setkey %s \"%s\"",
+            key, path + strlen(repodir) + 1);
+    if (res == 0)
+        res = fmt_system("git annex fromkey %s \"%s\"",
+                key, path + strlen(repodir) + 1);
+    return res;
+}
+
 int git_annex_get(const char *repodir, const char *path,
         const char *branch)
 {
@@ -62,11 +147,238 @@ int git_annex_get(const char *repodir, const char *path,
     return res;
 }
 
+/*
+ * Index updates
+ *
+ * git add, git rm and git mv each rewrite the whole index, which costs the
+ * size of the index per mutation. The paths they are given are queued
+ * instead, and the next commit brings the index in line with the worktree
+ * for all of them in a single update-index run.
+ */
+
+static struct {
+    char **paths;       /* relative to the repository */
+    size_t n, cap;
+    pthread_mutex_t lock;
+} pending = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static void enqueue(const char *repodir, const char *path)
+{
+    pthread_mutex_lock(&pending.lock);
+    if (pending.n == pending.cap) {
+        pending.cap = pending.cap ? 2 * pending.cap : 64;
+        pending.paths = realloc(pending.paths, pending.cap * sizeof(char *));
+    }
+    pending.paths[pending.n++] = strdup(path + strlen(repodir) + 1);
+    pthread_mutex_unlock(&pending.lock);
+}
+
+/*
+ * Directories and removed paths (which may have been directories) stand
+ * for the files under them: the tracked ones, and the untracked ones that
+ * are not ignored.
+ */
+static void expand(FILE *out, char **paths, size_t n)
+{
+    size_t ARG_MAX, len, i, size;
+    char *command, *name;
+    ssize_t got;
+    FILE *in;
+
+    ARG_MAX = sysconf(_SC_ARG_MAX);
+    command = malloc(ARG_MAX);
+    len = snprintf(command, ARG_MAX, "git --literal-pathspecs ls-files -z "
+            "--cached --others --exclude-standard --");
+    for (i = 0; i < n; i++)
+        len += snprintf(command + len, len < ARG_MAX ? ARG_MAX - len : 0,
+                " \"%s\"", paths[i]);
+    if (len < ARG_MAX && (in = popen(command, "r")) != NULL) {
+        name = NULL;
+        size = 0;
+        while ((got = getdelim(&name, &size, '\0', in)) > 0)
+            fwrite(name, 1, got, out);
+        free(name);
+        pclose(in);
+    }
+    free(command);
+}
+
+static int flush_index(const char *repodir)
+{
+    char **paths, **trees;
+    size_t n, ntrees, i;
+    struct stat st;
+    FILE *out;
+    int res;
+
+    pthread_mutex_lock(&pending.lock);
+    paths = pending.paths;
+    n = pending.n;
+    pending.paths = NULL;
+    pending.n = pending.cap = 0;
+    pthread_mutex_unlock(&pending.lock);
+    if (n == 0)
+        return 0;
+
+    chdir(repodir);
+    /* what is added here is meant for git, not for the annex filter */
+    printf("git update-index --add --remove -z --stdin (%zu paths)\n", n);
+    if ((out = popen("git -c annex.gitaddtoannex=false "
+                    "update-index --add --remove -z --stdin", "w")) == NULL) {
+        res = -1;
+        goto out;
+    }
+    trees = malloc(n * sizeof(char *));
+    ntrees = 0;
+    for (i = 0; i < n; i++) {
+        if (lstat(paths[i], &st) == -1) {
+            trees[ntrees++] = paths[i];
+            fwrite(paths[i], 1, strlen(paths[i]) + 1, out);
+        } else if (S_ISDIR(st.st_mode)) {
+            trees[ntrees++] = paths[i];
+        } else {
+            fwrite(paths[i], 1, strlen(paths[i]) + 1, out);
+        }
+    }
+    if (ntrees > 0)
+        expand(out, trees, ntrees);
+    free(trees);
+    res = pclose(out);
+
+out:
+    for (i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+    return res;
+}
+
 int git_add(const char *repodir, const char *path)
 {
+    enqueue(repodir, path);
+    return 0;
+}
+
+/*
+ * Commits
+ *
+ * A commit per operation still means an update-index run and a commit
+ * per write. Once git_batch_start was called, git_commit only adds its
+ * message to a batch, and the batch is committed (index updates included)
+ * COMMIT_DELAY seconds after its first message, or as soon as the lock is
+ * released once it holds COMMIT_BATCH of them. The lock given to git_batch_start is the one
+ * callers of git_commit hold, it protects the batch too. Whatever has to
+ * see HEAD up to date calls git_commit_flush.
+ */
+
+#define COMMIT_DELAY 1
+#define COMMIT_BATCH 256
+
+static struct {
+    const char *repodir;
+    pthread_mutex_t *lock;      /* NULL: no batching */
+    void (*committed)(const char *sha);
+    char *messages;             /* one per line */
+    size_t len, n;
+    struct timespec since;      /* of the first message */
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool stop;
+} batch = { .cond = PTHREAD_COND_INITIALIZER };
+
+/* commits the index and the messages of the batch (batch.lock held) */
+static int commit_batch(const char *repodir)
+{
+    char *message, sha[41];
+    size_t len;
+    int res;
+
+    flush_index(repodir);
+    if (batch.n == 0)
+        return 0;
+    len = batch.len + 64;
+    message = malloc(len);
+    batch.messages[batch.len - 1] = '\0';     /* the last newline */
+    if (batch.n == 1)
+        snprintf(message, len, "%s", batch.messages);
+    else
+        snprintf(message, len, "%zu changes\n\n%s", batch.n,
+                batch.messages);
+    free(batch.messages);
+    batch.messages = NULL;
+    batch.len = batch.n = 0;
+
     chdir(repodir);
-    return fmt_system("git add -- \"%s\"",
-            path + strlen(repodir) + 1);
+    res = fmt_system("git commit -m \"%s\"", message);
+    free(message);
+    /* a failed commit (nothing to commit included) made no new HEAD: what
+       was recorded for it goes with the next one */
+    if (res == 0 && batch.committed && git_head(repodir, sha) == 0)
+        batch.committed(sha);
+    return res;
+}
+
+/* commits the batch COMMIT_DELAY seconds after its first message */
+static void *committer(void *arg)
+{
+    struct timespec ts, now;
+    (void) arg;
+
+    pthread_mutex_lock(batch.lock);
+    while (!batch.stop) {
+        if (batch.n == 0) {
+            pthread_cond_wait(&batch.cond, batch.lock);
+            continue;
+        }
+        ts = batch.since;
+        ts.tv_sec += COMMIT_DELAY;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (batch.n >= COMMIT_BATCH || now.tv_sec > ts.tv_sec
+                || (now.tv_sec == ts.tv_sec && now.tv_nsec >= ts.tv_nsec))
+            commit_batch(batch.repodir);
+        else
+            pthread_cond_timedwait(&batch.cond, batch.lock, &ts);
+    }
+    pthread_mutex_unlock(batch.lock);
+    return NULL;
+}
+
+/*
+ * Batches the commits of repodir from now on. lock is held by the
+ * callers of git_commit, committed is called with each new HEAD.
+ */
+void git_batch_start(const char *repodir, pthread_mutex_t *lock,
+        void (*committed)(const char *sha))
+{
+    batch.repodir = repodir;
+    batch.committed = committed;
+    batch.stop = false;
+    batch.lock = lock;
+    if (pthread_create(&batch.thread, NULL, committer, NULL) != 0)
+        batch.lock = NULL;
+}
+
+/* commits what is left and stops batching */
+void git_batch_stop(void)
+{
+    pthread_mutex_t *lock = batch.lock;
+
+    if (lock == NULL)
+        return;
+    pthread_mutex_lock(lock);
+    batch.stop = true;
+    pthread_cond_signal(&batch.cond);
+    pthread_mutex_unlock(lock);
+    pthread_join(batch.thread, NULL);
+    pthread_mutex_lock(lock);
+    commit_batch(batch.repodir);
+    batch.lock = NULL;
+    pthread_mutex_unlock(lock);
+}
+
+/* commits the batch now, with the lock of git_batch_start held */
+int git_commit_flush(const char *repodir)
+{
+    return commit_batch(repodir);
 }
 
 int git_commit(const char *repodir, const char *format, ...)
@@ -74,29 +386,104 @@ int git_commit(const char *repodir, const char *format, ...)
     va_list ap;
     size_t ARG_MAX;
     char *message;
+    int len;
 
     ARG_MAX = sysconf(_SC_ARG_MAX);
     message = malloc(ARG_MAX - 16);
 
     va_start(ap, format);
-    vsnprintf(message, ARG_MAX, format, ap);
+    len = vsnprintf(message, ARG_MAX - 16, format, ap);
     va_end(ap);
+    if (len >= (int) (ARG_MAX - 16))
+        len = ARG_MAX - 17;
 
-    chdir(repodir);
-    return fmt_system("git commit -m \"%s\"", message);
+    batch.messages = realloc(batch.messages, batch.len + len + 2);
+    memcpy(batch.messages + batch.len, message, len);
+    batch.len += len;
+    batch.messages[batch.len++] = '\n';
+    batch.messages[batch.len] = '\0';
+    free(message);
+    if (++batch.n == 1)
+        clock_gettime(CLOCK_REALTIME, &batch.since);
+
+    if (batch.lock == NULL)
+        return commit_batch(repodir);
+    if (batch.n == 1 || batch.n >= COMMIT_BATCH)
+        pthread_cond_signal(&batch.cond);
+    return 0;
 }
 
 int git_rm(const char *repodir, const char *path)
 {
-    chdir(repodir);
-    return fmt_system("git rm -- \"%s\"", path + strlen(repodir) + 1);
+    enqueue(repodir, path);
+    return 0;
 }
 
 int git_mv(const char *repodir, const char *old, const char *new)
+{
+    enqueue(repodir, old);
+    enqueue(repodir, new);
+    return 0;
+}
+
+/*
+ * Adds the paths listed (NUL separated, relative to repodir) in the file
+ * list to the index in a single run.
+ */
+int git_update_index(const char *repodir, const char *list)
 {
     chdir(repodir);
-    return fmt_system("git mv -- \"%s\" \"%s\"",
-            old + strlen(repodir) + 1, new + strlen(repodir) + 1);
+    return fmt_system("git update-index --add -z --stdin < \"%s\"", list);
+}
+
+/*
+ * Records in the location log the "key uuid 1" lines of the file list.
+ */
+int git_annex_setpresentkeys(const char *repodir, const char *list)
+{
+    chdir(repodir);
+    return fmt_system("git annex setpresentkey --batch < \"%s\"", list);
+}
+
+/*
+ * Records in the location log whether the repository of the given uuid
+ * has the content of key.
+ */
+int git_annex_setpresentkey(const char *repodir, const char *key,
+        const char *uuid, int present)
+{
+    chdir(repodir);
+    return fmt_system("git annex setpresentkey %s %s %d", key, uuid,
+            present ? 1 : 0);
+}
+
+/*
+ * Returns a stream giving, for each key of the file list, the path of its
+ * object relative to .git/annex/objects. To be closed with pclose().
+ */
+FILE *git_annex_objectpaths(const char *repodir, const char *list)
+{
+    char command[2 * FILENAME_MAX];
+    chdir(repodir);
+    snprintf(command, sizeof command, "git annex examinekey --batch "
+            "--format='${hashdirmixed}${key}/${key}\\n' < \"%s\"", list);
+    printf("%s\n", command);
+    return popen(command, "r");
+}
+
+int git_annex_uuid(const char *repodir, char uuid[64])
+{
+    FILE *out;
+    char *res;
+    chdir(repodir);
+    if ((out = popen("git config annex.uuid", "r")) == NULL)
+        return -1;
+    res = fgets(uuid, 64, out);
+    pclose(out);
+    if (res == NULL)
+        return -1;
+    uuid[strcspn(uuid, "\n")] = '\0';
+    return 0;
 }
 
 int git_annexed(const char *repodir, const char *path)
@@ -105,15 +492,74 @@ int git_annexed(const char *repodir, const char *path)
     char realpathbuf[FILENAME_MAX];
     char gitannexpathbuf[FILENAME_MAX];
     snprintf(gitannexpathbuf, FILENAME_MAX, "%s/.git/annex/objects", repodir);
-    if (lstat(path, &st) == -1)
-        perror(path);
-    if (!S_ISLNK(st.st_mode))
+    if (lstat(path, &st) == -1 || !S_ISLNK(st.st_mode))
         return 0;
+    /* the object of an annexed file may be absent: look at the link */
     if (realpath(path, realpathbuf) == NULL)
-        perror(path);
+        return git_annex_key(path, realpathbuf) == 0;
     return (strncmp(realpathbuf, gitannexpathbuf, strlen(gitannexpathbuf)) == 0);
 }
 
+/*
+ * Copies in key the name of the annex key path links to. Returns -1 if
+ * path is not a link to an annexed object.
+ */
+int git_annex_key(const char *path, char key[FILENAME_MAX])
+{
+    char target[FILENAME_MAX], *p;
+    ssize_t len;
+
+    if ((len = readlink(path, target, FILENAME_MAX - 1)) == -1)
+        return -1;
+    target[len] = '\0';
+    if (!strstr(target, ".git/annex/objects/"))
+        return -1;
+    if ((p = strrchr(target, '/')) == NULL)
+        return -1;
+    snprintf(key, FILENAME_MAX, "%s", p + 1);
+    return 0;
+}
+
+/*
+ * Size recorded in a key (BACKEND-sSIZE-...--NAME), -1 if it has none.
+ */
+off_t git_annex_keysize(const char *key)
+{
+    const char *p, *end;
+
+    if ((end = strstr(key, "--")) == NULL)
+        return -1;
+    for (p = strchr(key, '-'); p != NULL && p < end; p = strchr(p + 1, '-'))
+        if (p[1] == 's')
+            return strtoll(p + 2, NULL, 10);
+    return -1;
+}
+
+/*
+ * Builds the SHA256E key of a file, the default backend of git annex: the
+ * hash is followed by the extensions of the file name (at most two, of at
+ * most four alphanumeric characters each).
+ */
+void git_annex_mkkey(char key[FILENAME_MAX], const char *path, off_t size,
+        const char *sha256)
+{
+    const char *name, *ext, *p;
+    int n;
+
+    name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    ext = name + strlen(name);
+    for (n = 0; n < 2; n++) {
+        for (p = ext - 1; p > name && *p != '.' && ext - p <= 5; p--)
+            if (!isalnum((unsigned char) *p))
+                break;
+        if (p <= name || *p != '.' || p == ext - 1)
+            break;
+        ext = p;
+    }
+    snprintf(key, FILENAME_MAX, "SHA256E-s%lld--%s%s",
+            (long long) size, sha256, ext);
+}
+
 int git_ignored(const char *repodir, const char *path)
 {
     FILE *pipe;
@@ -252,3 +698,708 @@ void target(char target[FILENAME_MAX], const char *repodir,
     target[res] = '\0';
     fmt_system("git checkout master");
 }
+
+/*
+ * Peers
+ */
+
+/* whether url can be reached as a git repository (0 if it can) */
+int git_reachable(const char *url)
+{
+    return fmt_system("GIT_TERMINAL_PROMPT=0 git ls-remote -q \"%s\" "
+            "> /dev/null 2>&1", url);
+}
+
+/*
+ * Makes url the remote name, fetching ref (a branch of it, or HEAD) into
+ * refs/remotes/<name>/sharebox.
+ */
+int git_remote_set(const char *repodir, const char *name, const char *url,
+        const char *ref)
+{
+    int res;
+    chdir(repodir);
+    fmt_system("git remote remove \"%s\" 2> /dev/null", name);
+    res = fmt_system("git remote add \"%s\" \"%s\"", name, url);
+    if (res == 0)
+        res = fmt_system("git config remote.\"%s\".fetch "
+                "\"+%s:refs/remotes/%s/sharebox\"", name, ref, name);
+    /* a local repository tells its uuid without git-annex contacting it */
+    if (res == 0)
+        fmt_system("uuid=$(git -C \"%s\" config annex.uuid 2> /dev/null) "
+                "&& git config remote.\"%s\".annex-uuid \"$uuid\"",
+                url, name);
+    return res;
+}
+
+int git_remote_remove(const char *repodir, const char *name)
+{
+    chdir(repodir);
+    return fmt_system("git remote remove \"%s\"", name);
+}
+
+/*
+ * Fetches what the remote name has that we do not, along with its
+ * git-annex branch when it has one.
+ */
+int git_fetch(const char *repodir, const char *name)
+{
+    int res;
+    chdir(repodir);
+    res = fmt_system("GIT_TERMINAL_PROMPT=0 git fetch -q \"%s\"", name);
+    if (res == 0)
+        fmt_system("GIT_TERMINAL_PROMPT=0 git fetch -q \"%s\" "
+                "+refs/heads/git-annex:refs/remotes/%s/git-annex "
+                "2> /dev/null", name, name);
+    return res;
+}
+
+/* the commit ref points to, -1 if there is none */
+int git_rev_parse(const char *repodir, const char *ref, char sha[41])
+{
+    char command[FILENAME_MAX + 64];
+    FILE *out;
+    char *res;
+
+    chdir(repodir);
+    snprintf(command, sizeof command,
+            "git rev-parse -q --verify \"%s^{commit}\"", ref);
+    if ((out = popen(command, "r")) == NULL)
+        return -1;
+    res = fgets(sha, 41, out);
+    pclose(out);
+    if (res == NULL || strlen(sha) != 40)
+        return -1;
+    return 0;
+}
+
+/* merges the git-annex branches of the remotes into ours */
+int git_annex_merge(const char *repodir)
+{
+    chdir(repodir);
+    return fmt_system("git annex merge");
+}
+
+/*
+ * Writes to list, one per line, the keys that the links added or changed
+ * between the commits from and to point to (all those of to when from is
+ * NULL). Returns how many, -1 on failure.
+ */
+long git_added_keys(const char *repodir, const char *from, const char *to,
+        FILE *list)
+{
+    char command[512], header[256], *target, *key;
+    unsigned long size;
+    FILE *out;
+    long n;
+
+    chdir(repodir);
+    if (from)
+        snprintf(command, sizeof command, "git diff-tree -r --no-renames "
+                "--diff-filter=AMT %s %s | awk '$2 == \"120000\" "
+                "{ print $4 }' | git cat-file --batch", from, to);
+    else
+        snprintf(command, sizeof command, "git ls-tree -r %s | "
+                "awk '$1 == \"120000\" { print $3 }' | git cat-file --batch",
+                to);
+    if ((out = popen(command, "r")) == NULL)
+        return -1;
+    n = 0;
+    target = malloc(FILENAME_MAX);
+    while (fgets(header, sizeof header, out) != NULL) {
+        if (sscanf(header, "%*s blob %lu", &size) != 1)
+            continue;
+        if (size >= FILENAME_MAX) {
+            while (size-- > 0 && getc(out) != EOF)
+                ;
+            getc(out);
+            continue;
+        }
+        if (fread(target, 1, size, out) != size)
+            break;
+        target[size] = '\0';
+        getc(out);  /* the newline after the content */
+        if (strstr(target, ".git/annex/objects/") == NULL
+                || (key = strrchr(target, '/')) == NULL)
+            continue;
+        fprintf(list, "%s\n", key + 1);
+        n++;
+    }
+    free(target);
+    if (pclose(out) != 0)
+        return -1;
+    return n;
+}
+
+/* gets the content of key from the remote name */
+int git_annex_get_key(const char *repodir, const char *key, const char *name)
+{
+    chdir(repodir);
+    return fmt_system("git annex get --key=\"%s\" --from=\"%s\"", key, name);
+}
+
+/*
+ * Calls found with the key and the content of each location log of the
+ * git-annex branch added or changed between the commits from and to (all
+ * those of to when from is NULL). Returns how many, -1 on failure.
+ */
+long git_location_logs(const char *repodir, const char *from, const char *to,
+        void (*found)(const char *key, char *log, void *arg), void *arg)
+{
+    char command[512], header[FILENAME_MAX + 64], *path, *log, *key;
+    unsigned long size;
+    FILE *out;
+    long n;
+
+    chdir(repodir);
+    /* location logs are aaa/bbb/KEY.log, other logs are named otherwise */
+    if (from)
+        snprintf(command, sizeof command, "git diff-tree -r --no-renames "
+                "--diff-filter=AM %s %s | awk -F '\\t' "
+                "'$2 ~ /\\/[^\\/]*\\.log$/ { split($1, m, \" \"); "
+                "print m[4], $2 }' | git cat-file "
+                "--batch='%%(objecttype) %%(objectsize) %%(rest)'", from, to);
+    else
+        snprintf(command, sizeof command, "git ls-tree -r %s | awk -F '\\t' "
+                "'$2 ~ /\\/[^\\/]*\\.log$/ { split($1, m, \" \"); "
+                "print m[3], $2 }' | git cat-file "
+                "--batch='%%(objecttype) %%(objectsize) %%(rest)'", to);
+    if ((out = popen(command, "r")) == NULL)
+        return -1;
+    n = 0;
+    path = malloc(FILENAME_MAX);
+    while (fgets(header, sizeof header, out) != NULL) {
+        if (sscanf(header, "blob %lu %s", &size, path) != 2)
+            continue;
+        if ((log = malloc(size + 1)) == NULL || fread(log, 1, size, out)
+                != size) {
+            free(log);
+            break;
+        }
+        log[size] = '\0';
+        getc(out);  /* the newline after the content */
+        key = (key = strrchr(path, '/')) ? key + 1 : path;
+        key[strlen(key) - strlen(".log")] = '\0';
+        found(key, log, arg);
+        free(log);
+        n++;
+    }
+    free(path);
+    if (pclose(out) != 0)
+        return -1;
+    return n;
+}
+
+/*
+ * Calls found with the name and the annex uuid of each remote git-annex
+ * knows the uuid of.
+ */
+int git_remote_uuids(const char *repodir,
+        void (*found)(const char *name, const char *uuid, void *arg),
+        void *arg)
+{
+    char line[FILENAME_MAX + 64], *name, *uuid, *end;
+    FILE *out;
+
+    chdir(repodir);
+    if ((out = popen("git config --get-regexp '^remote\\..*\\.annex-uuid$'",
+                    "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof line, out) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((uuid = strrchr(line, ' ')) == NULL)
+            continue;
+        *uuid++ = '\0';
+        name = line + strlen("remote.");
+        if ((end = strstr(name, ".annex-uuid")) == NULL)
+            continue;
+        *end = '\0';
+        found(name, uuid, arg);
+    }
+    pclose(out);
+    return 0;
+}
+
+/*
+ * The commit HEAD points to, read from the refs without running git. -1
+ * before the first commit.
+ */
+int git_head(const char *repodir, char sha[41])
+{
+    char path[FILENAME_MAX], line[FILENAME_MAX], ref[FILENAME_MAX];
+    FILE *f;
+    int res;
+
+    if (snprintf(path, FILENAME_MAX, "%s/.git/HEAD", repodir) >= FILENAME_MAX
+            || (f = fopen(path, "r")) == NULL)
+        return -1;
+    res = fgets(line, sizeof line, f) ? 0 : -1;
+    fclose(f);
+    if (res == -1)
+        return -1;
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: ", 5) != 0) {
+        /* detached */
+        if (strlen(line) != 40)
+            return -1;
+        memcpy(sha, line, 41);
+        return 0;
+    }
+    snprintf(ref, FILENAME_MAX, "%s", line + 5);
+
+    if (snprintf(path, FILENAME_MAX, "%s/.git/%s", repodir, ref)
+            >= FILENAME_MAX)
+        return -1;
+    if ((f = fopen(path, "r")) != NULL) {
+        res = fscanf(f, "%40s", sha) == 1 ? 0 : -1;
+        fclose(f);
+        return res;
+    }
+    /* lines of "sha ref" once git packed it */
+    snprintf(path, FILENAME_MAX, "%s/.git/packed-refs", repodir);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    res = -1;
+    while (res == -1 && fgets(line, sizeof line, f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line) > 41 && strcmp(line + 41, ref) == 0) {
+            memcpy(sha, line, 40);
+            sha[40] = '\0';
+            res = 0;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+/*
+ * Merges
+ *
+ * A merge is computed in an index of its own, MERGE_INDEX, rather than in
+ * the worktree and the index of the filesystem: nothing the filesystem
+ * sees changes until the result is applied (see merge.c).
+ */
+
+#define MERGE_INDEX ".git/sharebox/merge.index"
+#define HEAD_INDEX  ".git/sharebox/head.index"
+#define EMPTY_TREE "4b825dc642cb6eb9a060e54bf8d69288fbee4904"
+#define NULL_SHA "0000000000000000000000000000000000000000"
+
+typedef struct conflict conflict;
+struct conflict
+{
+    char path[FILENAME_MAX];
+    char ours[48];      /* "mode sha", empty when ours has no such path */
+    char theirs[48];
+};
+
+/* reads the sha command prints, -1 if it prints none or fails */
+static int read_sha(const char *command, char sha[41])
+{
+    FILE *out;
+    char *res;
+
+    printf("%s\n", command);
+    if ((out = popen(command, "r")) == NULL)
+        return -1;
+    res = fgets(sha, 41, out);
+    if (pclose(out) != 0 || res == NULL || strlen(sha) != 40)
+        return -1;
+    return 0;
+}
+
+/* the best common ancestor of the commits a and b, -1 if they have none */
+int git_merge_base(const char *repodir, const char *a, const char *b,
+        char sha[41])
+{
+    char command[128];
+    chdir(repodir);
+    snprintf(command, sizeof command, "git merge-base %s %s", a, b);
+    return read_sha(command, sha);
+}
+
+/* .<peer>.<name>.conflict, next to path */
+static void conflict_name(char name[FILENAME_MAX], const char *path,
+        const char *peer)
+{
+    const char *base;
+
+    base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    snprintf(name, FILENAME_MAX, "%.*s.%s.%s.conflict", (int) (base - path),
+            path, peer, base);
+}
+
+/*
+ * Entry ("mode sha") that command gives for a single path, empty if there
+ * is none. ls-tree puts the type of the entry between the mode and the
+ * sha (typed), ls-files -s does not.
+ */
+static void read_entry(const char *command, int typed, char entry[48])
+{
+    char line[FILENAME_MAX + 64], mode[7], sha[41];
+    FILE *out;
+    int res;
+
+    entry[0] = '\0';
+    if ((out = popen(command, "r")) == NULL)
+        return;
+    if (fgets(line, sizeof line, out) != NULL) {
+        if (typed)
+            res = sscanf(line, "%6s %*s %40s", mode, sha);
+        else
+            res = sscanf(line, "%6s %40s", mode, sha);
+        if (res == 2)
+            snprintf(entry, 48, "%s %s", mode, sha);
+    }
+    pclose(out);
+}
+
+/*
+ * Puts ours at the path of each conflict and theirs next to it, or theirs
+ * at the path when ours has nothing there and !keep.
+ */
+static int resolve(conflict *c, size_t n, const char *peer, int keep)
+{
+    char name[FILENAME_MAX];
+    FILE *in;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    if ((in = popen("GIT_INDEX_FILE=" MERGE_INDEX " "
+                    "git update-index -z --index-info", "w")) == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        /* drops every stage of the path */
+        fprintf(in, "0 " NULL_SHA "\t%s%c", c[i].path, '\0');
+        if (c[i].ours[0])
+            fprintf(in, "%s 0\t%s%c", c[i].ours, c[i].path, '\0');
+        if (c[i].theirs[0] && (c[i].ours[0] || keep)) {
+            conflict_name(name, c[i].path, peer);
+            printf("conflict: %s kept, theirs is %s\n", c[i].path, name);
+            fprintf(in, "%s 0\t%s%c", c[i].theirs, name, '\0');
+        } else if (c[i].theirs[0])
+            fprintf(in, "%s 0\t%s%c", c[i].theirs, c[i].path, '\0');
+    }
+    return pclose(in);
+}
+
+/* the paths that read-tree could not merge, with the side of each */
+static conflict *unmerged(size_t *n)
+{
+    char *record, mode[7], sha[41], *path;
+    conflict *c;
+    size_t size, cap;
+    FILE *out;
+    int stage;
+
+    *n = cap = 0;
+    c = NULL;
+    if ((out = popen("GIT_INDEX_FILE=" MERGE_INDEX " git ls-files -u -z",
+                    "r")) == NULL)
+        return NULL;
+    record = NULL;
+    size = 0;
+    while (getdelim(&record, &size, '\0', out) > 0) {
+        if (sscanf(record, "%6s %40s %d", mode, sha, &stage) != 3
+                || (path = strchr(record, '\t')) == NULL)
+            continue;
+        path++;
+        /* the stages of a path come one after another */
+        if (*n == 0 || strcmp(c[*n - 1].path, path) != 0) {
+            if (*n == cap) {
+                cap = cap ? 2 * cap : 16;
+                c = realloc(c, cap * sizeof(conflict));
+            }
+            memset(&c[*n], 0, sizeof(conflict));
+            snprintf(c[*n].path, FILENAME_MAX, "%s", path);
+            (*n)++;
+        }
+        if (stage == 2)
+            snprintf(c[*n - 1].ours, 48, "%s %s", mode, sha);
+        else if (stage == 3)
+            snprintf(c[*n - 1].theirs, 48, "%s %s", mode, sha);
+    }
+    free(record);
+    pclose(out);
+    return c;
+}
+
+/*
+ * Merges the commits ours and theirs (of the peer named peer) from their
+ * common ancestor base (NULL when they have none) into tree, without the
+ * worktree. Paths that both changed keep ours, theirs going next to them
+ * as .<peer>.<name>.conflict; so do the keep paths (those the worktree
+ * has changes to that were not committed yet) that theirs changed.
+ */
+int git_merge_trees(const char *repodir, const char *base, const char *ours,
+        const char *theirs, const char *peer, char **keep, size_t nkeep,
+        char tree[41])
+{
+    char command[FILENAME_MAX + 128], merged[48];
+    conflict *c;
+    size_t n, i;
+    int res;
+
+    chdir(repodir);
+    unlink(MERGE_INDEX);
+    res = fmt_system("GIT_INDEX_FILE=" MERGE_INDEX " git read-tree -i -m "
+            "--aggressive %s %s %s", base ? base : EMPTY_TREE, ours, theirs);
+    if (res != 0)
+        goto out;
+
+    c = unmerged(&n);
+    res = resolve(c, n, peer, 0);
+    free(c);
+    if (res != 0)
+        goto out;
+
+    c = malloc((nkeep ? nkeep : 1) * sizeof(conflict));
+    for (i = n = 0; i < nkeep; i++) {
+        snprintf(command, sizeof command, "GIT_INDEX_FILE=" MERGE_INDEX " "
+                "git ls-files -s -z -- \":(literal)%s\"", keep[i]);
+        read_entry(command, 0, merged);
+        snprintf(command, sizeof command,
+                "git ls-tree -z %s -- \"%s\"", ours, keep[i]);
+        read_entry(command, 1, c[n].ours);
+        if (strcmp(merged, c[n].ours) == 0)
+            continue;
+        snprintf(c[n].path, FILENAME_MAX, "%s", keep[i]);
+        strcpy(c[n].theirs, merged);
+        n++;
+    }
+    res = resolve(c, n, peer, 1);
+    free(c);
+    if (res != 0)
+        goto out;
+
+    res = read_sha("GIT_INDEX_FILE=" MERGE_INDEX " git write-tree", tree);
+out:
+    unlink(MERGE_INDEX);
+    return res == 0 ? 0 : -1;
+}
+
+/* commits tree as the merge of the commits a and b */
+int git_commit_tree(const char *repodir, const char *tree, const char *a,
+        const char *b, const char *message, char sha[41])
+{
+    char command[FILENAME_MAX + 256];
+    chdir(repodir);
+    snprintf(command, sizeof command,
+            "git commit-tree %s -p %s -p %s -m \"%s\"", tree, a, b, message);
+    return read_sha(command, sha);
+}
+
+/* writes the content of a blob of the given mode to a new file of tmpdir */
+static int checkout_blob(FILE *in, unsigned long size, unsigned mode,
+        const char *tmpdir, char tmp[FILENAME_MAX])
+{
+    char buf[BUFSIZ], *target;
+    size_t chunk;
+    int fd, res;
+
+    snprintf(tmp, FILENAME_MAX, "%s/blob.XXXXXX", tmpdir);
+    if ((fd = mkstemp(tmp)) == -1)
+        return -1;
+    res = 0;
+    if (mode == 0120000) {
+        close(fd);
+        unlink(tmp);
+        target = malloc(size + 1);
+        if (fread(target, 1, size, in) != size)
+            res = -1;
+        target[size] = '\0';
+        if (res == 0)
+            res = symlink(target, tmp);
+        free(target);
+        return res;
+    }
+    while (size > 0) {
+        chunk = size < sizeof buf ? size : sizeof buf;
+        if (fread(buf, 1, chunk, in) != chunk
+                || write(fd, buf, chunk) != (ssize_t) chunk) {
+            res = -1;
+            break;
+        }
+        size -= chunk;
+    }
+    if (res == 0)
+        res = fchmod(fd, mode & 0111 ? 0755 : 0644);
+    if (close(fd) == -1)
+        res = -1;
+    if (res == -1)
+        unlink(tmp);
+    return res;
+}
+
+/*
+ * Calls found with each path (relative to repodir) that differs between
+ * the commits from and to, its status (A, M, D or T), and, unless it was
+ * removed, a file of tmpdir with its content in to, ready to be renamed
+ * over it. Returns how many, -1 on failure.
+ */
+long git_tree_changes(const char *repodir, const char *from, const char *to,
+        const char *tmpdir,
+        void (*found)(char status, const char *path, const char *tmp,
+            void *arg), void *arg)
+{
+    typedef struct { char status; unsigned mode; char *path; } entry;
+    char command[FILENAME_MAX + 128], header[128], list[FILENAME_MAX];
+    char tmp[FILENAME_MAX], *record, sha[41], status;
+    unsigned long bytes;
+    unsigned mode;
+    size_t size, n, cap, i;
+    entry *e;
+    FILE *out, *shas;
+    long res;
+
+    chdir(repodir);
+    snprintf(command, sizeof command,
+            "git diff-tree -r -z --no-renames %s %s", from, to);
+    snprintf(list, FILENAME_MAX, "%s/blobs", tmpdir);
+    if ((shas = fopen(list, "w")) == NULL)
+        return -1;
+    if ((out = popen(command, "r")) == NULL) {
+        fclose(shas);
+        return -1;
+    }
+    /* ":oldmode newmode oldsha newsha status" then the path */
+    e = NULL;
+    n = cap = size = 0;
+    record = NULL;
+    while (getdelim(&record, &size, '\0', out) > 0) {
+        if (sscanf(record, ":%*o %o %*s %40s %c", &mode, sha, &status) != 3
+                || getdelim(&record, &size, '\0', out) <= 0)
+            break;
+        /* submodules have no content here */
+        if (mode == 0160000)
+            continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            e = realloc(e, cap * sizeof(entry));
+        }
+        e[n].status = status;
+        e[n].mode = mode;
+        e[n].path = strdup(record);
+        if (status != 'D')
+            fprintf(shas, "%s\n", sha);
+        n++;
+    }
+    free(record);
+    res = pclose(out) == 0 ? 0 : -1;
+    if (fclose(shas) != 0)
+        res = -1;
+
+    /* the contents come in the order of the list */
+    out = NULL;
+    snprintf(command, sizeof command, "git cat-file --batch < \"%s\"", list);
+    if (res == 0 && (out = popen(command, "r")) == NULL)
+        res = -1;
+    for (i = 0; res == 0 && i < n; i++) {
+        if (e[i].status == 'D') {
+            found('D', e[i].path, NULL, arg);
+            continue;
+        }
+        if (fgets(header, sizeof header, out) == NULL
+                || sscanf(header, "%*s blob %lu", &bytes) != 1
+                || checkout_blob(out, bytes, e[i].mode, tmpdir, tmp) == -1) {
+            res = -1;
+            break;
+        }
+        getc(out);  /* the newline after the content */
+        found(e[i].status, e[i].path, tmp, arg);
+    }
+    if (out && pclose(out) != 0)
+        res = -1;
+    unlink(list);
+    for (i = 0; i < n; i++)
+        free(e[i].path);
+    free(e);
+    return res == 0 ? (long) n : -1;
+}
+
+/*
+ * Calls found with those of the n paths (relative to repodir) that the
+ * worktree changed since the index. Returns how many, -1 on failure.
+ */
+long git_dirty_paths(const char *repodir, char **paths, size_t n,
+        void (*found)(const char *path, void *arg), void *arg)
+{
+    size_t ARG_MAX, len, i, size;
+    char *command, *name;
+    long count;
+    FILE *out;
+
+    chdir(repodir);
+    ARG_MAX = sysconf(_SC_ARG_MAX);
+    command = malloc(ARG_MAX);
+    len = snprintf(command, ARG_MAX,
+            "git --literal-pathspecs diff-files -z --name-only --");
+    for (i = 0; i < n && len < ARG_MAX; i++)
+        len += snprintf(command + len, len < ARG_MAX ? ARG_MAX - len : 0,
+                " \"%s\"", paths[i]);
+    /* too many for a command line: look at them all */
+    if (len >= ARG_MAX)
+        snprintf(command, ARG_MAX, "git diff-files -z --name-only");
+    count = -1;
+    if ((out = popen(command, "r")) != NULL) {
+        count = 0;
+        name = NULL;
+        size = 0;
+        while (getdelim(&name, &size, '\0', out) > 0) {
+            found(name, arg);
+            count++;
+        }
+        free(name);
+        if (pclose(out) != 0)
+            count = -1;
+    }
+    free(command);
+    return count;
+}
+
+/*
+ * Moves the index and HEAD from the commit from to the commit to, once
+ * the worktree was brought to it, the n paths (relative to repodir) being
+ * those that changed. Fails if HEAD is not at from. The new index is
+ * built in a copy, HEAD_INDEX, which replaces the index once HEAD moved:
+ * on failure neither of them changed.
+ */
+int git_move_head(const char *repodir, const char *from, const char *to,
+        char **paths, size_t n)
+{
+    FILE *in;
+    size_t i;
+    int res;
+
+    chdir(repodir);
+    res = fmt_system("cp -p .git/index " HEAD_INDEX);
+    /* the entries that did not change keep what they know of the files */
+    if (res == 0)
+        res = fmt_system("GIT_INDEX_FILE=" HEAD_INDEX " git read-tree -i -m "
+                "%s %s", from, to);
+    /* the others are brought up to date with the files */
+    if (res == 0 && n > 0) {
+        if ((in = popen("GIT_INDEX_FILE=" HEAD_INDEX " git -c "
+                        "annex.gitaddtoannex=false update-index --add "
+                        "--remove -z --stdin", "w")) == NULL) {
+            unlink(HEAD_INDEX);
+            return -1;
+        }
+        for (i = 0; i < n; i++)
+            fwrite(paths[i], 1, strlen(paths[i]) + 1, in);
+        res = pclose(in);
+    }
+    if (res == 0)
+        res = fmt_system("git update-ref -m \"merge %s\" HEAD %s %s",
+                to, to, from);
+    if (res == 0 && rename(HEAD_INDEX, ".git/index") == -1) {
+        /* HEAD goes back to the index it had */
+        fmt_system("git update-ref -m \"undo merge %s\" HEAD %s %s",
+                to, from, to);
+        res = -1;
+    }
+    if (res != 0)
+        unlink(HEAD_INDEX);
+    return res;
+}
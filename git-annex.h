@@ -2,17 +2,69 @@
  * git-annex.h
  */
 
+#ifndef __GIT_ANNEX_H__
+#define __GIT_ANNEX_H__
+
 #include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 int git_annex_unlock(const char *repodir, const char *path);
+int git_annex_unlock_empty(const char *repodir, const char *path);
 int git_annex_add(const char *repodir, const char *path);
+int git_annex_setkey(const char *repodir, const char *path, const char *key);
 int git_annex_get(const char *repodir, const char *path, const char *branch);
 int git_add(const char *repodir, const char *path);
 int git_commit(const char *repodir, const char *format, ...);
+int git_commit_flush(const char *repodir);
+void git_batch_start(const char *repodir, pthread_mutex_t *lock,
+        void (*committed)(const char *sha));
+void git_batch_stop(void);
 int git_rm(const char *repodir, const char *path);
 int git_mv(const char *repodir, const char *old, const char *new);
+int git_update_index(const char *repodir, const char *list);
+int git_annex_setpresentkeys(const char *repodir, const char *list);
+int git_annex_setpresentkey(const char *repodir, const char *key,
+        const char *uuid, int present);
+FILE *git_annex_objectpaths(const char *repodir, const char *list);
+int git_annex_uuid(const char *repodir, char uuid[64]);
+int git_reachable(const char *url);
+int git_remote_set(const char *repodir, const char *name, const char *url,
+        const char *ref);
+int git_remote_remove(const char *repodir, const char *name);
+int git_fetch(const char *repodir, const char *name);
+int git_rev_parse(const char *repodir, const char *ref, char sha[41]);
+int git_head(const char *repodir, char sha[41]);
+int git_merge_base(const char *repodir, const char *a, const char *b,
+        char sha[41]);
+int git_merge_trees(const char *repodir, const char *base, const char *ours,
+        const char *theirs, const char *peer, char **keep, size_t nkeep,
+        char tree[41]);
+int git_commit_tree(const char *repodir, const char *tree, const char *a,
+        const char *b, const char *message, char sha[41]);
+long git_tree_changes(const char *repodir, const char *from, const char *to,
+        const char *tmpdir,
+        void (*found)(char status, const char *path, const char *tmp,
+            void *arg), void *arg);
+long git_dirty_paths(const char *repodir, char **paths, size_t n,
+        void (*found)(const char *path, void *arg), void *arg);
+int git_move_head(const char *repodir, const char *from, const char *to,
+        char **paths, size_t n);
+int git_annex_merge(const char *repodir);
+long git_added_keys(const char *repodir, const char *from, const char *to,
+        FILE *list);
+int git_annex_get_key(const char *repodir, const char *key, const char *name);
+long git_location_logs(const char *repodir, const char *from, const char *to,
+        void (*found)(const char *key, char *log, void *arg), void *arg);
+int git_remote_uuids(const char *repodir,
+        void (*found)(const char *name, const char *uuid, void *arg),
+        void *arg);
 int git_annexed(const char *repodir, const char *path);
 int git_ignored(const char *repodir, const char *path);
+int git_annex_key(const char *path, char key[FILENAME_MAX]);
+off_t git_annex_keysize(const char *key);
+void git_annex_mkkey(char key[FILENAME_MAX], const char *path, off_t size,
+        const char *sha256);
 
 typedef struct namelist namelist;
 struct namelist {
@@ -26,3 +78,5 @@ namelist* conflicting_files(const char *repodir, const char *path,
 void free_namelist(namelist *l);
 void target(char target[FILENAME_MAX], const char *repodir,
         const char *path, const char *branch);
+
+#endif /* __GIT_ANNEX_H__ */
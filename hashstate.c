@@ -0,0 +1,319 @@
+/*
+ * Saved hash states of annexed files
+ *
+ * Logs and growing datasets are only ever appended to. When such a file
+ * is committed under a key we hashed ourselves, the SHA-256 state reached
+ * at its end is saved here, so that the next session that only appends to
+ * it starts from that state instead of hashing the whole file again.
+ *
+ * States are appended to .git/sharebox/hashstates as lines of
+ * "key count state pending<TAB>path" (hexadecimal), the last line for a
+ * key wins. A state is only worth keeping for the current content of a
+ * file: saving the state of a path drops the one it had under its
+ * previous key, and a line of "-<TAB>path" drops the state of a removed
+ * path. The log is rewritten once it has twice as many lines as states.
+ */
+
+#include "hashstate.h"
+
+#include <sys/stat.h>
+
+#define HASHSTATE_MIN     (1 << 20)   /* smaller files are cheap to rehash */
+#define HASHSTATE_BUCKETS 4096
+#define HASHSTATE_SLACK   64          /* lines before compacting at all */
+
+typedef struct entry entry;
+struct entry
+{
+    char *key;
+    char *path;         /* relative to the repository, "" if unknown */
+    sha256 ctx;
+    entry *next;
+};
+
+static struct {
+    char path[FILENAME_MAX];
+    size_t prefix;                  /* length of the repository path */
+    entry *buckets[HASHSTATE_BUCKETS];
+    size_t entries, lines;
+    pthread_mutex_t lock;
+} hs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned long hash(const char *key)
+{
+    unsigned long h = 5381;
+    for (; *key; key++)
+        h = h * 33 + (unsigned char) *key;
+    return h % HASHSTATE_BUCKETS;
+}
+
+static entry *lookup(const char *key)
+{
+    entry *e;
+    for (e = hs.buckets[hash(key)]; e != NULL; e = e->next)
+        if (strcmp(e->key, key) == 0)
+            return e;
+    return NULL;
+}
+
+/*
+ * Drops the states of path, and of what is under it when under is set,
+ * but the one of key (NULL for none).
+ */
+static void drop(const char *path, bool under, const char *key)
+{
+    entry **p, *e;
+    size_t len;
+    int i;
+
+    len = strlen(path);
+    for (i = 0; i < HASHSTATE_BUCKETS; i++) {
+        for (p = &hs.buckets[i]; (e = *p) != NULL; ) {
+            if ((strcmp(e->path, path) == 0 || (under
+                            && strncmp(e->path, path, len) == 0
+                            && e->path[len] == '/'))
+                    && (key == NULL || strcmp(e->key, key) != 0)) {
+                *p = e->next;
+                free(e->key);
+                free(e->path);
+                free(e);
+                hs.entries--;
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+}
+
+static void insert(const char *key, const char *path, const sha256 *ctx)
+{
+    entry *e;
+
+    /* the previous content of path will not be appended to */
+    if (path[0])
+        drop(path, false, key);
+    if ((e = lookup(key)) == NULL) {
+        e = malloc(sizeof(entry));
+        e->key = strdup(key);
+        e->path = NULL;
+        e->next = hs.buckets[hash(key)];
+        hs.buckets[hash(key)] = e;
+        hs.entries++;
+    }
+    free(e->path);
+    e->path = strdup(path);
+    e->ctx = *ctx;
+}
+
+static void write_line(FILE *f, const char *key, const char *path,
+        const sha256 *ctx)
+{
+    int i;
+    fprintf(f, "%s %llx ", key, (unsigned long long) ctx->count);
+    for (i = 0; i < 8; i++)
+        fprintf(f, "%08x", ctx->state[i]);
+    fputc(' ', f);
+    for (i = 0; i < (int) (ctx->count % 64); i++)
+        fprintf(f, "%02x", ctx->buf[i]);
+    fprintf(f, " \t%s\n", path);
+}
+
+static int parse_line(char *line, char **key, char **path, sha256 *ctx)
+{
+    char *count, *state, *pending, *tab;
+    unsigned int byte;
+    int i;
+
+    /* lines written before paths were kept have none */
+    *path = "";
+    if ((tab = strchr(line, '\t')) != NULL) {
+        *tab = '\0';
+        *path = tab + 1;
+        (*path)[strcspn(*path, "\n")] = '\0';
+    }
+    if (!(*key = strtok(line, " ")) || !(count = strtok(NULL, " "))
+            || !(state = strtok(NULL, " ")) || strlen(state) != 64)
+        return -1;
+    pending = strtok(NULL, " \n");
+    ctx->count = strtoull(count, NULL, 16);
+    for (i = 0; i < 8; i++)
+        if (sscanf(state + 8 * i, "%8x", &ctx->state[i]) != 1)
+            return -1;
+    for (i = 0; i < (int) (ctx->count % 64); i++)
+        if (!pending || sscanf(pending + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        else
+            ctx->buf[i] = byte;
+    return 0;
+}
+
+/* rewrites the log with one line per key */
+static void compact(void)
+{
+    char tmp[FILENAME_MAX + 8];
+    entry *e;
+    FILE *f;
+    int i;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", hs.path);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return;
+    for (i = 0; i < HASHSTATE_BUCKETS; i++)
+        for (e = hs.buckets[i]; e != NULL; e = e->next)
+            write_line(f, e->key, e->path, &e->ctx);
+    if (fclose(f) == 0 && rename(tmp, hs.path) == 0)
+        hs.lines = hs.entries;
+}
+
+/* appends line to the log, compacting it when it grew too long */
+static void append(const char *key, const char *path, const sha256 *ctx)
+{
+    FILE *f;
+
+    if (hs.lines + 1 > 2 * hs.entries + HASHSTATE_SLACK) {
+        compact();
+        return;
+    }
+    if ((f = fopen(hs.path, "a")) == NULL)
+        return;
+    if (key)
+        write_line(f, key, path, ctx);
+    else
+        fprintf(f, "-\t%s\n", path);
+    fclose(f);
+    hs.lines++;
+}
+
+/*
+ * Path relative to the repository, "" if fpath is not in it (hs.path
+ * starts with the path of the repository).
+ */
+static const char *relative(const char *fpath)
+{
+    if (strncmp(fpath, hs.path, hs.prefix) != 0 || fpath[hs.prefix] != '/')
+        return "";
+    return fpath + hs.prefix + 1;
+}
+
+void hashstate_init(const char *repodir)
+{
+    char line[2 * FILENAME_MAX + 256], *key, *path;
+    sha256 ctx;
+    FILE *f;
+
+    hs.prefix = strlen(repodir);
+    snprintf(hs.path, FILENAME_MAX, "%s/.git/sharebox", repodir);
+    mkdir(hs.path, 0755);
+    strncat(hs.path, "/hashstates", FILENAME_MAX - strlen(hs.path) - 1);
+
+    if ((f = fopen(hs.path, "r")) == NULL)
+        return;
+    while (fgets(line, sizeof line, f) != NULL) {
+        hs.lines++;
+        if (strncmp(line, "-\t", 2) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            drop(line + 2, true, NULL);
+        } else if (parse_line(line, &key, &path, &ctx) == 0)
+            insert(key, path, &ctx);
+    }
+    fclose(f);
+    if (hs.lines > 2 * hs.entries + HASHSTATE_SLACK)
+        compact();
+}
+
+void hashstate_destroy(void)
+{
+    entry *e, *next;
+    int i;
+
+    for (i = 0; i < HASHSTATE_BUCKETS; i++) {
+        for (e = hs.buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->key);
+            free(e->path);
+            free(e);
+        }
+        hs.buckets[i] = NULL;
+    }
+    hs.entries = hs.lines = 0;
+}
+
+/*
+ * Gets the state reached at the end of the content of key. Returns -1 if
+ * none was saved.
+ */
+int hashstate_load(const char *key, sha256 *ctx)
+{
+    entry *e;
+    pthread_mutex_lock(&hs.lock);
+    if ((e = lookup(key)) != NULL)
+        *ctx = e->ctx;
+    pthread_mutex_unlock(&hs.lock);
+    return e ? 0 : -1;
+}
+
+/* Saves the state reached at the end of fpath, committed under key */
+void hashstate_save(const char *fpath, const char *key, const sha256 *ctx)
+{
+    const char *path;
+
+    pthread_mutex_lock(&hs.lock);
+    path = relative(fpath);
+    if (ctx->count < HASHSTATE_MIN) {
+        /* a small file now: what was saved for it is of no use */
+        if (path[0]) {
+            drop(path, false, NULL);
+            append(NULL, path, NULL);
+        }
+    } else {
+        insert(key, path, ctx);
+        append(key, path, ctx);
+    }
+    pthread_mutex_unlock(&hs.lock);
+}
+
+/* Drops the states of fpath, removed, and of the files under it */
+void hashstate_remove(const char *fpath)
+{
+    const char *path;
+
+    pthread_mutex_lock(&hs.lock);
+    path = relative(fpath);
+    if (path[0]) {
+        drop(path, true, NULL);
+        append(NULL, path, NULL);
+    }
+    pthread_mutex_unlock(&hs.lock);
+}
+
+/* Moves the states of from, and of the files under it, to to */
+void hashstate_rename(const char *from, const char *to)
+{
+    char moved[FILENAME_MAX];
+    const char *src, *dst;
+    entry *e;
+    size_t len;
+    int i;
+
+    pthread_mutex_lock(&hs.lock);
+    src = relative(from);
+    dst = relative(to);
+    len = strlen(src);
+    /* what to replaced loses its state */
+    if (dst[0]) {
+        drop(dst, true, NULL);
+        append(NULL, dst, NULL);
+    }
+    for (i = 0; src[0] && i < HASHSTATE_BUCKETS; i++) {
+        for (e = hs.buckets[i]; e != NULL; e = e->next) {
+            if (strncmp(e->path, src, len) != 0
+                    || (e->path[len] != '\0' && e->path[len] != '/'))
+                continue;
+            snprintf(moved, FILENAME_MAX, "%s%s", dst, e->path + len);
+            free(e->path);
+            e->path = strdup(moved);
+            append(e->key, e->path, &e->ctx);
+        }
+    }
+    pthread_mutex_unlock(&hs.lock);
+}
@@ -0,0 +1,13 @@
+/*
+ * hashstate.h
+ */
+
+#include "common.h"
+#include "sha256.h"
+
+void hashstate_init(const char *repodir);
+void hashstate_destroy(void);
+int hashstate_load(const char *key, sha256 *ctx);
+void hashstate_save(const char *fpath, const char *key, const sha256 *ctx);
+void hashstate_remove(const char *fpath);
+void hashstate_rename(const char *from, const char *to);
@@ -0,0 +1,533 @@
+/*
+ * Bulk import of a directory tree
+ *
+ * Copying a large tree through the mount costs a git annex add and a
+ * commit per released file. Importing walks the source instead with one
+ * worker per core: each worker owns a deque of directories and files to
+ * process, works from its tail, and steals from the head of the others
+ * when it runs dry, so that a single huge directory is spread over all
+ * cores. Every file is cloned into .git/annex/tmp (a reflink where the
+ * filesystem allows it) and hashed there, so the key describes exactly
+ * what is stored.
+ *
+ * Once the tree is hashed, the objects are renamed into .git/annex/objects,
+ * the links are created, and the index, the location log and the history
+ * are each updated once for the whole tree.
+ */
+
+#include "import.h"
+#include "git-annex.h"
+#include "clone.h"
+#include "sha256.h"
+#include "inventory.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct task task;
+struct task
+{
+    char *rel;      /* path relative to the source, "" for the source */
+    bool isdir;
+};
+
+/* the tasks of a worker: it pops from the tail, thieves from the head */
+typedef struct deque deque;
+struct deque
+{
+    pthread_mutex_t lock;
+    task **tasks;
+    size_t head, tail, cap;
+};
+
+typedef struct entry entry;
+struct entry
+{
+    char *rel;
+    char *tmp;      /* the hashed copy in .git/annex/tmp */
+    char *key;
+};
+
+typedef struct import import;
+struct import
+{
+    const char *repodir;
+    const char *src;
+    int nworkers;
+    deque *deques;
+    pthread_mutex_t lock;   /* protects what follows */
+    long outstanding;       /* tasks queued or being processed */
+    entry *entries;
+    size_t nentries, cap;
+    off_t bytes;
+    unsigned long skipped;
+};
+
+typedef struct worker_arg worker_arg;
+struct worker_arg
+{
+    import *imp;
+    int id;
+};
+
+/*
+ * Deques
+ */
+
+static void push(import *imp, int id, const char *rel, bool isdir)
+{
+    deque *d = &imp->deques[id];
+    task *t;
+
+    t = malloc(sizeof(task));
+    t->rel = strdup(rel);
+    t->isdir = isdir;
+
+    pthread_mutex_lock(&imp->lock);
+    imp->outstanding++;
+    pthread_mutex_unlock(&imp->lock);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->tasks, d->tasks + d->head,
+                    (d->tail - d->head) * sizeof(task *));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->cap = d->cap ? 2 * d->cap : 64;
+            d->tasks = realloc(d->tasks, d->cap * sizeof(task *));
+        }
+    }
+    d->tasks[d->tail++] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static task *pop(deque *d)
+{
+    task *t = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head)
+        t = d->tasks[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+static task *steal(deque *d)
+{
+    task *t = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head)
+        t = d->tasks[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+/*
+ * Hashing (in the workers)
+ */
+
+/* path is dir/rel, returns -1 (and sets errno) if it does not fit */
+static int join(char path[FILENAME_MAX], const char *dir, const char *rel)
+{
+    int n;
+
+    if (*rel)
+        n = snprintf(path, FILENAME_MAX, "%s/%s", dir, rel);
+    else
+        n = snprintf(path, FILENAME_MAX, "%s", dir);
+    if (n >= FILENAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static void skip(import *imp, const char *path)
+{
+    perror(path);
+    pthread_mutex_lock(&imp->lock);
+    imp->skipped++;
+    pthread_mutex_unlock(&imp->lock);
+}
+
+static void scan_dir(import *imp, int id, const char *rel)
+{
+    char path[FILENAME_MAX], child[FILENAME_MAX], sub[FILENAME_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dp;
+
+    if (join(path, imp->src, rel) == -1 || (dp = opendir(path)) == NULL) {
+        skip(imp, path);
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (snprintf(sub, FILENAME_MAX, "%s%s%s", rel, *rel ? "/" : "",
+                    de->d_name) >= FILENAME_MAX) {
+            errno = ENAMETOOLONG;
+            skip(imp, path);
+        } else if (join(child, imp->src, sub) == -1
+                || lstat(child, &st) == -1)
+            skip(imp, child);
+        else if (S_ISDIR(st.st_mode))
+            push(imp, id, sub, true);
+        else if (S_ISREG(st.st_mode))
+            push(imp, id, sub, false);
+        else {
+            /* links and special files are not content */
+            pthread_mutex_lock(&imp->lock);
+            imp->skipped++;
+            pthread_mutex_unlock(&imp->lock);
+        }
+    }
+    closedir(dp);
+}
+
+static void import_file(import *imp, const char *rel)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX], key[FILENAME_MAX], hex[65];
+    char buf[1 << 16];
+    struct stat st;
+    sha256 hash;
+    ssize_t n;
+    off_t off;
+    int in, out;
+    entry *e;
+
+    snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp/import.XXXXXX",
+            imp->repodir);
+    if (join(path, imp->src, rel) == -1
+            || (in = open(path, O_RDONLY)) == -1) {
+        skip(imp, path);
+        return;
+    }
+    if (fstat(in, &st) == -1 || (out = mkstemp(tmp)) == -1) {
+        skip(imp, tmp);
+        close(in);
+        return;
+    }
+    if (clone_fd(in, out, st.st_size) == -1)
+        goto fail;
+
+    /* hash what was stored, not what the source has become since */
+    sha256_init(&hash);
+    for (off = 0; (n = pread(out, buf, sizeof buf, off)) > 0; off += n)
+        sha256_update(&hash, buf, n);
+    if (n == -1 || fchmod(out, 0444) == -1)
+        goto fail;
+    close(in);
+    if (close(out) == -1) {
+        skip(imp, path);
+        unlink(tmp);
+        return;
+    }
+    sha256_hex(&hash, hex);
+    git_annex_mkkey(key, path, off, hex);
+
+    pthread_mutex_lock(&imp->lock);
+    if (imp->nentries == imp->cap) {
+        imp->cap = imp->cap ? 2 * imp->cap : 256;
+        imp->entries = realloc(imp->entries, imp->cap * sizeof(entry));
+    }
+    e = &imp->entries[imp->nentries++];
+    e->rel = strdup(rel);
+    e->tmp = strdup(tmp);
+    e->key = strdup(key);
+    imp->bytes += off;
+    pthread_mutex_unlock(&imp->lock);
+    return;
+
+fail:
+    skip(imp, path);
+    close(in);
+    close(out);
+    unlink(tmp);
+}
+
+static void *worker(void *arg)
+{
+    worker_arg *w = arg;
+    import *imp = w->imp;
+    struct timespec idle = { 0, 1000000 };
+    task *t;
+    int i;
+    bool done;
+
+    for (;;) {
+        t = pop(&imp->deques[w->id]);
+        for (i = 1; t == NULL && i < imp->nworkers; i++)
+            t = steal(&imp->deques[(w->id + i) % imp->nworkers]);
+        if (t == NULL) {
+            pthread_mutex_lock(&imp->lock);
+            done = imp->outstanding == 0;
+            pthread_mutex_unlock(&imp->lock);
+            if (done)
+                break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        if (t->isdir)
+            scan_dir(imp, w->id, t->rel);
+        else
+            import_file(imp, t->rel);
+        free(t->rel);
+        free(t);
+        pthread_mutex_lock(&imp->lock);
+        imp->outstanding--;
+        pthread_mutex_unlock(&imp->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Placing (serially, with the repository lock held)
+ */
+
+static void mkdirs(const char *path)
+{
+    char dir[FILENAME_MAX], *p;
+    strncpy(dir, path, FILENAME_MAX - 1);
+    dir[FILENAME_MAX - 1] = '\0';
+    for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+/*
+ * Moves the hashed copies to their objects, links them in dest and
+ * records the whole tree in the index, the location log and the history.
+ */
+static int place(import *imp, const char *dest)
+{
+    char lists[3][FILENAME_MAX], objpath[FILENAME_MAX];
+    char object[FILENAME_MAX], link[FILENAME_MAX], rel[FILENAME_MAX];
+    char target[FILENAME_MAX], uuid[64];
+    FILE *keys, *paths, *present, *objects;
+    const char *c;
+    entry *e;
+    size_t i;
+    int fd, res;
+
+    if (git_annex_uuid(imp->repodir, uuid) == -1)
+        return -1;
+    for (i = 0; i < 3; i++) {
+        snprintf(lists[i], FILENAME_MAX, "%s/.git/annex/tmp/import.XXXXXX",
+                imp->repodir);
+        if ((fd = mkstemp(lists[i])) != -1)
+            close(fd);
+    }
+    keys = fopen(lists[0], "w");
+    paths = fopen(lists[1], "w");
+    present = fopen(lists[2], "w");
+    res = -1;
+    if (!keys || !paths || !present)
+        goto out;
+
+    for (i = 0; i < imp->nentries; i++)
+        fprintf(keys, "%s\n", imp->entries[i].key);
+    fclose(keys);
+    keys = NULL;
+    if ((objects = git_annex_objectpaths(imp->repodir, lists[0])) == NULL)
+        goto out;
+
+    for (i = 0; i < imp->nentries; i++) {
+        e = &imp->entries[i];
+        if (fgets(objpath, FILENAME_MAX, objects) == NULL)
+            break;
+        objpath[strcspn(objpath, "\n")] = '\0';
+
+        if (snprintf(object, FILENAME_MAX, "%s/.git/annex/objects/%s",
+                    imp->repodir, objpath) >= FILENAME_MAX
+                || snprintf(rel, FILENAME_MAX, "files%s/%s", dest, e->rel)
+                    >= FILENAME_MAX
+                || snprintf(link, FILENAME_MAX, "%s/%s", imp->repodir, rel)
+                    >= FILENAME_MAX) {
+            fprintf(stderr, "%s: %s\n", e->rel, strerror(ENAMETOOLONG));
+            unlink(e->tmp);
+            continue;
+        }
+        mkdirs(object);
+        if (access(object, F_OK) == 0)
+            unlink(e->tmp);     /* the same content is already there */
+        else if (rename(e->tmp, object) == -1) {
+            perror(object);
+            unlink(e->tmp);
+            continue;
+        }
+        inventory_update(objpath);
+
+        target[0] = '\0';
+        for (c = rel; *c; c++)
+            if (*c == '/')
+                strncat(target, "../", FILENAME_MAX - strlen(target) - 1);
+        strncat(target, ".git/annex/objects/",
+                FILENAME_MAX - strlen(target) - 1);
+        strncat(target, objpath, FILENAME_MAX - strlen(target) - 1);
+        mkdirs(link);
+        unlink(link);
+        if (symlink(target, link) == -1) {
+            perror(link);
+            continue;
+        }
+        fwrite(rel, 1, strlen(rel) + 1, paths);
+        fprintf(present, "%s %s 1\n", e->key, uuid);
+    }
+    pclose(objects);
+    fclose(paths);
+    fclose(present);
+    paths = present = NULL;
+
+    res = 0;
+    if (git_update_index(imp->repodir, lists[1]) != 0
+            || git_annex_setpresentkeys(imp->repodir, lists[2]) != 0)
+        res = -1;
+    else
+        git_commit(imp->repodir, "imported %s", *dest ? dest + 1 : "/");
+
+out:
+    if (keys)
+        fclose(keys);
+    if (paths)
+        fclose(paths);
+    if (present)
+        fclose(present);
+    for (i = 0; i < 3; i++)
+        unlink(lists[i]);
+    return res;
+}
+
+/*
+ * Interface
+ */
+
+/*
+ * Imports the tree src into dest, a directory of the mount ("/" being its
+ * root). lock, if given, is held while the repository is modified. A
+ * summary is written to report.
+ */
+int import_tree(const char *repodir, const char *src, const char *dest,
+        pthread_mutex_t *lock, char *report, size_t len)
+{
+    char tmpdir[FILENAME_MAX], destdir[FILENAME_MAX];
+    struct timespec start, end;
+    pthread_t *threads;
+    worker_arg *args;
+    import imp;
+    size_t i;
+    int res;
+
+    /* dest as "/a/b", or "" for the root */
+    snprintf(destdir, FILENAME_MAX, "%s%s", *dest == '/' ? "" : "/", dest);
+    while (*destdir && destdir[strlen(destdir) - 1] == '/')
+        destdir[strlen(destdir) - 1] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&imp, 0, sizeof(imp));
+    imp.repodir = repodir;
+    imp.src = src;
+    imp.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (imp.nworkers < 1)
+        imp.nworkers = 1;
+    pthread_mutex_init(&imp.lock, NULL);
+    imp.deques = calloc(imp.nworkers, sizeof(deque));
+    for (i = 0; i < (size_t) imp.nworkers; i++)
+        pthread_mutex_init(&imp.deques[i].lock, NULL);
+    snprintf(tmpdir, FILENAME_MAX, "%s/.git/annex/tmp", repodir);
+    mkdir(tmpdir, 0755);
+
+    push(&imp, 0, "", true);
+    threads = malloc(imp.nworkers * sizeof(pthread_t));
+    args = malloc(imp.nworkers * sizeof(worker_arg));
+    for (i = 0; i < (size_t) imp.nworkers; i++) {
+        args[i].imp = &imp;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    for (i = 0; i < (size_t) imp.nworkers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(args);
+
+    res = 0;
+    if (imp.nentries > 0) {
+        if (lock)
+            pthread_mutex_lock(lock);
+        res = place(&imp, destdir);
+        if (lock)
+            pthread_mutex_unlock(lock);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    snprintf(report, len, "imported %zu files (%lld bytes) from %s "
+            "with %d workers in %.1fs, %lu skipped%s\n",
+            imp.nentries, (long long) imp.bytes, src, imp.nworkers,
+            (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9, imp.skipped,
+            res == -1 ? ", failed to record them" : "");
+
+    for (i = 0; i < imp.nentries; i++) {
+        unlink(imp.entries[i].tmp);     /* left over on failure */
+        free(imp.entries[i].rel);
+        free(imp.entries[i].tmp);
+        free(imp.entries[i].key);
+    }
+    free(imp.entries);
+    for (i = 0; i < (size_t) imp.nworkers; i++)
+        free(imp.deques[i].tasks);
+    free(imp.deques);
+    return res;
+}
+
+/*
+ * sharebox import <srcdir> <dest>, for a repository that is not mounted:
+ * dest is a directory under the files/ directory of the repository.
+ */
+int import_main(const char *src, const char *dest)
+{
+    char srcdir[FILENAME_MAX], destdir[FILENAME_MAX], repodir[FILENAME_MAX];
+    char check[FILENAME_MAX + 8], report[512], *p;
+    size_t n;
+    int res;
+
+    mkdir(dest, 0755);
+    if (realpath(src, srcdir) == NULL) {
+        perror(src);
+        return 1;
+    }
+    if (realpath(dest, destdir) == NULL) {
+        perror(dest);
+        return 1;
+    }
+
+    /* look for the repository whose files/ contains dest */
+    strcpy(repodir, destdir);
+    for (;;) {
+        n = strlen(repodir);
+        snprintf(check, sizeof check, "%s/.git", repodir);
+        if (access(check, F_OK) == 0 && strncmp(destdir + n, "/files", 6) == 0
+                && (destdir[n + 6] == '\0' || destdir[n + 6] == '/'))
+            break;
+        if ((p = strrchr(repodir, '/')) == NULL || p == repodir) {
+            fprintf(stderr, "%s: not in the files/ of a sharebox\n", dest);
+            return 1;
+        }
+        *p = '\0';
+    }
+
+    /* keeps the inventory of the unmounted repository in line */
+    inventory_init(repodir);
+    res = import_tree(repodir, srcdir, destdir + n + 6, NULL, report,
+            sizeof report);
+    inventory_destroy();
+    if (res == -1) {
+        fputs(report, stderr);
+        return 1;
+    }
+    fputs(report, stdout);
+    return 0;
+}
@@ -0,0 +1,9 @@
+/*
+ * import.h
+ */
+
+#include "common.h"
+
+int import_tree(const char *repodir, const char *src, const char *dest,
+        pthread_mutex_t *lock, char *report, size_t len);
+int import_main(const char *src, const char *dest);
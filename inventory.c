@@ -0,0 +1,335 @@
+/*
+ * Inventory of the annexed content a repository holds
+ *
+ * Knowing which keys a peer has that we do not would take enumerating
+ * both sides key by key. Instead each repository keeps a digest tree
+ * that follows the layout of .git/annex/objects, whose objects live in
+ * two levels of hash directories (Xx/Yy/KEY/KEY, 32 values per character
+ * of the mixed case hash):
+ *
+ *     root      XOR of the 1024 first level digests
+ *     Xx        XOR of the 1024 digests of its subdirectories
+ *     Xx/Yy     XOR of the hashes of the keys held in it
+ *
+ * all kept in the mmap'd file .git/sharebox/inventory. A key is held when
+ * its loose object is there. One that a store keeps is not: peers could
+ * not copy it from us, and the location log says the same (see store.c).
+ *
+ * When an object comes or goes, the digest of its directory is recomputed
+ * from a listing of that directory alone (a handful of keys), and the
+ * change goes up the tree. Comparing with a peer then only descends where
+ * the digests differ: the root, the first level of the directories that
+ * differ, and listings of the leaf directories that differ, so that the
+ * work is proportional to the difference rather than to the inventory.
+ *
+ * The tree is marked clean on unmount; one that was not is rebuilt by a
+ * full walk at the next mount.
+ */
+
+#include "inventory.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INVENTORY_FANOUT 1024   /* two characters of 32 values */
+
+static const char alphabet[] = "0123456789zqjxkmvwgpfZQJXKMVWGPF";
+
+typedef struct header header;
+struct header
+{
+    char magic[8];
+    uint32_t clean;
+    uint32_t pad;
+    uint64_t root;
+    uint64_t dirs[INVENTORY_FANOUT];
+    uint64_t leaves[INVENTORY_FANOUT * INVENTORY_FANOUT];
+};
+
+static struct {
+    char objects[FILENAME_MAX - 16];    /* room for the hash directories */
+    header *tree;
+    pthread_mutex_t lock;
+} inv;
+
+static uint64_t key_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *key; key++)
+        h = (h ^ (unsigned char) *key) * 1099511628211ULL;
+    /* splitmix64 finalizer, so that XORs of similar keys do not cancel */
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* index of a two character hash directory name, -1 if it is not one */
+static int dir_index(const char *name)
+{
+    const char *a, *b;
+    if (strlen(name) != 2 || (a = strchr(alphabet, name[0])) == NULL
+            || (b = strchr(alphabet, name[1])) == NULL)
+        return -1;
+    return (a - alphabet) * 32 + (b - alphabet);
+}
+
+/* lists the keys held in the leaf directory objects/xx/yy, sorted */
+static int list_leaf(const char *objects, int dir, int leaf,
+        struct dirent ***keys)
+{
+    char path[FILENAME_MAX], object[FILENAME_MAX];
+    struct dirent **entries;
+    int n, i, kept;
+
+    snprintf(path, FILENAME_MAX, "%s/%c%c/%c%c", objects,
+            alphabet[dir / 32], alphabet[dir % 32],
+            alphabet[leaf / 32], alphabet[leaf % 32]);
+    if ((n = scandir(path, &entries, NULL, alphasort)) == -1) {
+        *keys = NULL;
+        return 0;
+    }
+    kept = 0;
+    for (i = 0; i < n; i++) {
+        if (entries[i]->d_name[0] != '.'
+                && snprintf(object, FILENAME_MAX, "%s/%s/%s", path,
+                    entries[i]->d_name, entries[i]->d_name) < FILENAME_MAX
+                && access(object, F_OK) == 0)
+            entries[kept++] = entries[i];
+        else
+            free(entries[i]);
+    }
+    *keys = entries;
+    return kept;
+}
+
+static void free_list(struct dirent **keys, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+/* recomputes a leaf, and the digests above it (called with inv.lock held) */
+static void refresh_leaf(int dir, int leaf)
+{
+    struct dirent **keys;
+    uint64_t digest, delta;
+    int n, i;
+
+    n = list_leaf(inv.objects, dir, leaf, &keys);
+    digest = 0;
+    for (i = 0; i < n; i++)
+        digest ^= key_hash(keys[i]->d_name);
+    free_list(keys, n);
+    delta = inv.tree->leaves[dir * INVENTORY_FANOUT + leaf] ^ digest;
+    inv.tree->leaves[dir * INVENTORY_FANOUT + leaf] = digest;
+    inv.tree->dirs[dir] ^= delta;
+    inv.tree->root ^= delta;
+}
+
+/* walks the whole of .git/annex/objects */
+static void rebuild(void)
+{
+    char path[FILENAME_MAX];
+    struct dirent *de, *le;
+    DIR *dp, *lp;
+    int dir, leaf;
+    unsigned long leaves;
+
+    memset(&inv.tree->root, 0, sizeof(header) - offsetof(header, root));
+    if ((dp = opendir(inv.objects)) == NULL)
+        return;
+    leaves = 0;
+    while ((de = readdir(dp)) != NULL) {
+        if ((dir = dir_index(de->d_name)) == -1)
+            continue;
+        snprintf(path, FILENAME_MAX, "%s/%c%c", inv.objects,
+                alphabet[dir / 32], alphabet[dir % 32]);
+        if ((lp = opendir(path)) == NULL)
+            continue;
+        while ((le = readdir(lp)) != NULL) {
+            if ((leaf = dir_index(le->d_name)) == -1)
+                continue;
+            refresh_leaf(dir, leaf);
+            leaves++;
+        }
+        closedir(lp);
+    }
+    closedir(dp);
+    printf("inventory rebuilt from %lu directories\n", leaves);
+}
+
+/* the leaf an object path (anything containing Xx/Yy/KEY/KEY) is in */
+static int locate(const char *object, int *dir, int *leaf)
+{
+    char name[3];
+    const char *p;
+
+    if ((p = strstr(object, ".git/annex/objects/")) != NULL)
+        object = p + strlen(".git/annex/objects/");
+    if (strlen(object) < 6 || object[2] != '/' || object[5] != '/')
+        return -1;
+    name[2] = '\0';
+    memcpy(name, object, 2);
+    *dir = dir_index(name);
+    memcpy(name, object + 3, 2);
+    *leaf = dir_index(name);
+    return *dir == -1 || *leaf == -1 ? -1 : 0;
+}
+
+/*
+ * Interface
+ */
+
+void inventory_init(const char *repodir)
+{
+    char path[FILENAME_MAX];
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(&inv, 0, sizeof(inv));
+    pthread_mutex_init(&inv.lock, NULL);
+    if (snprintf(inv.objects, sizeof inv.objects, "%s/.git/annex/objects",
+                repodir) >= (int) sizeof inv.objects)
+        return;
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox", repodir);
+    mkdir(path, 0755);
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox/inventory", repodir);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+        return;
+    if (fstat(fd, &st) == -1 || (st.st_size != sizeof(header)
+                && ftruncate(fd, sizeof(header)) == -1)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, sizeof(header), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    inv.tree = map;
+    if (memcmp(inv.tree->magic, "SBXINVT2", 8) != 0 || !inv.tree->clean) {
+        memcpy(inv.tree->magic, "SBXINVT2", 8);
+        rebuild();
+    }
+    inv.tree->clean = 0;
+    msync(inv.tree, sizeof(header), MS_SYNC);
+}
+
+void inventory_destroy(void)
+{
+    if (inv.tree == NULL)
+        return;
+    inv.tree->clean = 1;
+    msync(inv.tree, sizeof(header), MS_SYNC);
+    munmap(inv.tree, sizeof(header));
+    inv.tree = NULL;
+}
+
+/*
+ * To be called when the object at path (relative to .git/annex/objects,
+ * or anything leading there such as the target of a link) came or went.
+ */
+void inventory_update(const char *object)
+{
+    int dir, leaf;
+
+    if (inv.tree == NULL || locate(object, &dir, &leaf) == -1)
+        return;
+    pthread_mutex_lock(&inv.lock);
+    refresh_leaf(dir, leaf);
+    pthread_mutex_unlock(&inv.lock);
+}
+
+/* same as inventory_update, for the annexed file fpath */
+void inventory_update_link(const char *fpath)
+{
+    char target[FILENAME_MAX];
+    ssize_t n;
+
+    if ((n = readlink(fpath, target, FILENAME_MAX - 1)) == -1)
+        return;
+    target[n] = '\0';
+    inventory_update(target);
+}
+
+/*
+ * Finds the symmetric difference between what we hold and what the peer
+ * whose repository is the local path repo holds. found is called with
+ * the path of each object (relative to .git/annex/objects) and whether
+ * it is the peer that has it. Returns the number of differences, -1 if
+ * the peer keeps no inventory.
+ */
+long inventory_diff(const char *repo,
+        void (*found)(const char *object, bool theirs, void *arg), void *arg)
+{
+    char path[FILENAME_MAX], objects[FILENAME_MAX], object[FILENAME_MAX];
+    uint64_t root, dirs[INVENTORY_FANOUT], leaves[INVENTORY_FANOUT];
+    struct dirent **ours, **theirs;
+    int fd, dir, leaf, nours, ntheirs, i, j, c;
+    long n;
+
+    if (inv.tree == NULL)
+        return -1;
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox/inventory", repo);
+    snprintf(objects, FILENAME_MAX, "%s/.git/annex/objects", repo);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (pread(fd, object, 8, 0) != 8 || memcmp(object, "SBXINVT2", 8) != 0
+            || pread(fd, &root, sizeof root, offsetof(header, root))
+            != sizeof root) {
+        close(fd);
+        return -1;
+    }
+
+    n = 0;
+    if (root == inv.tree->root)
+        goto out;
+    if (pread(fd, dirs, sizeof dirs, offsetof(header, dirs)) != sizeof dirs)
+        goto out;
+    for (dir = 0; dir < INVENTORY_FANOUT; dir++) {
+        if (dirs[dir] == inv.tree->dirs[dir])
+            continue;
+        if (pread(fd, leaves, sizeof leaves, offsetof(header, leaves)
+                    + dir * sizeof leaves) != sizeof leaves)
+            break;
+        for (leaf = 0; leaf < INVENTORY_FANOUT; leaf++) {
+            if (leaves[leaf] == inv.tree->leaves[dir * INVENTORY_FANOUT + leaf])
+                continue;
+            /* both listings are sorted: merge them */
+            nours = list_leaf(inv.objects, dir, leaf, &ours);
+            ntheirs = list_leaf(objects, dir, leaf, &theirs);
+            for (i = j = 0; i < nours || j < ntheirs; ) {
+                if (i == nours)
+                    c = 1;
+                else if (j == ntheirs)
+                    c = -1;
+                else
+                    c = strcoll(ours[i]->d_name, theirs[j]->d_name);
+                if (c == 0) {
+                    i++;
+                    j++;
+                    continue;
+                }
+                snprintf(object, FILENAME_MAX, "%c%c/%c%c/%s/%s",
+                        alphabet[dir / 32], alphabet[dir % 32],
+                        alphabet[leaf / 32], alphabet[leaf % 32],
+                        c < 0 ? ours[i]->d_name : theirs[j]->d_name,
+                        c < 0 ? ours[i]->d_name : theirs[j]->d_name);
+                found(object, c > 0, arg);
+                n++;
+                if (c < 0)
+                    i++;
+                else
+                    j++;
+            }
+            free_list(ours, nours);
+            free_list(theirs, ntheirs);
+        }
+    }
+out:
+    close(fd);
+    return n;
+}
@@ -0,0 +1,12 @@
+/*
+ * inventory.h
+ */
+
+#include "common.h"
+
+void inventory_init(const char *repodir);
+void inventory_destroy(void);
+void inventory_update(const char *object);
+void inventory_update_link(const char *fpath);
+long inventory_diff(const char *repo,
+        void (*found)(const char *object, bool theirs, void *arg), void *arg);
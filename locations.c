@@ -0,0 +1,357 @@
+/*
+ * Index of where annexed content is
+ *
+ * git-annex records which repositories hold a key in the location logs of
+ * its branch (aaa/bbb/KEY.log, lines of "<timestamp>s 1|0|X uuid", where X
+ * marks a copy known to be dead), which only git can read. They are kept
+ * here in memory, keyed by key: read from the branch once at mount, then
+ * after each sync only the logs that changed between the commit of the
+ * branch last indexed and its new tip.
+ *
+ * The remotes a key is at are ranked by what fetching it from each of them
+ * costs: its latency plus the size of the key over its throughput, both
+ * measured on the transfers made so far. Remotes not measured yet come
+ * first, so that they get measured.
+ */
+
+#include "locations.h"
+#include "git-annex.h"
+
+#include <limits.h>
+#include <time.h>
+
+#define LOCATIONS_BUCKETS 65536
+#define LOCATIONS_MAX     16            /* repositories tracked per key */
+#define LOCATIONS_REMOTES 255
+#define LOCATIONS_SMALL   (256 << 10)   /* transfers that measure latency */
+#define LOCATIONS_WEIGHT  0.25          /* of a new measure in the average */
+#define LOCATIONS_PENALTY 5.0           /* seconds a failed transfer costs */
+
+typedef struct remote remote;
+struct remote
+{
+    char uuid[64];
+    char name[NAME_MAX + 1];    /* "" when no remote has this uuid */
+    double latency;             /* seconds */
+    double rate;                /* bytes per second, 0 until measured */
+    unsigned long samples;
+};
+
+typedef struct entry entry;
+struct entry
+{
+    char *key;
+    unsigned char n;
+    unsigned char at[LOCATIONS_MAX];    /* indexes in the remotes */
+    entry *next;
+};
+
+static struct {
+    char repodir[FILENAME_MAX];
+    char self[64];              /* our uuid */
+    char tip[41];               /* commit of the branch last indexed */
+    entry *buckets[LOCATIONS_BUCKETS];
+    remote remotes[LOCATIONS_REMOTES];
+    int nremotes;
+    pthread_mutex_t lock;       /* the index and the remotes */
+    pthread_mutex_t refresh;    /* one refresh at a time */
+    pthread_t builder;
+    bool building;
+} loc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .refresh = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned long hash(const char *key)
+{
+    unsigned long h = 5381;
+    for (; *key; key++)
+        h = h * 33 + (unsigned char) *key;
+    return h % LOCATIONS_BUCKETS;
+}
+
+static entry *lookup(const char *key)
+{
+    entry *e;
+    for (e = loc.buckets[hash(key)]; e != NULL; e = e->next)
+        if (strcmp(e->key, key) == 0)
+            return e;
+    return NULL;
+}
+
+/* index of the remote of uuid, added when new (-1 when there is no room) */
+static int remote_index(const char *uuid)
+{
+    int i;
+    for (i = 0; i < loc.nremotes; i++)
+        if (strcmp(loc.remotes[i].uuid, uuid) == 0)
+            return i;
+    if (loc.nremotes == LOCATIONS_REMOTES || strlen(uuid) >= 64)
+        return -1;
+    memset(&loc.remotes[i], 0, sizeof(remote));
+    strcpy(loc.remotes[i].uuid, uuid);
+    return loc.nremotes++;
+}
+
+static remote *remote_named(const char *name)
+{
+    int i;
+    for (i = 0; i < loc.nremotes; i++)
+        if (strcmp(loc.remotes[i].name, name) == 0)
+            return &loc.remotes[i];
+    return NULL;
+}
+
+/*
+ * Indexes the location log of key: for each uuid the line with the latest
+ * timestamp tells whether it has the key (1) or not (0, or X once dead).
+ */
+static void index_log(const char *key, char *log, void *arg)
+{
+    char uuids[LOCATIONS_MAX][64];
+    double stamps[LOCATIONS_MAX], stamp;
+    bool present[LOCATIONS_MAX];
+    char *line, *save, uuid[64], value;
+    int n, i, r;
+    entry *e;
+    (void) arg;
+
+    n = 0;
+    for (line = strtok_r(log, "\n", &save); line != NULL;
+            line = strtok_r(NULL, "\n", &save)) {
+        if (sscanf(line, "%lfs %c %63s", &stamp, &value, uuid) != 3
+                || strcmp(uuid, loc.self) == 0)
+            continue;
+        for (i = 0; i < n && strcmp(uuids[i], uuid) != 0; i++)
+            ;
+        if (i == n) {
+            if (n == LOCATIONS_MAX)
+                continue;
+            strcpy(uuids[n++], uuid);
+        } else if (stamp < stamps[i]) {
+            continue;
+        }
+        stamps[i] = stamp;
+        present[i] = value == '1';
+    }
+
+    pthread_mutex_lock(&loc.lock);
+    if ((e = lookup(key)) == NULL) {
+        e = calloc(1, sizeof(entry));
+        e->key = strdup(key);
+        e->next = loc.buckets[hash(key)];
+        loc.buckets[hash(key)] = e;
+    }
+    e->n = 0;
+    for (i = 0; i < n; i++)
+        if (present[i] && (r = remote_index(uuids[i])) != -1)
+            e->at[e->n++] = r;
+    pthread_mutex_unlock(&loc.lock);
+}
+
+static void name_remote(const char *name, const char *uuid, void *arg)
+{
+    int i;
+    (void) arg;
+    if ((i = remote_index(uuid)) != -1 && strlen(name) <= NAME_MAX)
+        strcpy(loc.remotes[i].name, name);
+}
+
+/* what fetching size bytes from r is expected to take */
+static double cost(const remote *r, off_t size)
+{
+    if (r->samples == 0)
+        return 0;
+    if (r->rate == 0 || size <= 0)
+        return r->latency;
+    return r->latency + size / r->rate;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *build(void *arg)
+{
+    (void) arg;
+    locations_refresh();
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+/* starts indexing the branch in the background */
+void locations_init(const char *repodir)
+{
+    strcpy(loc.repodir, repodir);
+    if (git_annex_uuid(repodir, loc.self) == -1)
+        loc.self[0] = '\0';
+    loc.building = pthread_create(&loc.builder, NULL, build, NULL) == 0;
+}
+
+void locations_destroy(void)
+{
+    entry *e, *next;
+    int i;
+
+    if (loc.building)
+        pthread_join(loc.builder, NULL);
+    loc.building = false;
+    for (i = 0; i < LOCATIONS_BUCKETS; i++) {
+        for (e = loc.buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->key);
+            free(e);
+        }
+        loc.buckets[i] = NULL;
+    }
+    loc.nremotes = 0;
+    loc.tip[0] = '\0';
+}
+
+/*
+ * Brings the index up to date with the git-annex branch, reading only the
+ * logs that changed since the last time, and the remotes with their names.
+ */
+void locations_refresh(void)
+{
+    char tip[41];
+    long n;
+    int i;
+
+    pthread_mutex_lock(&loc.refresh);
+    if (git_rev_parse(loc.repodir, "refs/heads/git-annex", tip) == 0
+            && strcmp(tip, loc.tip) != 0) {
+        n = git_location_logs(loc.repodir, loc.tip[0] ? loc.tip : NULL, tip,
+                index_log, NULL);
+        if (n >= 0) {
+            printf("locations: %ld logs indexed up to %.8s\n", n, tip);
+            strcpy(loc.tip, tip);
+        }
+    }
+    pthread_mutex_lock(&loc.lock);
+    for (i = 0; i < loc.nremotes; i++)
+        loc.remotes[i].name[0] = '\0';
+    git_remote_uuids(loc.repodir, name_remote, NULL);
+    pthread_mutex_unlock(&loc.lock);
+    pthread_mutex_unlock(&loc.refresh);
+}
+
+/*
+ * Accounts for a transfer of size bytes from the remote name that took
+ * seconds. Small transfers measure the latency, larger ones the rate.
+ */
+void locations_record(const char *name, off_t size, double seconds)
+{
+    double rate, t;
+    remote *r;
+
+    pthread_mutex_lock(&loc.lock);
+    if ((r = remote_named(name)) == NULL) {
+        pthread_mutex_unlock(&loc.lock);
+        return;
+    }
+    if (size < LOCATIONS_SMALL) {
+        r->latency = r->samples == 0 ? seconds : r->latency
+            + LOCATIONS_WEIGHT * (seconds - r->latency);
+    } else {
+        t = seconds - r->latency > 0.001 ? seconds - r->latency : 0.001;
+        rate = size / t;
+        r->rate = r->rate == 0 ? rate : r->rate
+            + LOCATIONS_WEIGHT * (rate - r->rate);
+    }
+    r->samples++;
+    pthread_mutex_unlock(&loc.lock);
+}
+
+/*
+ * Gets the content of key from the cheapest of the remotes that have it,
+ * trying the next one on failure. Returns -1 if none did.
+ */
+int locations_get_key(const char *key)
+{
+    char names[LOCATIONS_MAX][NAME_MAX + 1];
+    double costs[LOCATIONS_MAX], c;
+    struct timespec start;
+    off_t size;
+    entry *e;
+    int n, i, j;
+
+    size = git_annex_keysize(key);
+    n = 0;
+    pthread_mutex_lock(&loc.lock);
+    if ((e = lookup(key)) != NULL) {
+        for (i = 0; i < e->n; i++) {
+            if (loc.remotes[e->at[i]].name[0] == '\0')
+                continue;
+            /* insertion in the order of the costs */
+            c = cost(&loc.remotes[e->at[i]], size);
+            for (j = n; j > 0 && costs[j - 1] > c; j--) {
+                costs[j] = costs[j - 1];
+                strcpy(names[j], names[j - 1]);
+            }
+            costs[j] = c;
+            strcpy(names[j], loc.remotes[e->at[i]].name);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&loc.lock);
+
+    for (i = 0; i < n; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (git_annex_get_key(loc.repodir, key, names[i]) == 0) {
+            locations_record(names[i], size, elapsed(&start));
+            return 0;
+        }
+        locations_record(names[i], 0, elapsed(&start) + LOCATIONS_PENALTY);
+    }
+    return -1;
+}
+
+/* how many other repositories are recorded to have key */
+int locations_copies(const char *key)
+{
+    entry *e;
+    int n;
+
+    pthread_mutex_lock(&loc.lock);
+    n = (e = lookup(key)) != NULL ? e->n : 0;
+    pthread_mutex_unlock(&loc.lock);
+    return n;
+}
+
+/* how many keys are indexed, and how many of them a remote has */
+void locations_stats(FILE *out)
+{
+    unsigned long keys, remote;
+    entry *e;
+    int i;
+
+    keys = remote = 0;
+    pthread_mutex_lock(&loc.lock);
+    for (i = 0; i < LOCATIONS_BUCKETS; i++) {
+        for (e = loc.buckets[i]; e != NULL; e = e->next) {
+            keys++;
+            if (e->n > 0)
+                remote++;
+        }
+    }
+    fprintf(out, "locations: %lu keys, %lu at a remote, %d remotes\n",
+            keys, remote, loc.nremotes);
+    pthread_mutex_unlock(&loc.lock);
+}
+
+/* same as locations_get_key, for the annexed file fpath */
+int locations_get(const char *fpath)
+{
+    char key[FILENAME_MAX];
+    if (git_annex_key(fpath, key) == -1)
+        return -1;
+    return locations_get_key(key);
+}
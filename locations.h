@@ -0,0 +1,14 @@
+/*
+ * locations.h
+ */
+
+#include "common.h"
+
+void locations_init(const char *repodir);
+void locations_destroy(void);
+void locations_refresh(void);
+void locations_record(const char *name, off_t size, double seconds);
+int locations_get_key(const char *key);
+int locations_get(const char *fpath);
+int locations_copies(const char *key);
+void locations_stats(FILE *out);
@@ -0,0 +1,423 @@
+/*
+ * Merging the commits of peers beside the live filesystem
+ *
+ * git merge works in the worktree: it rewrites the files under the open
+ * handles of the filesystem, and the whole time it runs it holds
+ * sharebox.rwlock, and with it every operation. Here the merge is
+ * computed without the lock instead, in an index of its own (see
+ * git_merge_trees), and each path it changes gets its new content in a
+ * file of .git/sharebox/merge. Only then is the lock taken, to rename
+ * these files over their paths one by one, so that a handle open on a
+ * path keeps the content it had, to remove the removed paths, and to move
+ * the index and HEAD to the merge. What the paths had is moved aside to
+ * .git/sharebox/merge as well rather than lost, and put back if any of it
+ * fails, so that the worktree, the index and HEAD stay where they were.
+ *
+ * Git cannot merge the content of annexed files: when both sides changed
+ * a path ours stays, and theirs goes next to it as .<peer>.<name>.conflict.
+ * So does theirs for a path with changes the filesystem did not commit
+ * yet (a file open for writing, an overlay not compacted, a commit held
+ * back), which a rename would lose. HEAD moving or such changes appearing while the merge is computed
+ * make it start over, MERGE_TRIES times at most.
+ */
+
+#include "merge.h"
+#include "git-annex.h"
+#include "events.h"
+#include "metadata.h"
+#include "slash.h"
+
+#include <sys/stat.h>
+
+#define MERGE_TRIES 3
+
+typedef struct change change;
+struct change
+{
+    char status;    /* A, M, D or T */
+    char *path;     /* relative to the repository */
+    char *tmp;      /* the new content, NULL once renamed or removed */
+    char *old;      /* what the path had, moved aside, NULL if nothing */
+    bool applied;
+};
+
+typedef struct plan plan;
+struct plan
+{
+    change *changes;
+    size_t n, cap;
+};
+
+typedef struct strlist strlist;
+struct strlist
+{
+    char **s;
+    size_t n, cap;
+};
+
+static void push(strlist *l, const char *s)
+{
+    if (l->n == l->cap) {
+        l->cap = l->cap ? 2 * l->cap : 16;
+        l->s = realloc(l->s, l->cap * sizeof(char *));
+    }
+    l->s[l->n++] = strdup(s);
+}
+
+static void clear(strlist *l)
+{
+    size_t i;
+    for (i = 0; i < l->n; i++)
+        free(l->s[i]);
+    free(l->s);
+    memset(l, 0, sizeof(strlist));
+}
+
+static void found_change(char status, const char *path, const char *tmp,
+        void *arg)
+{
+    plan *p = arg;
+
+    if (p->n == p->cap) {
+        p->cap = p->cap ? 2 * p->cap : 64;
+        p->changes = realloc(p->changes, p->cap * sizeof(change));
+    }
+    p->changes[p->n].status = status;
+    p->changes[p->n].path = strdup(path);
+    p->changes[p->n].tmp = tmp ? strdup(tmp) : NULL;
+    p->changes[p->n].old = NULL;
+    p->changes[p->n].applied = false;
+    p->n++;
+}
+
+static void found_dirty(const char *path, void *arg)
+{
+    push(arg, path);
+}
+
+/* removes what is left of the plan, but what the paths had */
+static void discard(plan *p)
+{
+    size_t i;
+
+    for (i = 0; i < p->n; i++) {
+        if (p->changes[i].tmp)
+            unlink(p->changes[i].tmp);
+        free(p->changes[i].tmp);
+        free(p->changes[i].old);
+        free(p->changes[i].path);
+    }
+    free(p->changes);
+    memset(p, 0, sizeof(plan));
+}
+
+/*
+ * Adds to keep the paths of the plan with changes only the filesystem
+ * knows of, that git cannot see (sharebox.rwlock held). Returns how many.
+ */
+static long busy(plan *p, strlist *keep)
+{
+    char fpath[FILENAME_MAX];
+    size_t n, i, j;
+
+    n = keep->n;
+    for (i = 0; i < p->n; i++) {
+        snprintf(fpath, FILENAME_MAX, "%s/%s", sharebox.reporoot,
+                p->changes[i].path);
+        if (!slash_uncommitted(fpath))
+            continue;
+        for (j = 0; j < keep->n
+                && strcmp(keep->s[j], p->changes[i].path) != 0; j++)
+            ;
+        if (j == keep->n)
+            push(keep, p->changes[i].path);
+    }
+    return (long) (keep->n - n);
+}
+
+/*
+ * Adds to keep the paths of the plan with changes that were not
+ * committed, returns how many.
+ */
+static long dirty(plan *p, strlist *keep)
+{
+    char fpath[FILENAME_MAX];
+    struct stat st;
+    strlist paths;
+    size_t n, i;
+    long res;
+
+    memset(&paths, 0, sizeof(strlist));
+    n = keep->n;
+    for (i = 0; i < p->n; i++) {
+        /* a file the filesystem created where theirs adds one */
+        snprintf(fpath, FILENAME_MAX, "%s/%s", sharebox.reporoot,
+                p->changes[i].path);
+        if (p->changes[i].status == 'A' && lstat(fpath, &st) == 0
+                && !S_ISDIR(st.st_mode))
+            push(keep, p->changes[i].path);
+        else if (p->changes[i].status != 'A')
+            push(&paths, p->changes[i].path);
+    }
+    res = 0;
+    if (paths.n > 0)
+        res = git_dirty_paths(sharebox.reporoot, paths.s, paths.n,
+                found_dirty, keep);
+    clear(&paths);
+    return res == -1 ? -1 : (long) (keep->n - n);
+}
+
+/* creates the missing directories above fpath */
+static void mkparents(char *fpath)
+{
+    char *p;
+
+    for (p = fpath + strlen(sharebox.reporoot) + 1; (p = strchr(p, '/'));
+            p++) {
+        *p = '\0';
+        mkdir(fpath, 0755);
+        *p = '/';
+    }
+}
+
+/* removes the directories that removing fpath left empty */
+static void prune(char *fpath)
+{
+    char *p;
+
+    while ((p = strrchr(fpath, '/')) != NULL
+            && p > fpath + strlen(sharebox.reporoot)) {
+        *p = '\0';
+        if (rmdir(fpath) == -1)
+            break;
+    }
+}
+
+/*
+ * Moves what fpath has aside in tmpdir, to c->old. Returns 0 on success
+ * (nothing to move included), -1 on failure.
+ */
+static int set_aside(change *c, const char *fpath, const char *tmpdir)
+{
+    char old[FILENAME_MAX];
+    struct stat st;
+    int fd;
+
+    if (lstat(fpath, &st) == -1)
+        return errno == ENOENT ? 0 : -1;
+    snprintf(old, FILENAME_MAX, "%s/old.XXXXXX", tmpdir);
+    if ((fd = mkstemp(old)) == -1)
+        return -1;
+    close(fd);
+    if (rename(fpath, old) == -1) {
+        unlink(old);
+        return -1;
+    }
+    c->old = strdup(old);
+    return 0;
+}
+
+/* brings the worktree to the plan (sharebox.rwlock held) */
+static int apply(plan *p, const char *tmpdir)
+{
+    char fpath[FILENAME_MAX];
+    change *c;
+    size_t i;
+
+    /* removals first, they may free the names of new files */
+    for (i = 0; i < p->n; i++) {
+        c = &p->changes[i];
+        if (c->status != 'D')
+            continue;
+        snprintf(fpath, FILENAME_MAX, "%s/%s", sharebox.reporoot, c->path);
+        if (set_aside(c, fpath, tmpdir) == -1) {
+            perror(fpath);
+            return -1;
+        }
+        c->applied = true;
+        prune(fpath);
+    }
+    for (i = 0; i < p->n; i++) {
+        c = &p->changes[i];
+        if (c->status == 'D')
+            continue;
+        snprintf(fpath, FILENAME_MAX, "%s/%s", sharebox.reporoot, c->path);
+        mkparents(fpath);
+        if (set_aside(c, fpath, tmpdir) == -1) {
+            perror(fpath);
+            return -1;
+        }
+        c->applied = true;
+        if (rename(c->tmp, fpath) == -1) {
+            perror(fpath);
+            return -1;
+        }
+        free(c->tmp);
+        c->tmp = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Puts back what the paths the plan was applied to had, the last applied
+ * first (sharebox.rwlock held). What cannot be put back stays in tmpdir.
+ */
+static void roll_back(plan *p)
+{
+    char fpath[FILENAME_MAX];
+    change *c;
+    size_t i;
+
+    for (i = p->n; i-- > 0;) {
+        c = &p->changes[i];
+        if (!c->applied)
+            continue;
+        snprintf(fpath, FILENAME_MAX, "%s/%s", sharebox.reporoot, c->path);
+        if (c->old == NULL) {
+            /* the path is new: remove it, with the directories it took */
+            if (c->status != 'D' && c->tmp == NULL && unlink(fpath) == 0)
+                prune(fpath);
+        } else {
+            mkparents(fpath);
+            if (rename(c->old, fpath) == -1) {
+                fprintf(stderr, "%s: left in %s\n", fpath, c->old);
+            } else {
+                free(c->old);
+                c->old = NULL;
+            }
+        }
+        c->applied = false;
+    }
+}
+
+/* removes what the paths had, once the merge is done */
+static void drop_old(plan *p)
+{
+    size_t i;
+
+    for (i = 0; i < p->n; i++) {
+        if (p->changes[i].old)
+            unlink(p->changes[i].old);
+        free(p->changes[i].old);
+        p->changes[i].old = NULL;
+    }
+}
+
+/* records the changes of the paths under files/, for the event stream */
+static void record_events(plan *p)
+{
+    char path[FILENAME_MAX];
+    size_t i;
+
+    for (i = 0; i < p->n; i++) {
+        if (strncmp(p->changes[i].path, "files/", strlen("files/")) != 0)
+            continue;
+        snprintf(path, FILENAME_MAX, "/%s",
+                p->changes[i].path + strlen("files/"));
+        events_record(p->changes[i].status == 'D' ? 'D' : 'M', path);
+    }
+}
+
+/*
+ * Interface
+ */
+
+/*
+ * Merges the commit theirs of the peer named peer into HEAD and the
+ * worktree. Returns 0 on success, -1 on failure.
+ */
+int merge_commit(const char *peer, const char *theirs)
+{
+    char ours[41], base[41], tree[41], merged[41], now[41];
+    char tmpdir[FILENAME_MAX], message[FILENAME_MAX];
+    strlist keep, changed;
+    plan p;
+    size_t i;
+    long n;
+    int tries, res;
+
+    snprintf(tmpdir, FILENAME_MAX, "%s/.git/sharebox/merge",
+            sharebox.reporoot);
+    mkdir(tmpdir, 0755);
+    snprintf(message, FILENAME_MAX, "merged %s", peer);
+    memset(&keep, 0, sizeof(strlist));
+    memset(&changed, 0, sizeof(strlist));
+    memset(&p, 0, sizeof(plan));
+
+    res = -1;
+    for (tries = 0; tries < MERGE_TRIES; tries++) {
+        /* from everything the filesystem did so far, the attributes of
+           annexed files included */
+        pthread_mutex_lock(&sharebox.rwlock);
+        metadata_flush();
+        git_commit_flush(sharebox.reporoot);
+        pthread_mutex_unlock(&sharebox.rwlock);
+        if (git_head(sharebox.reporoot, ours) == -1)
+            break;
+        if (git_merge_base(sharebox.reporoot, ours, theirs, base) == -1)
+            base[0] = '\0';
+        if (strcmp(base, theirs) == 0) {
+            /* nothing we do not have already */
+            res = 0;
+            break;
+        }
+        if (strcmp(base, ours) == 0 && keep.n == 0)
+            strcpy(merged, theirs);
+        else if (git_merge_trees(sharebox.reporoot, base[0] ? base : NULL,
+                    ours, theirs, peer, keep.s, keep.n, tree) == -1
+                || git_commit_tree(sharebox.reporoot, tree, ours, theirs,
+                    message, merged) == -1)
+            break;
+        if (git_tree_changes(sharebox.reporoot, ours, merged, tmpdir,
+                    found_change, &p) == -1)
+            break;
+        printf("%s: merging %lu paths\n", peer, (unsigned long) p.n);
+        /* paths with uncommitted changes: merge again around them */
+        pthread_mutex_lock(&sharebox.rwlock);
+        n = busy(&p, &keep);
+        pthread_mutex_unlock(&sharebox.rwlock);
+        if (n != 0 || dirty(&p, &keep) != 0) {
+            discard(&p);
+            continue;
+        }
+
+        pthread_mutex_lock(&sharebox.rwlock);
+        git_commit_flush(sharebox.reporoot);
+        if (git_head(sharebox.reporoot, now) == -1 || strcmp(now, ours) != 0
+                || busy(&p, &keep) != 0 || dirty(&p, &keep) != 0) {
+            /* the filesystem moved on while the merge was computed */
+            pthread_mutex_unlock(&sharebox.rwlock);
+            discard(&p);
+            continue;
+        }
+        res = apply(&p, tmpdir);
+        if (res == 0) {
+            for (i = 0; i < p.n; i++)
+                push(&changed, p.changes[i].path);
+            if (git_move_head(sharebox.reporoot, ours, merged, changed.s,
+                        changed.n) != 0)
+                res = -1;
+        }
+        if (res == 0) {
+            drop_old(&p);
+            /* the attributes of annexed files are read at mount only */
+            for (i = 0; i < p.n; i++)
+                if (strcmp(p.changes[i].path, ".sharebox-metadata") == 0)
+                    metadata_reload();
+            record_events(&p);
+            events_publish(merged);
+        } else {
+            fprintf(stderr, "%s: merge failed, rolled back\n", peer);
+            roll_back(&p);
+        }
+        pthread_mutex_unlock(&sharebox.rwlock);
+        break;
+    }
+    if (tries == MERGE_TRIES)
+        fprintf(stderr, "%s: the filesystem kept changing, merge later\n",
+                peer);
+    discard(&p);
+    clear(&keep);
+    clear(&changed);
+    return res;
+}
@@ -0,0 +1,7 @@
+/*
+ * merge.h
+ */
+
+#include "common.h"
+
+int merge_commit(const char *peer, const char *theirs);
@@ -0,0 +1,471 @@
+/*
+ * Metadata of annexed files
+ *
+ * Changing the mode, owner or times of a locked file used to unlock it,
+ * that is copy its content, only for the content to be hashed and added
+ * again. Instead, the attributes set on annexed files are recorded here
+ * and presented by getattr on top of those of the object.
+ *
+ * Records are kept in .sharebox-metadata, next to files/, as lines of
+ * "fields mode uid gid atime mtime path" where fields tells which of them
+ * are set (none means the record was removed) and the last line for a
+ * path wins. The file is committed in batches: every METADATA_BATCH
+ * changes, METADATA_DELAY seconds after the oldest uncommitted one (by a
+ * thread that waits for it), and on unmount.
+ */
+
+#include "metadata.h"
+#include "git-annex.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+#define METADATA_BUCKETS 4096
+#define METADATA_BATCH   4096
+#define METADATA_DELAY   60
+
+enum {
+    META_MODE = 1,
+    META_OWNER = 2,
+    META_TIMES = 4,
+};
+
+typedef struct record record;
+struct record
+{
+    char *path;
+    int fields;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec atime, mtime;
+    record *next;
+};
+
+static struct {
+    const char *repodir;
+    char path[FILENAME_MAX];
+    record *buckets[METADATA_BUCKETS];
+    size_t records, lines;
+    size_t changes;             /* not committed yet */
+    time_t first_change;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* a first change, or unmounting */
+    pthread_t flusher;
+    bool running, stop;
+} md = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Helpers (called with md.lock held)
+ */
+
+static unsigned long hash(const char *path)
+{
+    unsigned long h = 5381;
+    for (; *path; path++)
+        h = h * 33 + (unsigned char) *path;
+    return h % METADATA_BUCKETS;
+}
+
+static record *lookup(const char *path, bool create)
+{
+    record *r;
+    for (r = md.buckets[hash(path)]; r != NULL; r = r->next)
+        if (strcmp(r->path, path) == 0)
+            return r;
+    if (!create)
+        return NULL;
+    r = calloc(1, sizeof(record));
+    r->path = strdup(path);
+    r->next = md.buckets[hash(path)];
+    md.buckets[hash(path)] = r;
+    md.records++;
+    return r;
+}
+
+static void drop(record *r)
+{
+    record **p;
+    for (p = &md.buckets[hash(r->path)]; *p != r; p = &(*p)->next)
+        ;
+    *p = r->next;
+    free(r->path);
+    free(r);
+    md.records--;
+}
+
+static void write_record(FILE *f, const record *r)
+{
+    fprintf(f, "%d %o %u %u %lld.%09ld %lld.%09ld %s\n", r->fields,
+            (unsigned int) r->mode, (unsigned int) r->uid,
+            (unsigned int) r->gid,
+            (long long) r->atime.tv_sec, r->atime.tv_nsec,
+            (long long) r->mtime.tv_sec, r->mtime.tv_nsec, r->path);
+}
+
+static void rewrite(void)
+{
+    char tmp[FILENAME_MAX + 8];
+    record *r;
+    FILE *f;
+    int i;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", md.path);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return;
+    for (i = 0; i < METADATA_BUCKETS; i++)
+        for (r = md.buckets[i]; r != NULL; r = r->next)
+            write_record(f, r);
+    if (fclose(f) == 0 && rename(tmp, md.path) == 0)
+        md.lines = md.records;
+}
+
+static void commit(void)
+{
+    size_t changes;
+
+    if (md.changes == 0)
+        return;
+    changes = md.changes;
+    md.changes = 0;
+    rewrite();
+    git_add(md.repodir, md.path);
+    git_commit(md.repodir, "changed metadata %zu times", changes);
+}
+
+/* journals the new state of r, drops it if it became empty */
+static void changed(record *r)
+{
+    FILE *f;
+    time_t now;
+
+    if ((f = fopen(md.path, "a")) != NULL) {
+        write_record(f, r);
+        fclose(f);
+        md.lines++;
+    }
+    if (r->fields == 0)
+        drop(r);
+
+    now = time(NULL);
+    if (md.changes++ == 0) {
+        md.first_change = now;
+        pthread_cond_signal(&md.cond);
+    }
+    if (md.changes >= METADATA_BATCH || now - md.first_change > METADATA_DELAY)
+        commit();
+}
+
+/* commits the changes that waited METADATA_DELAY seconds */
+static void *flusher(void *arg)
+{
+    struct timespec ts;
+    (void) arg;
+
+    pthread_mutex_lock(&md.lock);
+    while (!md.stop) {
+        if (md.changes == 0) {
+            pthread_cond_wait(&md.cond, &md.lock);
+            continue;
+        }
+        if (time(NULL) - md.first_change < METADATA_DELAY) {
+            ts.tv_sec = md.first_change + METADATA_DELAY;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&md.cond, &md.lock, &ts);
+            continue;
+        }
+        /* the index belongs to whoever holds sharebox.rwlock, which is
+           taken before md.lock */
+        pthread_mutex_unlock(&md.lock);
+        pthread_mutex_lock(&sharebox.rwlock);
+        pthread_mutex_lock(&md.lock);
+        commit();
+        pthread_mutex_unlock(&sharebox.rwlock);
+    }
+    pthread_mutex_unlock(&md.lock);
+    return NULL;
+}
+
+/* the time ts stands for: now for UTIME_NOW, old for UTIME_OMIT */
+static struct timespec resolve(const struct timespec *ts,
+        struct timespec old)
+{
+    struct timespec now;
+
+    if (ts->tv_nsec == UTIME_OMIT)
+        return old;
+    if (ts->tv_nsec == UTIME_NOW) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now;
+    }
+    return *ts;
+}
+
+/* reads the records of the file, the last line of a path winning */
+static void load(void)
+{
+    char line[FILENAME_MAX + 128], *p;
+    long long asec, msec;
+    unsigned int mode, uid, gid;
+    record rec, *r;
+    int n;
+    FILE *f;
+
+    if ((f = fopen(md.path, "r")) == NULL)
+        return;
+    while (fgets(line, sizeof line, f) != NULL) {
+        if ((p = strchr(line, '\n')))
+            *p = '\0';
+        md.lines++;
+        if (sscanf(line, "%d %o %u %u %lld.%ld %lld.%ld %n", &rec.fields,
+                    &mode, &uid, &gid, &asec, &rec.atime.tv_nsec,
+                    &msec, &rec.mtime.tv_nsec, &n) != 8)
+            continue;
+        r = lookup(line + n, true);
+        r->fields = rec.fields;
+        r->mode = mode;
+        r->uid = uid;
+        r->gid = gid;
+        r->atime.tv_sec = asec;
+        r->atime.tv_nsec = rec.atime.tv_nsec;
+        r->mtime.tv_sec = msec;
+        r->mtime.tv_nsec = rec.mtime.tv_nsec;
+        if (r->fields == 0)
+            drop(r);
+    }
+    fclose(f);
+    if (md.lines > 2 * md.records)
+        rewrite();
+}
+
+static void forget(void)
+{
+    record *r, *next;
+    int i;
+
+    for (i = 0; i < METADATA_BUCKETS; i++) {
+        for (r = md.buckets[i]; r != NULL; r = next) {
+            next = r->next;
+            free(r->path);
+            free(r);
+        }
+        md.buckets[i] = NULL;
+    }
+    md.records = md.lines = 0;
+}
+
+/*
+ * Interface
+ */
+
+void metadata_init(const char *repodir)
+{
+    md.repodir = repodir;
+    snprintf(md.path, FILENAME_MAX, "%s/.sharebox-metadata", repodir);
+    md.stop = false;
+    md.running = pthread_create(&md.flusher, NULL, flusher, NULL) == 0;
+    pthread_mutex_lock(&md.lock);
+    load();
+    pthread_mutex_unlock(&md.lock);
+}
+
+void metadata_destroy(void)
+{
+    if (md.running) {
+        pthread_mutex_lock(&md.lock);
+        md.stop = true;
+        pthread_cond_signal(&md.cond);
+        pthread_mutex_unlock(&md.lock);
+        pthread_join(md.flusher, NULL);
+        md.running = false;
+    }
+    metadata_flush();
+    pthread_mutex_lock(&md.lock);
+    forget();
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * Reads the records again, once something else than the filesystem (a
+ * merge) replaced the file. Changes not committed yet are lost, so it is
+ * meant for when there are none (sharebox.rwlock held).
+ */
+void metadata_reload(void)
+{
+    pthread_mutex_lock(&md.lock);
+    forget();
+    md.changes = 0;
+    load();
+    pthread_mutex_unlock(&md.lock);
+}
+
+void metadata_chmod(const char *path, mode_t mode)
+{
+    record *r;
+    pthread_mutex_lock(&md.lock);
+    r = lookup(path, true);
+    r->fields |= META_MODE;
+    r->mode = mode & 07777;
+    changed(r);
+    pthread_mutex_unlock(&md.lock);
+}
+
+void metadata_chown(const char *path, uid_t uid, gid_t gid)
+{
+    record *r;
+    struct stat st;
+    char fpath[FILENAME_MAX];
+
+    pthread_mutex_lock(&md.lock);
+    r = lookup(path, true);
+    /* -1 leaves one of them unchanged */
+    if (!(r->fields & META_OWNER)) {
+        snprintf(fpath, FILENAME_MAX, "%s/files%s", md.repodir, path);
+        if (stat(fpath, &st) != -1) {
+            r->uid = st.st_uid;
+            r->gid = st.st_gid;
+        }
+    }
+    r->fields |= META_OWNER;
+    if (uid != (uid_t) -1)
+        r->uid = uid;
+    if (gid != (gid_t) -1)
+        r->gid = gid;
+    changed(r);
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * Records the times ts of path, which may be UTIME_NOW or UTIME_OMIT as
+ * with utimensat().
+ */
+void metadata_utimens(const char *path, const struct timespec ts[2])
+{
+    record *r;
+    struct stat st;
+    char fpath[FILENAME_MAX];
+
+    if (ts[0].tv_nsec == UTIME_OMIT && ts[1].tv_nsec == UTIME_OMIT)
+        return;
+    pthread_mutex_lock(&md.lock);
+    r = lookup(path, true);
+    /* an omitted time keeps the one presented so far */
+    if (!(r->fields & META_TIMES)) {
+        snprintf(fpath, FILENAME_MAX, "%s/files%s", md.repodir, path);
+        if (stat(fpath, &st) != -1) {
+            r->atime = st.st_atim;
+            r->mtime = st.st_mtim;
+        }
+    }
+    r->fields |= META_TIMES;
+    r->atime = resolve(&ts[0], r->atime);
+    r->mtime = resolve(&ts[1], r->mtime);
+    changed(r);
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * New content comes with its own times.
+ */
+void metadata_content_changed(const char *path)
+{
+    record *r;
+    pthread_mutex_lock(&md.lock);
+    if ((r = lookup(path, false)) != NULL && (r->fields & META_TIMES)) {
+        r->fields &= ~META_TIMES;
+        changed(r);
+    }
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * Moves the record of from, or the records below it if it is a
+ * directory.
+ */
+void metadata_rename(const char *from, const char *to)
+{
+    char path[FILENAME_MAX];
+    record *r, *next, *moved, *n;
+    size_t len;
+    int i;
+
+    pthread_mutex_lock(&md.lock);
+    len = strlen(from);
+    moved = NULL;
+    for (i = 0; i < METADATA_BUCKETS; i++) {
+        for (r = md.buckets[i]; r != NULL; r = next) {
+            next = r->next;
+            if (strncmp(r->path, from, len) != 0
+                    || (r->path[len] != '\0' && r->path[len] != '/'))
+                continue;
+            snprintf(path, FILENAME_MAX, "%s%s", to, r->path + len);
+            n = calloc(1, sizeof(record));
+            *n = *r;
+            n->path = strdup(path);
+            n->next = moved;
+            moved = n;
+            r->fields = 0;
+            changed(r);
+        }
+    }
+    for (r = moved; r != NULL; r = next) {
+        next = r->next;
+        n = lookup(r->path, true);
+        n->fields = r->fields;
+        n->mode = r->mode;
+        n->uid = r->uid;
+        n->gid = r->gid;
+        n->atime = r->atime;
+        n->mtime = r->mtime;
+        changed(n);
+        free(r->path);
+        free(r);
+    }
+    pthread_mutex_unlock(&md.lock);
+}
+
+void metadata_remove(const char *path)
+{
+    record *r;
+    pthread_mutex_lock(&md.lock);
+    if ((r = lookup(path, false)) != NULL) {
+        r->fields = 0;
+        changed(r);
+    }
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * Presents the recorded attributes of path in st.
+ */
+void metadata_apply(const char *path, struct stat *st)
+{
+    record *r;
+    pthread_mutex_lock(&md.lock);
+    if ((r = lookup(path, false)) != NULL) {
+        if (r->fields & META_MODE)
+            st->st_mode = (st->st_mode & S_IFMT) | r->mode;
+        if (r->fields & META_OWNER) {
+            st->st_uid = r->uid;
+            st->st_gid = r->gid;
+        }
+        if (r->fields & META_TIMES) {
+            st->st_atim = r->atime;
+            st->st_mtim = r->mtime;
+        }
+    }
+    pthread_mutex_unlock(&md.lock);
+}
+
+/*
+ * Commits what changed since the last commit.
+ */
+void metadata_flush(void)
+{
+    pthread_mutex_lock(&md.lock);
+    commit();
+    pthread_mutex_unlock(&md.lock);
+}
@@ -0,0 +1,17 @@
+/*
+ * metadata.h
+ */
+
+#include "common.h"
+
+void metadata_init(const char *repodir);
+void metadata_destroy(void);
+void metadata_chmod(const char *path, mode_t mode);
+void metadata_chown(const char *path, uid_t uid, gid_t gid);
+void metadata_utimens(const char *path, const struct timespec ts[2]);
+void metadata_content_changed(const char *path);
+void metadata_rename(const char *from, const char *to);
+void metadata_remove(const char *path);
+void metadata_apply(const char *path, struct stat *st);
+void metadata_flush(void);
+void metadata_reload(void);
@@ -0,0 +1,210 @@
+/*
+ * Notification of written files (-o write_callback=PROGRAM)
+ *
+ * For those who want instant updates rather than scheduled syncs, the
+ * program given as write_callback is told which files changed. Running it
+ * on each write would fork for every save of every file, so the paths are
+ * collected instead, each once, and handed over in batches: a batch goes
+ * once no path was added for -o write_callback_delay milliseconds, or
+ * NOTIFY_MAX_WAIT seconds after its first path, whichever comes first.
+ *
+ * The program is run by a single thread, with the paths of the batch on
+ * its standard input, one per line (relative to the mountpoint, starting
+ * with '/'). Paths that change while it runs make the next batch.
+ */
+
+#include "notify.h"
+
+#include <time.h>
+#include <sys/wait.h>
+
+#define NOTIFY_BUCKETS  1024
+#define NOTIFY_MAX_WAIT 30      /* seconds a path may wait under writes */
+
+typedef struct entry entry;
+struct entry
+{
+    char *path;
+    entry *next;    /* in its bucket */
+};
+
+static struct {
+    const char *program;
+    int delay;                  /* ms */
+    entry *buckets[NOTIFY_BUCKETS];
+    char **paths;               /* in the order they came */
+    size_t n, cap;
+    struct timespec first, last;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running, stop;
+    unsigned long batches, notified;
+} nt = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static unsigned long hash(const char *path)
+{
+    unsigned long h = 5381;
+    for (; *path; path++)
+        h = h * 33 + (unsigned char) *path;
+    return h % NOTIFY_BUCKETS;
+}
+
+static void add_ms(struct timespec *ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static bool reached(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec
+            && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* takes the pending paths away (called with nt.lock held) */
+static char **take(size_t *n)
+{
+    char **paths;
+    entry *e, *next;
+    int i;
+
+    for (i = 0; i < NOTIFY_BUCKETS; i++) {
+        for (e = nt.buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        nt.buckets[i] = NULL;
+    }
+    paths = nt.paths;
+    *n = nt.n;
+    nt.paths = NULL;
+    nt.n = nt.cap = 0;
+    return paths;
+}
+
+static void run(char **paths, size_t n)
+{
+    FILE *in;
+    size_t i;
+    int status;
+
+    if ((in = popen(nt.program, "w")) == NULL) {
+        perror(nt.program);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        fprintf(in, "%s\n", paths[i]);
+    status = pclose(in);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "%s: failed on a batch of %lu paths\n", nt.program,
+                (unsigned long) n);
+}
+
+static void *notifier(void *arg)
+{
+    struct timespec quiet, oldest;
+    char **paths;
+    size_t n, i;
+    (void) arg;
+
+    pthread_mutex_lock(&nt.lock);
+    while (!nt.stop || nt.n > 0) {
+        if (nt.n == 0) {
+            pthread_cond_wait(&nt.cond, &nt.lock);
+            continue;
+        }
+        quiet = nt.last;
+        add_ms(&quiet, nt.delay);
+        oldest = nt.first;
+        oldest.tv_sec += NOTIFY_MAX_WAIT;
+        if (!nt.stop && !reached(&quiet) && !reached(&oldest)) {
+            pthread_cond_timedwait(&nt.cond, &nt.lock,
+                    quiet.tv_sec < oldest.tv_sec
+                    || (quiet.tv_sec == oldest.tv_sec
+                        && quiet.tv_nsec < oldest.tv_nsec) ? &quiet : &oldest);
+            continue;
+        }
+        paths = take(&n);
+        nt.batches++;
+        nt.notified += n;
+        pthread_mutex_unlock(&nt.lock);
+
+        run(paths, n);
+        for (i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+
+        pthread_mutex_lock(&nt.lock);
+    }
+    pthread_mutex_unlock(&nt.lock);
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+void notify_init(const char *program, int delay)
+{
+    nt.program = program;
+    nt.delay = delay > 0 ? delay : 0;
+    nt.stop = false;
+    if (program)
+        nt.running = pthread_create(&nt.thread, NULL, notifier, NULL) == 0;
+}
+
+/* hands the last batch over before returning */
+void notify_destroy(void)
+{
+    if (!nt.running)
+        return;
+    pthread_mutex_lock(&nt.lock);
+    nt.stop = true;
+    pthread_cond_signal(&nt.cond);
+    pthread_mutex_unlock(&nt.lock);
+    pthread_join(nt.thread, NULL);
+    nt.running = false;
+    printf("write_callback: %lu paths in %lu batches\n", nt.notified,
+            nt.batches);
+}
+
+/* To be called when the file path (relative to the mountpoint) changed */
+void notify_changed(const char *path)
+{
+    unsigned long h;
+    entry *e;
+
+    if (!nt.running)
+        return;
+    h = hash(path);
+    pthread_mutex_lock(&nt.lock);
+    clock_gettime(CLOCK_REALTIME, &nt.last);
+    for (e = nt.buckets[h]; e != NULL; e = e->next)
+        if (strcmp(e->path, path) == 0)
+            break;
+    if (e == NULL) {
+        if (nt.n == 0)
+            nt.first = nt.last;
+        if (nt.n == nt.cap) {
+            nt.cap = nt.cap ? 2 * nt.cap : 64;
+            nt.paths = realloc(nt.paths, nt.cap * sizeof(char *));
+        }
+        nt.paths[nt.n++] = strdup(path);
+        e = malloc(sizeof(entry));
+        e->path = nt.paths[nt.n - 1];
+        e->next = nt.buckets[h];
+        nt.buckets[h] = e;
+    }
+    pthread_cond_signal(&nt.cond);
+    pthread_mutex_unlock(&nt.lock);
+}
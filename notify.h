@@ -0,0 +1,9 @@
+/*
+ * notify.h
+ */
+
+#include "common.h"
+
+void notify_init(const char *program, int delay);
+void notify_destroy(void);
+void notify_changed(const char *path);
@@ -0,0 +1,687 @@
+/*
+ * Write overlay for large annexed files
+ *
+ * Writing a few bytes in a large locked file would otherwise unlock it,
+ * that is copy the whole object. Instead, the blocks that get modified are
+ * copied to a sparse delta file, and reads merge the delta with the
+ * object. The overlay of a path is shared by all the handles open on it.
+ *
+ * The delta lives in .git/sharebox/overlay, named after the key of the
+ * object it overlays, next to a map of its blocks (KEY.map: "basesize
+ * size nblocks", the path, then the bitmap of the dirty blocks) written at
+ * each release. It outlives the handles, the releases and the mount:
+ * the next writes go on in the same delta, and only once the path was
+ * left alone for OVERLAY_IDLE seconds, or on unmount, is the overlay
+ * compacted: the object is cloned (reflinked when possible), the modified
+ * blocks are written over the clone, and the result replaces the link so
+ * that it gets added and committed. If that fails, the delta stays for the
+ * next attempt. The overlays left by a previous mount are picked up at
+ * init.
+ */
+
+#include "overlay.h"
+#include "clone.h"
+#include "git-annex.h"
+#include "qos.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+
+#define OVERLAY_BLOCK (64 << 10)
+#define OVERLAY_IDLE  10        /* seconds without a handle to compact */
+
+struct overlay
+{
+    char path[FILENAME_MAX];
+    char delta_path[FILENAME_MAX];
+    int base;                   /* locked object */
+    int delta;                  /* modified blocks, at their offset */
+    off_t basesize;             /* bytes of base still visible */
+    off_t size;
+    unsigned char *dirty;       /* blocks living in delta */
+    size_t nblocks;
+    int refs;
+    time_t released;            /* when refs went to 0 */
+    bool removed;               /* its path is gone, drop it with refs */
+    pthread_mutex_t lock;
+    overlay *next;
+};
+
+static overlay *overlays;
+static pthread_mutex_t overlays_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    const char *repodir;
+    char dir[FILENAME_MAX - NAME_MAX - 8];
+    void (*commit)(const char *fpath);
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running, stop;
+} ov = {
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Helpers (called with o->lock held)
+ */
+
+static bool isdirty(overlay *o, size_t block)
+{
+    return block < o->nblocks && (o->dirty[block / 8] & (1 << (block % 8)));
+}
+
+static void setdirty(overlay *o, size_t block)
+{
+    size_t n;
+    if (block >= o->nblocks) {
+        n = (block + 1) * 2;
+        o->dirty = realloc(o->dirty, (n + 7) / 8);
+        memset(o->dirty + (o->nblocks + 7) / 8, 0,
+                (n + 7) / 8 - (o->nblocks + 7) / 8);
+        o->nblocks = (n + 7) / 8 * 8;
+    }
+    o->dirty[block / 8] |= 1 << (block % 8);
+}
+
+/* reads from the object, with zeroes past what remains of it */
+static int read_base(overlay *o, char *buf, size_t size, off_t offset)
+{
+    ssize_t n;
+    n = 0;
+    if (offset < o->basesize) {
+        if (offset + (off_t) size > o->basesize)
+            n = o->basesize - offset;
+        else
+            n = size;
+        if ((n = pread(o->base, buf, n, offset)) == -1)
+            return -1;
+    }
+    memset(buf + n, 0, size - n);
+    return size;
+}
+
+/* reads from the delta, which may end before the overlay after a truncate */
+static int read_delta(overlay *o, char *buf, size_t size, off_t offset)
+{
+    ssize_t n;
+    if ((n = pread(o->delta, buf, size, offset)) == -1)
+        return -1;
+    memset(buf + n, 0, size - n);
+    return size;
+}
+
+/* moves a block to the delta before it gets partially overwritten */
+static int copy_block(overlay *o, size_t block)
+{
+    char buf[OVERLAY_BLOCK];
+    off_t offset = (off_t) block * OVERLAY_BLOCK;
+
+    if (read_base(o, buf, OVERLAY_BLOCK, offset) == -1)
+        return -1;
+    if (pwrite(o->delta, buf, OVERLAY_BLOCK, offset) == -1)
+        return -1;
+    setdirty(o, block);
+    return 0;
+}
+
+/* the map of the blocks of a delta */
+static void map_path(overlay *o, char map[FILENAME_MAX + 8])
+{
+    snprintf(map, FILENAME_MAX + 8, "%s.map", o->delta_path);
+}
+
+/* writes the map of o, for its delta to outlive the mount */
+static int save_map(overlay *o)
+{
+    char map[FILENAME_MAX + 8], tmp[FILENAME_MAX + 16];
+    FILE *f;
+
+    map_path(o, map);
+    snprintf(tmp, sizeof tmp, "%s.tmp", map);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return -1;
+    fprintf(f, "%lld %lld %lu\n%s\n", (long long) o->basesize,
+            (long long) o->size, (unsigned long) o->nblocks,
+            o->path + strlen(ov.repodir) + 1);
+    if (o->nblocks > 0)
+        fwrite(o->dirty, 1, (o->nblocks + 7) / 8, f);
+    if (fclose(f) != 0 || rename(tmp, map) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* removes the delta of o and its map, once they are of no use */
+static void remove_delta(overlay *o)
+{
+    char map[FILENAME_MAX + 8];
+
+    map_path(o, map);
+    unlink(map);
+    unlink(o->delta_path);
+}
+
+static void free_overlay(overlay *o)
+{
+    overlay **p;
+    for (p = &overlays; *p != NULL; p = &(*p)->next) {
+        if (*p == o) {
+            *p = o->next;
+            break;
+        }
+    }
+    close(o->base);
+    close(o->delta);
+    free(o->dirty);
+    pthread_mutex_destroy(&o->lock);
+    free(o);
+}
+
+/* writes the merged content over the link */
+static int compact(overlay *o, const char *repodir)
+{
+    char tmp[FILENAME_MAX], buf[OVERLAY_BLOCK];
+    struct stat st;
+    size_t block, len;
+    off_t offset;
+    int out;
+
+    snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp", repodir);
+    mkdir(tmp, 0755);
+    snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp/overlay.XXXXXX", repodir);
+    if ((out = mkstemp(tmp)) == -1)
+        return -1;
+    if (fstat(o->base, &st) == -1 || clone_fd(o->base, out, st.st_size) == -1)
+        goto error;
+    if (ftruncate(out, o->basesize) == -1 || ftruncate(out, o->size) == -1)
+        goto error;
+    for (block = 0; block < o->nblocks; block++) {
+        offset = (off_t) block * OVERLAY_BLOCK;
+        if (!isdirty(o, block) || offset >= o->size)
+            continue;
+        len = o->size - offset < OVERLAY_BLOCK ? o->size - offset : OVERLAY_BLOCK;
+        if (read_delta(o, buf, len, offset) == -1
+                || pwrite(out, buf, len, offset) == -1)
+            goto error;
+    }
+    if (fchmod(out, (st.st_mode & 0777) | S_IWUSR) == -1 || close(out) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, o->path);
+
+error:
+    close(out);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ * Interface
+ */
+
+overlay *overlay_find(const char *fpath)
+{
+    overlay *o;
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    pthread_mutex_unlock(&overlays_lock);
+    return o;
+}
+
+/*
+ * Returns the overlay of the annexed file fpath, creating it if needed,
+ * NULL if it cannot have one (another path already has an overlay on the
+ * same object).
+ */
+overlay *overlay_open(const char *repodir, const char *fpath)
+{
+    char key[FILENAME_MAX];
+    struct stat st;
+    overlay *o;
+
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    if (o) {
+        pthread_mutex_lock(&o->lock);
+        o->refs++;
+        pthread_mutex_unlock(&o->lock);
+        pthread_mutex_unlock(&overlays_lock);
+        return o;
+    }
+
+    o = calloc(1, sizeof(overlay));
+    o->base = o->delta = -1;
+    strncpy(o->path, fpath, FILENAME_MAX - 1);
+    if (!ov.running || git_annex_key(fpath, key) == -1
+            || snprintf(o->delta_path, FILENAME_MAX, "%s/%s", ov.dir, key)
+            >= FILENAME_MAX
+            || (o->base = open(fpath, O_RDONLY)) == -1
+            || fstat(o->base, &st) == -1
+            || (o->delta = open(o->delta_path, O_RDWR | O_CREAT | O_EXCL,
+                    0600)) == -1) {
+        if (o->base != -1)
+            close(o->base);
+        free(o);
+        pthread_mutex_unlock(&overlays_lock);
+        return NULL;
+    }
+    o->basesize = o->size = st.st_size;
+    o->refs = 1;
+    pthread_mutex_init(&o->lock, NULL);
+    o->next = overlays;
+    overlays = o;
+    pthread_mutex_unlock(&overlays_lock);
+    (void) repodir;
+    return o;
+}
+
+int overlay_read(overlay *o, char *buf, size_t size, off_t offset)
+{
+    size_t block, done, len;
+    off_t off;
+    int res;
+
+    pthread_mutex_lock(&o->lock);
+    if (offset >= o->size)
+        size = 0;
+    else if (offset + (off_t) size > o->size)
+        size = o->size - offset;
+
+    res = 0;
+    for (done = 0; done < size && res != -1; done += len) {
+        off = offset + done;
+        block = off / OVERLAY_BLOCK;
+        len = (block + 1) * (off_t) OVERLAY_BLOCK - off;
+        if (len > size - done)
+            len = size - done;
+        if (isdirty(o, block))
+            res = read_delta(o, buf + done, len, off);
+        else
+            res = read_base(o, buf + done, len, off);
+    }
+    pthread_mutex_unlock(&o->lock);
+    return res == -1 ? -1 : (int) size;
+}
+
+int overlay_write(overlay *o, const char *buf, size_t size, off_t offset)
+{
+    size_t block, first, last;
+    int res;
+
+    /* an empty write has no last block, and must not grow the file */
+    if (size == 0)
+        return 0;
+    pthread_mutex_lock(&o->lock);
+    res = 0;
+    first = offset / OVERLAY_BLOCK;
+    last = (offset + size - 1) / OVERLAY_BLOCK;
+    for (block = first; block <= last && res != -1; block++) {
+        if (isdirty(o, block))
+            continue;
+        /* whole blocks need not be copied */
+        if ((block != first || offset % OVERLAY_BLOCK == 0)
+                && (block != last || (offset + size) % OVERLAY_BLOCK == 0))
+            setdirty(o, block);
+        else
+            res = copy_block(o, block);
+    }
+    if (res != -1)
+        res = pwrite(o->delta, buf, size, offset);
+    if (res != -1 && offset + (off_t) size > o->size)
+        o->size = offset + size;
+    pthread_mutex_unlock(&o->lock);
+    return res;
+}
+
+int overlay_truncate(overlay *o, off_t size)
+{
+    size_t block;
+    int res;
+
+    pthread_mutex_lock(&o->lock);
+    /* what is cut must read as zeroes if the file grows again */
+    if (size < o->basesize)
+        o->basesize = size;
+    res = 0;
+    block = size / OVERLAY_BLOCK;
+    if (size < o->size && size % OVERLAY_BLOCK && isdirty(o, block))
+        res = ftruncate(o->delta, size);
+    for (block = (size + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK;
+            block < o->nblocks; block++)
+        o->dirty[block / 8] &= ~(1 << (block % 8));
+    o->size = size;
+    /* with no handle, the map on disk is the only one */
+    if (res != -1 && o->refs == 0)
+        res = save_map(o);
+    pthread_mutex_unlock(&o->lock);
+    return res;
+}
+
+/*
+ * Gets the size of fpath as seen through its overlay. Returns -1 if it
+ * has none.
+ */
+int overlay_size(const char *fpath, off_t *size)
+{
+    overlay *o;
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    if (o) {
+        pthread_mutex_lock(&o->lock);
+        *size = o->size;
+        pthread_mutex_unlock(&o->lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+    return o ? 0 : -1;
+}
+
+/*
+ * Drops a reference. The last one saves the map of the overlay, which is
+ * compacted later on. Returns -1 if the map could not be saved: the writes
+ * are still in the delta, but would not survive the mount.
+ */
+int overlay_release(overlay *o, const char *repodir)
+{
+    int res;
+    (void) repodir;
+
+    pthread_mutex_lock(&overlays_lock);
+    pthread_mutex_lock(&o->lock);
+    res = 0;
+    if (o->refs > 0)
+        o->refs--;
+    if (o->refs == 0 && o->removed) {
+        remove_delta(o);
+        pthread_mutex_unlock(&o->lock);
+        free_overlay(o);
+    } else {
+        if (o->refs == 0) {
+            o->released = time(NULL);
+            if ((res = save_map(o)) == -1)
+                perror(o->delta_path);
+        }
+        pthread_mutex_unlock(&o->lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+    return res;
+}
+
+/* to be called when fpath is renamed to to */
+void overlay_rename(const char *fpath, const char *to)
+{
+    overlay *o;
+
+    overlay_remove(to);
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    if (o) {
+        pthread_mutex_lock(&o->lock);
+        snprintf(o->path, FILENAME_MAX, "%s", to);
+        if (o->refs == 0 && save_map(o) == -1)
+            perror(o->delta_path);
+        pthread_mutex_unlock(&o->lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+}
+
+/* to be called when fpath is removed: its writes go with it */
+void overlay_remove(const char *fpath)
+{
+    overlay *o;
+
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    if (o) {
+        pthread_mutex_lock(&o->lock);
+        o->removed = true;
+        if (o->refs == 0) {
+            remove_delta(o);
+            pthread_mutex_unlock(&o->lock);
+            free_overlay(o);
+        } else
+            pthread_mutex_unlock(&o->lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+}
+
+/*
+ * Compaction
+ */
+
+/*
+ * Compacts the overlay of fpath if no handle has it, and has it committed
+ * (sharebox.rwlock held). Returns 0 if it is done with, -1 if the delta
+ * stays.
+ */
+static int compact_path(const char *fpath)
+{
+    char path[FILENAME_MAX];
+    overlay *o;
+    int res;
+
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = o->next)
+        if (strcmp(o->path, fpath) == 0 && !o->removed)
+            break;
+    if (o == NULL) {
+        pthread_mutex_unlock(&overlays_lock);
+        return 0;
+    }
+    pthread_mutex_lock(&o->lock);
+    if (o->refs > 0) {
+        pthread_mutex_unlock(&o->lock);
+        pthread_mutex_unlock(&overlays_lock);
+        return -1;
+    }
+    if ((res = compact(o, ov.repodir)) == -1) {
+        perror(o->path);
+        /* tried again after another idle period */
+        o->released = time(NULL);
+        pthread_mutex_unlock(&o->lock);
+        pthread_mutex_unlock(&overlays_lock);
+        return -1;
+    }
+    remove_delta(o);
+    strcpy(path, o->path);
+    pthread_mutex_unlock(&o->lock);
+    free_overlay(o);
+    pthread_mutex_unlock(&overlays_lock);
+    ov.commit(path);
+    return 0;
+}
+
+/*
+ * Gets the path of an overlay left alone for OVERLAY_IDLE seconds (or for
+ * any time if all), false if there is none. Failures go to the end.
+ */
+static bool idle_overlay(char fpath[FILENAME_MAX], off_t *size, bool all)
+{
+    time_t now = time(NULL);
+    overlay *o, *oldest;
+
+    pthread_mutex_lock(&overlays_lock);
+    oldest = NULL;
+    for (o = overlays; o != NULL; o = o->next) {
+        pthread_mutex_lock(&o->lock);
+        if (o->refs == 0 && !o->removed
+                && (all || now - o->released >= OVERLAY_IDLE)
+                && (oldest == NULL || o->released < oldest->released))
+            oldest = o;
+        pthread_mutex_unlock(&o->lock);
+    }
+    if (oldest) {
+        pthread_mutex_lock(&oldest->lock);
+        strcpy(fpath, oldest->path);
+        *size = oldest->size;
+        /* not picked again right away if it fails */
+        oldest->released = now + 1;
+        pthread_mutex_unlock(&oldest->lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+    return oldest != NULL;
+}
+
+static void *compactor(void *arg)
+{
+    char fpath[FILENAME_MAX];
+    struct timespec ts;
+    off_t size;
+    (void) arg;
+
+    pthread_mutex_lock(&overlays_lock);
+    while (!ov.stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&ov.cond, &overlays_lock, &ts);
+        pthread_mutex_unlock(&overlays_lock);
+        while (!ov.stop && idle_overlay(fpath, &size, false)) {
+            qos_wait(QOS_COMPACT, size);
+            pthread_mutex_lock(&sharebox.rwlock);
+            compact_path(fpath);
+            pthread_mutex_unlock(&sharebox.rwlock);
+        }
+        pthread_mutex_lock(&overlays_lock);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+    return NULL;
+}
+
+/* takes up the overlay whose map is the file name of ov.dir */
+static void load(const char *name)
+{
+    char map[FILENAME_MAX + 8], rel[FILENAME_MAX], key[FILENAME_MAX];
+    long long basesize, size;
+    unsigned long nblocks;
+    struct stat st;
+    overlay *o;
+    FILE *f;
+
+    snprintf(map, sizeof map, "%s/%s", ov.dir, name);
+    if ((f = fopen(map, "r")) == NULL)
+        return;
+    o = calloc(1, sizeof(overlay));
+    o->base = o->delta = -1;
+    if (fscanf(f, "%lld %lld %lu\n", &basesize, &size, &nblocks) != 3
+            || fgets(rel, sizeof rel, f) == NULL)
+        goto error;
+    rel[strcspn(rel, "\n")] = '\0';
+    o->dirty = calloc(1, (nblocks + 7) / 8 + 1);
+    o->nblocks = nblocks;
+    if (fread(o->dirty, 1, (nblocks + 7) / 8, f) != (nblocks + 7) / 8)
+        goto error;
+    snprintf(o->delta_path, FILENAME_MAX, "%.*s", (int) (strlen(map)
+                - strlen(".map")), map);
+    if (snprintf(o->path, FILENAME_MAX, "%s/%s", ov.repodir, rel)
+            >= FILENAME_MAX
+            /* still the overlay of what the path links to */
+            || git_annex_key(o->path, key) == -1
+            || strcmp(key, strrchr(o->delta_path, '/') + 1) != 0
+            || (o->base = open(o->path, O_RDONLY)) == -1
+            || fstat(o->base, &st) == -1
+            || (o->delta = open(o->delta_path, O_RDWR)) == -1)
+        goto error;
+    fclose(f);
+    o->basesize = basesize;
+    o->size = size;
+    o->released = time(NULL) - OVERLAY_IDLE;
+    pthread_mutex_init(&o->lock, NULL);
+    o->next = overlays;
+    overlays = o;
+    return;
+
+error:
+    /* kept for whoever wants the writes back */
+    fprintf(stderr, "overlay: could not take up %s\n", map);
+    fclose(f);
+    if (o->base != -1)
+        close(o->base);
+    free(o->dirty);
+    free(o);
+}
+
+/*
+ * Interface
+ */
+
+/*
+ * Takes up the overlays of the previous mount, and starts compacting them
+ * in the background. commit is called with the path of each overlay that
+ * got compacted, with sharebox.rwlock held.
+ */
+void overlay_init(const char *repodir, void (*commit)(const char *fpath))
+{
+    struct dirent *de;
+    size_t len;
+    DIR *d;
+
+    ov.repodir = repodir;
+    ov.commit = commit;
+    ov.stop = false;
+    if (snprintf(ov.dir, sizeof ov.dir, "%s/.git/sharebox/overlay", repodir)
+            >= (int) sizeof ov.dir)
+        return;
+    mkdir(ov.dir, 0755);
+    pthread_mutex_lock(&overlays_lock);
+    if ((d = opendir(ov.dir)) != NULL) {
+        while ((de = readdir(d)) != NULL) {
+            len = strlen(de->d_name);
+            if (len > strlen(".map")
+                    && strcmp(de->d_name + len - strlen(".map"), ".map") == 0)
+                load(de->d_name);
+        }
+        closedir(d);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+    ov.running = pthread_create(&ov.thread, NULL, compactor, NULL) == 0;
+}
+
+/*
+ * Compacts the overlays no handle has (sharebox.rwlock not held). Those
+ * that fail stay for the next mount.
+ */
+void overlay_destroy(void)
+{
+    char fpath[FILENAME_MAX];
+    overlay *o, *next;
+    off_t size;
+    size_t n;
+
+    if (!ov.running)
+        return;
+    pthread_mutex_lock(&overlays_lock);
+    ov.stop = true;
+    pthread_cond_signal(&ov.cond);
+    pthread_mutex_unlock(&overlays_lock);
+    pthread_join(ov.thread, NULL);
+    ov.running = false;
+
+    /* each at most once, those that fail are still in the list */
+    pthread_mutex_lock(&overlays_lock);
+    for (n = 0, o = overlays; o != NULL; o = o->next)
+        n++;
+    pthread_mutex_unlock(&overlays_lock);
+    pthread_mutex_lock(&sharebox.rwlock);
+    while (n-- > 0 && idle_overlay(fpath, &size, true))
+        compact_path(fpath);
+    pthread_mutex_unlock(&sharebox.rwlock);
+    pthread_mutex_lock(&overlays_lock);
+    for (o = overlays; o != NULL; o = next) {
+        next = o->next;
+        free_overlay(o);
+    }
+    pthread_mutex_unlock(&overlays_lock);
+}
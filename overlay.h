@@ -0,0 +1,19 @@
+/*
+ * overlay.h
+ */
+
+#include "common.h"
+
+typedef struct overlay overlay;
+
+void overlay_init(const char *repodir, void (*commit)(const char *fpath));
+void overlay_destroy(void);
+overlay *overlay_open(const char *repodir, const char *fpath);
+overlay *overlay_find(const char *fpath);
+int overlay_read(overlay *o, char *buf, size_t size, off_t offset);
+int overlay_write(overlay *o, const char *buf, size_t size, off_t offset);
+int overlay_truncate(overlay *o, off_t size);
+int overlay_size(const char *fpath, off_t *size);
+int overlay_release(overlay *o, const char *repodir);
+void overlay_rename(const char *fpath, const char *to);
+void overlay_remove(const char *fpath);
@@ -0,0 +1,596 @@
+/*
+ * Packed store of small annexed objects
+ *
+ * Each loose object costs an inode and four levels of directories, which
+ * trees of millions of small files turn into a filesystem that is slow to
+ * walk and to back up. Objects up to pack_max bytes are appended instead
+ * to segment files of .git/sharebox/pack, as records of
+ *
+ *     magic, key length, content length, key, content
+ *
+ * and found through an open addressing hash table (key hash -> segment,
+ * offset, lengths) kept in the mmap'd file .git/sharebox/pack/index. The
+ * key is stored along each record, so that a hash collision is told from
+ * a match by reading it back.
+ *
+ * Objects taken back out of the pack leave dead records behind. A
+ * background thread rewrites the live records of segments that are
+ * mostly dead at the end of the current segment, and removes them.
+ */
+
+#include "pack.h"
+#include "qos.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define PACK_SEGMENT (256 << 20)   /* a new segment is started past this */
+#define PACK_SLOTS   4096          /* initial size of the index */
+#define PACK_COMPACT 30            /* seconds between compaction passes */
+#define PACK_MAGIC   0x5342504b
+
+enum { EMPTY = 0, DELETED = 1 };    /* reserved slot hashes */
+
+typedef struct record record;
+struct record
+{
+    uint32_t magic;
+    uint32_t keylen;
+    uint64_t length;
+};
+
+typedef struct slot slot;
+struct slot
+{
+    uint64_t hash;
+    uint32_t seg;
+    uint32_t keylen;
+    uint64_t offset;        /* of the record in its segment */
+    uint64_t length;        /* of the content */
+};
+
+typedef struct header header;
+struct header
+{
+    char magic[8];
+    uint64_t nslots;
+    uint64_t used;          /* slots that are not EMPTY */
+    uint64_t count;         /* live objects */
+    uint32_t nsegs;         /* the last one is being appended to */
+    uint32_t pad;
+};
+
+static struct {
+    char dir[FILENAME_MAX - 32];    /* leaves room for the names in it */
+    off_t max;
+    int indexfd;
+    header *index;
+    size_t mapped;
+    int *fds;               /* per segment, -1 once compacted away */
+    uint64_t *live, *total; /* bytes of records, per segment */
+    uint32_t cap;
+    pthread_rwlock_t lock;
+    pthread_t compactor;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+    unsigned long compacted;
+} pk;
+
+static store pack;
+
+/*
+ * Index (called with pk.lock held)
+ */
+
+static uint64_t hash(const char *key, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    return h < 2 ? h + 2 : h;
+}
+
+static slot *slots(void)
+{
+    return (slot *) (pk.index + 1);
+}
+
+static uint64_t reclen(const slot *s)
+{
+    return sizeof(record) + s->keylen + s->length;
+}
+
+static slot *find(const char *key)
+{
+    char stored[FILENAME_MAX];
+    size_t len = strlen(key);
+    uint64_t h = hash(key, len), i, n;
+    slot *s;
+
+    n = pk.index->nslots;
+    for (i = h % n; ; i = (i + 1) % n) {
+        s = &slots()[i];
+        if (s->hash == EMPTY)
+            return NULL;
+        if (s->hash != h || s->keylen != len || pk.fds[s->seg] == -1)
+            continue;
+        if (pread(pk.fds[s->seg], stored, len, s->offset + sizeof(record))
+                == (ssize_t) len && memcmp(stored, key, len) == 0)
+            return s;
+    }
+}
+
+static int map_index(const char *path, uint64_t nslots, bool create)
+{
+    struct stat st;
+    size_t size;
+    header *index;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644))
+            == -1)
+        return -1;
+    size = sizeof(header) + nslots * sizeof(slot);
+    if (create && ftruncate(fd, size) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!create) {
+        if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(header)) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+    }
+    index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (create) {
+        memcpy(index->magic, "SBXPACK1", 8);
+        index->nslots = nslots;
+    } else if (memcmp(index->magic, "SBXPACK1", 8) != 0
+            || size != sizeof(header) + index->nslots * sizeof(slot)) {
+        munmap(index, size);
+        close(fd);
+        return -1;
+    }
+    if (pk.index) {
+        munmap(pk.index, pk.mapped);
+        close(pk.indexfd);
+    }
+    pk.index = index;
+    pk.mapped = size;
+    pk.indexfd = fd;
+    return 0;
+}
+
+static void place(const slot *s)
+{
+    uint64_t i, n = pk.index->nslots;
+    for (i = s->hash % n; slots()[i].hash > DELETED; i = (i + 1) % n)
+        ;
+    if (slots()[i].hash == EMPTY)
+        pk.index->used++;
+    slots()[i] = *s;
+    pk.index->count++;
+}
+
+/* rebuilds the index without its tombstones, with room to grow */
+static int rebuild(void)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX];
+    header *old;
+    size_t oldsize;
+    uint64_t nslots, i, n;
+    slot *s;
+    int oldfd;
+
+    for (nslots = PACK_SLOTS; nslots < 4 * (pk.index->count + 1); nslots *= 2)
+        ;
+    snprintf(path, FILENAME_MAX, "%s/index", pk.dir);
+    snprintf(tmp, FILENAME_MAX, "%s/index.new", pk.dir);
+
+    /* keep the old mapping while the new one is filled */
+    old = pk.index;
+    oldsize = pk.mapped;
+    oldfd = pk.indexfd;
+    pk.index = NULL;
+    if (map_index(tmp, nslots, true) == -1) {
+        pk.index = old;
+        return -1;
+    }
+    pk.index->nsegs = old->nsegs;
+    n = old->nslots;
+    for (i = 0; i < n; i++) {
+        s = &((slot *) (old + 1))[i];
+        if (s->hash > DELETED)
+            place(s);
+    }
+    msync(pk.index, pk.mapped, MS_SYNC);
+    rename(tmp, path);
+    munmap(old, oldsize);
+    close(oldfd);
+    return 0;
+}
+
+/*
+ * Segments (called with pk.lock held for writing)
+ */
+
+static void reserve(uint32_t seg)
+{
+    uint32_t cap;
+
+    if (seg >= pk.cap) {
+        cap = pk.cap ? 2 * pk.cap : 16;
+        while (cap <= seg)
+            cap *= 2;
+        pk.fds = realloc(pk.fds, cap * sizeof(int));
+        pk.live = realloc(pk.live, cap * sizeof(uint64_t));
+        pk.total = realloc(pk.total, cap * sizeof(uint64_t));
+        for (; pk.cap < cap; pk.cap++) {
+            pk.fds[pk.cap] = -1;
+            pk.live[pk.cap] = pk.total[pk.cap] = 0;
+        }
+    }
+}
+
+static int open_segment(uint32_t seg)
+{
+    char path[FILENAME_MAX];
+
+    reserve(seg);
+    snprintf(path, FILENAME_MAX, "%s/seg.%06u", pk.dir, seg);
+    pk.fds[seg] = open(path, O_RDWR | O_CREAT, 0644);
+    return pk.fds[seg];
+}
+
+/*
+ * Appends a record to the current segment, durably, and fills s with
+ * where it went.
+ */
+static int append(const char *key, const char *data, uint64_t length,
+        slot *s)
+{
+    record r;
+    uint32_t seg;
+    char *buf;
+    size_t len, keylen;
+
+    keylen = strlen(key);
+    len = sizeof(record) + keylen + length;
+    seg = pk.index->nsegs - 1;
+    if (pk.index->nsegs == 0
+            || (pk.total[seg] > 0 && pk.total[seg] + len > PACK_SEGMENT)) {
+        seg = pk.index->nsegs;
+        if (open_segment(seg) == -1)
+            return -1;
+        pk.index->nsegs++;
+    }
+
+    buf = malloc(len);
+    r.magic = PACK_MAGIC;
+    r.keylen = keylen;
+    r.length = length;
+    memcpy(buf, &r, sizeof(record));
+    memcpy(buf + sizeof(record), key, keylen);
+    memcpy(buf + sizeof(record) + keylen, data, length);
+    if (pwrite(pk.fds[seg], buf, len, pk.total[seg]) != (ssize_t) len
+            || fdatasync(pk.fds[seg]) == -1) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    s->hash = hash(key, keylen);
+    s->seg = seg;
+    s->keylen = keylen;
+    s->offset = pk.total[seg];
+    s->length = length;
+    pk.total[seg] += len;
+    pk.live[seg] += len;
+    return 0;
+}
+
+static void forget(slot *s)
+{
+    pk.live[s->seg] -= reclen(s);
+    s->hash = DELETED;
+    pk.index->count--;
+}
+
+/*
+ * Compaction
+ */
+
+/* moves the live records of seg to the current segment, removes seg */
+static void compact_segment(uint32_t seg)
+{
+    char path[FILENAME_MAX], key[FILENAME_MAX];
+    char *data;
+    uint64_t offset, len;
+    record r;
+    slot *s, moved;
+    int fd;
+
+    pthread_rwlock_rdlock(&pk.lock);
+    fd = pk.fds[seg];
+    len = pk.total[seg];
+    pthread_rwlock_unlock(&pk.lock);
+
+    /* the records of a segment that is not appended to never change */
+    for (offset = 0; offset < len; offset += sizeof(record) + r.keylen
+            + r.length) {
+        if (pread(fd, &r, sizeof(record), offset) != sizeof(record)
+                || r.magic != PACK_MAGIC || r.keylen >= FILENAME_MAX
+                || pread(fd, key, r.keylen, offset + sizeof(record))
+                != r.keylen)
+            return;
+        key[r.keylen] = '\0';
+
+        pthread_rwlock_wrlock(&pk.lock);
+        s = find(key);
+        if (s && s->seg == seg && s->offset == offset) {
+            data = malloc(r.length ? r.length : 1);
+            if (pread(fd, data, r.length, offset + sizeof(record) + r.keylen)
+                    == (ssize_t) r.length
+                    && append(key, data, r.length, &moved) == 0) {
+                pk.live[seg] -= reclen(s);
+                *s = moved;
+                msync(pk.index, pk.mapped, MS_SYNC);
+            }
+            free(data);
+        }
+        pthread_rwlock_unlock(&pk.lock);
+    }
+
+    pthread_rwlock_wrlock(&pk.lock);
+    if (pk.live[seg] == 0) {
+        close(pk.fds[seg]);
+        pk.fds[seg] = -1;
+        pk.total[seg] = 0;
+        snprintf(path, FILENAME_MAX, "%s/seg.%06u", pk.dir, seg);
+        unlink(path);
+        pk.compacted++;
+    }
+    pthread_rwlock_unlock(&pk.lock);
+}
+
+static void *compactor(void *arg)
+{
+    struct timespec deadline;
+    uint32_t seg, victim;
+    uint64_t live;
+    bool found;
+    (void) arg;
+
+    pthread_mutex_lock(&pk.stop_lock);
+    while (!pk.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PACK_COMPACT;
+        pthread_cond_timedwait(&pk.stop_cond, &pk.stop_lock, &deadline);
+        if (pk.stop)
+            break;
+        pthread_mutex_unlock(&pk.stop_lock);
+
+        /* the segment with the most dead bytes, if mostly dead */
+        found = false;
+        victim = 0;
+        pthread_rwlock_rdlock(&pk.lock);
+        for (seg = 0; seg + 1 < pk.index->nsegs; seg++) {
+            if (pk.fds[seg] == -1 || pk.live[seg] * 2 >= pk.total[seg])
+                continue;
+            if (!found || pk.total[seg] - pk.live[seg]
+                    > pk.total[victim] - pk.live[victim])
+                victim = seg;
+            found = true;
+        }
+        live = found ? pk.live[victim] : 0;
+        pthread_rwlock_unlock(&pk.lock);
+        if (found) {
+            qos_wait(QOS_COMPACT, live);
+            compact_segment(victim);
+        }
+
+        pthread_mutex_lock(&pk.stop_lock);
+    }
+    pthread_mutex_unlock(&pk.stop_lock);
+    return NULL;
+}
+
+/*
+ * Store operations
+ */
+
+static int pack_put(const char *key, const char *object, off_t size)
+{
+    char *data;
+    ssize_t n;
+    slot s;
+    int fd, res;
+
+    if (size > pk.max)
+        return -1;
+    if ((fd = open(object, O_RDONLY)) == -1)
+        return -1;
+    data = malloc(size ? size : 1);
+    n = pread(fd, data, size, 0);
+    close(fd);
+    if (n != size) {
+        free(data);
+        return -1;
+    }
+
+    res = 0;
+    pthread_rwlock_wrlock(&pk.lock);
+    if (find(key) == NULL) {
+        if ((pk.index->used + 1) * 2 > pk.index->nslots && rebuild() == -1)
+            res = -1;
+        else if ((res = append(key, data, size, &s)) == 0) {
+            place(&s);
+            msync(pk.index, pk.mapped, MS_SYNC);
+        }
+    }
+    pthread_rwlock_unlock(&pk.lock);
+    free(data);
+    return res;
+}
+
+static int pack_has(const char *key)
+{
+    int res;
+    pthread_rwlock_rdlock(&pk.lock);
+    res = find(key) != NULL;
+    pthread_rwlock_unlock(&pk.lock);
+    return res;
+}
+
+static ssize_t pack_read(const char *key, char *buf, size_t size,
+        off_t offset)
+{
+    ssize_t res;
+    slot *s;
+
+    pthread_rwlock_rdlock(&pk.lock);
+    if ((s = find(key)) == NULL) {
+        errno = ENOENT;
+        res = -1;
+    } else if ((uint64_t) offset >= s->length) {
+        res = 0;
+    } else {
+        if (offset + size > s->length)
+            size = s->length - offset;
+        res = pread(pk.fds[s->seg], buf, size,
+                s->offset + sizeof(record) + s->keylen + offset);
+    }
+    pthread_rwlock_unlock(&pk.lock);
+    return res;
+}
+
+static int pack_get(const char *key, const char *object)
+{
+    char *data;
+    slot *s;
+    int fd, res;
+
+    pthread_rwlock_wrlock(&pk.lock);
+    if ((s = find(key)) == NULL) {
+        pthread_rwlock_unlock(&pk.lock);
+        return -1;
+    }
+    res = -1;
+    data = malloc(s->length ? s->length : 1);
+    if (pread(pk.fds[s->seg], data, s->length,
+                s->offset + sizeof(record) + s->keylen)
+            == (ssize_t) s->length
+            && (fd = open(object, O_WRONLY | O_CREAT | O_EXCL, 0444)) != -1) {
+        if (write(fd, data, s->length) == (ssize_t) s->length
+                && fsync(fd) == 0)
+            res = 0;
+        if (close(fd) == -1)
+            res = -1;
+        if (res == -1)
+            unlink(object);
+    }
+    free(data);
+    if (res == 0) {
+        forget(s);
+        msync(pk.index, pk.mapped, MS_SYNC);
+    }
+    pthread_rwlock_unlock(&pk.lock);
+    return res;
+}
+
+static void pack_destroy(void)
+{
+    uint64_t live, total;
+    uint32_t seg;
+
+    pthread_mutex_lock(&pk.stop_lock);
+    pk.stop = true;
+    pthread_cond_signal(&pk.stop_cond);
+    pthread_mutex_unlock(&pk.stop_lock);
+    pthread_join(pk.compactor, NULL);
+
+    live = total = 0;
+    for (seg = 0; seg < pk.index->nsegs; seg++) {
+        live += pk.live[seg];
+        total += pk.total[seg];
+        if (pk.fds[seg] != -1)
+            close(pk.fds[seg]);
+    }
+    printf("pack: %llu objects, %llu live bytes of %llu, "
+            "%lu segments compacted\n", (unsigned long long) pk.index->count,
+            (unsigned long long) live, (unsigned long long) total,
+            pk.compacted);
+    msync(pk.index, pk.mapped, MS_SYNC);
+    munmap(pk.index, pk.mapped);
+    close(pk.indexfd);
+    free(pk.fds);
+    free(pk.live);
+    free(pk.total);
+}
+
+/*
+ * Returns the pack store of the repository, for objects up to max bytes,
+ * or NULL if max is 0.
+ */
+store *pack_store(const char *repodir, off_t max)
+{
+    char path[FILENAME_MAX];
+    struct stat st;
+    uint64_t i;
+    uint32_t seg;
+    slot *s;
+
+    if (max <= 0)
+        return NULL;
+    memset(&pk, 0, sizeof(pk));
+    pk.max = max;
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox", repodir);
+    mkdir(path, 0755);
+    if (snprintf(pk.dir, sizeof pk.dir, "%s/.git/sharebox/pack", repodir)
+            >= (int) sizeof pk.dir)
+        return NULL;
+    mkdir(pk.dir, 0755);
+
+    snprintf(path, FILENAME_MAX, "%s/index", pk.dir);
+    if (map_index(path, 0, false) == -1
+            && map_index(path, PACK_SLOTS, true) == -1) {
+        perror(path);
+        return NULL;
+    }
+    for (seg = 0; seg < pk.index->nsegs; seg++) {
+        snprintf(path, FILENAME_MAX, "%s/seg.%06u", pk.dir, seg);
+        reserve(seg);
+        if (stat(path, &st) == -1)
+            continue;               /* compacted away */
+        open_segment(seg);
+        pk.total[seg] = st.st_size;
+    }
+    for (i = 0; i < pk.index->nslots; i++) {
+        s = &slots()[i];
+        if (s->hash > DELETED && s->seg < pk.index->nsegs)
+            pk.live[s->seg] += reclen(s);
+    }
+
+    pthread_rwlock_init(&pk.lock, NULL);
+    pthread_mutex_init(&pk.stop_lock, NULL);
+    pthread_cond_init(&pk.stop_cond, NULL);
+    pthread_create(&pk.compactor, NULL, compactor, NULL);
+
+    pack.name = "pack";
+    pack.put = pack_put;
+    pack.has = pack_has;
+    pack.read = pack_read;
+    pack.get = pack_get;
+    pack.destroy = pack_destroy;
+    return &pack;
+}
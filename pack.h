@@ -0,0 +1,7 @@
+/*
+ * pack.h
+ */
+
+#include "store.h"
+
+store *pack_store(const char *repodir, off_t max);
@@ -0,0 +1,578 @@
+/*
+ * /.sharebox/peers: the peers of the filesystem
+ *
+ * Each file of this directory is a peer, named after it; its content is
+ * the url the peer is reached at: a git repository, or a local repository
+ * followed by the branch to follow ("/path/to/repo/master"). Writing a url
+ * makes the peer a git remote, touching the file synchronizes with it,
+ * and removing it forgets the peer.
+ *
+ * A peer keeps, in .git/sharebox/peers/<name>, its url and the watermarks
+ * of the last sync: the commits of its branch and of its git-annex branch
+ * that were merged. Fetching is already incremental in git; the
+ * watermarks make the rest incremental too. When the peer did not move a
+ * sync stops after comparing two hashes. Otherwise the branch of the peer
+ * is merged beside the worktree (see merge.c), and with -o sync_content
+ * the content of what changed between the watermark and the new commit
+ * is transferred in the background (see transfer.c), which costs the size
+ * of the change rather than the size of the tree.
+ */
+
+#include "peers.h"
+#include "git-annex.h"
+#include "transfer.h"
+#include "locations.h"
+#include "replicate.h"
+#include "merge.h"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <limits.h>
+
+#define PEERS_DIR "/.sharebox/peers"
+
+typedef struct peer peer;
+struct peer
+{
+    char name[NAME_MAX + 1];
+    char url[FILENAME_MAX];
+    char repo[FILENAME_MAX];    /* the repository the url resolved to */
+    char tip[41];       /* watermark of the branch of the peer */
+    char annex[41];     /* watermark of its git-annex branch */
+};
+
+/* what a handle wrote, applied when it is flushed */
+typedef struct request request;
+struct request
+{
+    char *data;
+    size_t len;
+    bool dirty;
+};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_root(const char *path)
+{
+    return strcmp(path, PEERS_DIR) == 0;
+}
+
+/* name of the peer path stands for, NULL if it is not one */
+static const char *peer_name(const char *path)
+{
+    const char *name;
+
+    if (strncmp(path, PEERS_DIR "/", strlen(PEERS_DIR "/")) != 0)
+        return NULL;
+    name = path + strlen(PEERS_DIR "/");
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/')
+            || strlen(name) > NAME_MAX)
+        return NULL;
+    return name;
+}
+
+static void state_path(char path[FILENAME_MAX], const char *name)
+{
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox/peers/%s",
+            sharebox.reporoot, name);
+}
+
+/*
+ * Peer state
+ */
+
+static int load(const char *name, peer *p)
+{
+    char path[FILENAME_MAX], line[FILENAME_MAX];
+    FILE *f;
+
+    memset(p, 0, sizeof(peer));
+    strcpy(p->name, name);
+    state_path(path, name);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof line, f))
+        if (sscanf(line, "url %[^\n]", p->url) != 1
+                && sscanf(line, "repo %[^\n]", p->repo) != 1
+                && sscanf(line, "tip %40s", p->tip) != 1)
+            sscanf(line, "annex %40s", p->annex);
+    fclose(f);
+    return 0;
+}
+
+static int save(const peer *p)
+{
+    char path[FILENAME_MAX], tmp[FILENAME_MAX + 8];
+    FILE *f;
+
+    state_path(path, p->name);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return -1;
+    fprintf(f, "url %s\nrepo %s\ntip %s\nannex %s\n", p->url, p->repo,
+            p->tip, p->annex);
+    if (fclose(f) == EOF || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the repositories of the peers that have an url.
+ */
+namelist *peer_repos(void)
+{
+    char dirpath[FILENAME_MAX];
+    namelist *res, *n;
+    struct dirent *de;
+    DIR *dp;
+    peer p;
+
+    snprintf(dirpath, FILENAME_MAX, "%s/.git/sharebox/peers",
+            sharebox.reporoot);
+    if ((dp = opendir(dirpath)) == NULL)
+        return NULL;
+    res = NULL;
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) > NAME_MAX
+                || load(de->d_name, &p) == -1 || p.repo[0] == '\0')
+            continue;
+        n = malloc(sizeof(namelist));
+        strcpy(n->name, p.repo);
+        n->next = res;
+        res = n;
+    }
+    closedir(dp);
+    return res;
+}
+
+/*
+ * Splits url into the repository and the ref to follow in it. Returns -1
+ * if it reaches no repository.
+ */
+static int resolve(const char *url, char repo[FILENAME_MAX],
+        char ref[FILENAME_MAX])
+{
+    char *slash;
+
+    strcpy(repo, url);
+    strcpy(ref, "HEAD");
+    if (git_reachable(repo) == 0)
+        return 0;
+    if ((slash = strrchr(repo, '/')) == NULL || slash == repo
+            || slash[1] == '\0')
+        return -1;
+    *slash = '\0';
+    snprintf(ref, FILENAME_MAX, "refs/heads/%s", slash + 1);
+    return git_reachable(repo) == 0 ? 0 : -1;
+}
+
+/* makes url the url of the peer name */
+static int set_url(const char *name, const char *url)
+{
+    char repo[FILENAME_MAX], ref[FILENAME_MAX];
+    peer p;
+
+    if (resolve(url, repo, ref) == -1)
+        return -EINVAL;
+    pthread_mutex_lock(&sync_lock);
+    load(name, &p);
+    if (strcmp(p.url, url) != 0) {
+        /* another repository: the watermarks mean nothing to it */
+        strcpy(p.url, url);
+        p.tip[0] = p.annex[0] = '\0';
+    }
+    strcpy(p.repo, repo);
+    if (git_remote_set(sharebox.reporoot, name, repo, ref) != 0
+            || save(&p) == -1) {
+        pthread_mutex_unlock(&sync_lock);
+        return -EIO;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return 0;
+}
+
+/*
+ * Brings in what the peer name committed since the last sync.
+ */
+static int sync_peer(const char *name)
+{
+    char ref[FILENAME_MAX], tip[41], annex[41];
+    peer p;
+    int res;
+
+    pthread_mutex_lock(&sync_lock);
+    if (load(name, &p) == -1 || p.url[0] == '\0') {
+        res = -ENOENT;
+        goto out;
+    }
+    if (git_fetch(sharebox.reporoot, name) != 0) {
+        res = -EHOSTUNREACH;
+        goto out;
+    }
+    snprintf(ref, FILENAME_MAX, "refs/remotes/%s/sharebox", name);
+    if (git_rev_parse(sharebox.reporoot, ref, tip) == -1)
+        tip[0] = '\0';
+    snprintf(ref, FILENAME_MAX, "refs/remotes/%s/git-annex", name);
+    if (git_rev_parse(sharebox.reporoot, ref, annex) == -1)
+        annex[0] = '\0';
+
+    res = 0;
+    if (strcmp(tip, p.tip) == 0 && strcmp(annex, p.annex) == 0) {
+        printf("%s: up to date\n", name);
+        goto done;
+    }
+    pthread_mutex_lock(&sharebox.rwlock);
+    if (annex[0] && strcmp(annex, p.annex) != 0
+            && git_annex_merge(sharebox.reporoot) != 0)
+        res = -EIO;
+    pthread_mutex_unlock(&sharebox.rwlock);
+    /* takes the lock only to apply what it merged */
+    if (res == 0 && tip[0] && strcmp(tip, p.tip) != 0
+            && merge_commit(name, tip) != 0)
+        res = -EIO;
+    if (res == 0 && annex[0] && strcmp(annex, p.annex) != 0)
+        locations_refresh();
+    if (res == 0 && tip[0] && strcmp(tip, p.tip) != 0)
+        replicate_rescan();
+    if (res == 0 && sharebox.sync_content && tip[0] && strcmp(tip, p.tip))
+        transfer_keys(name, p.repo, p.tip[0] ? p.tip : NULL, tip);
+    if (res == 0) {
+        strcpy(p.tip, tip);
+        strcpy(p.annex, annex);
+    }
+
+done:
+    /* the time of the last sync, as seen on the peer file */
+    if (res == 0 && save(&p) == -1)
+        res = -EIO;
+out:
+    pthread_mutex_unlock(&sync_lock);
+    return res;
+}
+
+/*
+ * FS Operations
+ */
+
+static int peers_getattr(const char *path, struct stat *stbuf)
+{
+    char state[FILENAME_MAX];
+    const char *name;
+    struct stat st;
+    peer p;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    if (is_root(path)) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    if ((name = peer_name(path)) == NULL)
+        return -ENOENT;
+    state_path(state, name);
+    if (stat(state, &st) == -1 || load(name, &p) == -1)
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = p.url[0] ? strlen(p.url) + 1 : 0;
+    stbuf->st_mtime = st.st_mtime;
+    stbuf->st_atime = st.st_atime;
+    stbuf->st_ctime = st.st_ctime;
+    return 0;
+}
+
+static int peers_access(const char *path, int mask)
+{
+    struct stat st;
+    (void) mask;
+    return peers_getattr(path, &st);
+}
+
+static int peers_readlink(const char *path, char *buf, size_t size)
+{
+    (void) path;
+    (void) buf;
+    (void) size;
+    return -EINVAL;
+}
+
+static int peers_readdir(const char *path, void *buf,
+        fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    char dirpath[FILENAME_MAX];
+    struct dirent *de;
+    size_t len;
+    DIR *dp;
+    (void) offset;
+    (void) fi;
+
+    if (!is_root(path))
+        return -ENOTDIR;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    snprintf(dirpath, FILENAME_MAX, "%s/.git/sharebox/peers",
+            sharebox.reporoot);
+    if ((dp = opendir(dirpath)) == NULL)
+        return 0;
+    while ((de = readdir(dp)) != NULL) {
+        len = strlen(de->d_name);
+        if (de->d_name[0] == '.'
+                || (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0))
+            continue;
+        filler(buf, de->d_name, NULL, 0);
+    }
+    closedir(dp);
+    return 0;
+}
+
+/* creates a peer without an url yet */
+static int peers_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    char state[FILENAME_MAX];
+    const char *name;
+    peer p;
+    int res;
+    (void) rdev;
+
+    if (!S_ISREG(mode) || (name = peer_name(path)) == NULL)
+        return -EACCES;
+    pthread_mutex_lock(&sync_lock);
+    state_path(state, name);
+    load(name, &p);
+    if (access(state, F_OK) == 0)
+        res = -EEXIST;
+    else
+        res = save(&p) == -1 ? -EIO : 0;
+    pthread_mutex_unlock(&sync_lock);
+    return res;
+}
+
+static int peers_mkdir(const char *path, mode_t mode)
+{
+    (void) path;
+    (void) mode;
+    return -EACCES;
+}
+
+static int peers_symlink(const char *target, const char *linkname)
+{
+    (void) target;
+    (void) linkname;
+    return -EACCES;
+}
+
+static int peers_unlink(const char *path)
+{
+    char state[FILENAME_MAX];
+    const char *name;
+    peer p;
+    int res;
+
+    if ((name = peer_name(path)) == NULL)
+        return -ENOENT;
+    pthread_mutex_lock(&sync_lock);
+    state_path(state, name);
+    if (load(name, &p) == -1) {
+        res = -ENOENT;
+    } else {
+        if (p.url[0])
+            git_remote_remove(sharebox.reporoot, name);
+        res = unlink(state) == -1 ? -errno : 0;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return res;
+}
+
+static int peers_rmdir(const char *path)
+{
+    (void) path;
+    return -EACCES;
+}
+
+static int peers_rename(const char *from, const char *to)
+{
+    (void) from;
+    (void) to;
+    return -EACCES;
+}
+
+static int peers_chmod(const char *path, mode_t mode)
+{
+    (void) path;
+    (void) mode;
+    return -EACCES;
+}
+
+static int peers_chown(const char *path, uid_t uid, gid_t gid)
+{
+    (void) path;
+    (void) uid;
+    (void) gid;
+    return -EACCES;
+}
+
+/* the url is replaced as a whole when the writer is flushed */
+static int peers_truncate(const char *path, off_t size)
+{
+    struct stat st;
+    (void) size;
+    return peers_getattr(path, &st);
+}
+
+static int peers_utimens(const char *path, const struct timespec ts[2])
+{
+    const char *name;
+    (void) ts;
+
+    if (is_root(path))
+        return 0;
+    if ((name = peer_name(path)) == NULL)
+        return -ENOENT;
+    return sync_peer(name);
+}
+
+static int peers_open(const char *path, struct fuse_file_info *fi)
+{
+    struct stat st;
+    int res;
+
+    if (is_root(path))
+        return -EISDIR;
+    if ((res = peers_getattr(path, &st)) != 0)
+        return res;
+    fi->fh = (uintptr_t) calloc(1, sizeof(request));
+    fi->direct_io = 1;  /* the url may change under the page cache */
+    return 0;
+}
+
+static int peers_read(const char *path, char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    char url[FILENAME_MAX + 1];
+    size_t len;
+    peer p;
+    (void) fi;
+
+    if (load(peer_name(path), &p) == -1)
+        return -ENOENT;
+    len = p.url[0] ? (size_t) snprintf(url, sizeof url, "%s\n", p.url) : 0;
+    if (offset >= (off_t) len)
+        return 0;
+    if (offset + size > len)
+        size = len - offset;
+    memcpy(buf, url + offset, size);
+    return size;
+}
+
+static int peers_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    (void) path;
+
+    if (offset + size > FILENAME_MAX)
+        return -EFBIG;
+    if (offset + size > r->len) {
+        r->data = realloc(r->data, offset + size);
+        memset(r->data + r->len, 0, offset + size - r->len);
+        r->len = offset + size;
+    }
+    memcpy(r->data + offset, buf, size);
+    r->dirty = true;
+    return size;
+}
+
+/*
+ * Applies the url written so far. A peer created by the writer is removed
+ * again if the url is of no use, so that the failure shows on close.
+ */
+static int peers_flush(const char *path, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    const char *name;
+    char *url;
+    peer p;
+    int res;
+
+    if (!r->dirty)
+        return 0;
+    r->dirty = false;
+    name = peer_name(path);
+    url = strndup(r->data, r->len);
+    url[strcspn(url, "\n")] = '\0';
+    res = set_url(name, url);
+    free(url);
+    if (res != 0 && load(name, &p) == 0 && p.url[0] == '\0')
+        peers_unlink(path);
+    return res;
+}
+
+static int peers_release(const char *path, struct fuse_file_info *fi)
+{
+    request *r = (request *) (uintptr_t) fi->fh;
+    (void) path;
+
+    free(r->data);
+    free(r);
+    return 0;
+}
+
+static int peers_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+    if (statvfs(sharebox.reporoot, stbuf) == -1)
+        return -errno;
+    return 0;
+}
+
+static void *peers_init(struct fuse_conn_info *conn)
+{
+    char path[FILENAME_MAX];
+    (void) conn;
+
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox", sharebox.reporoot);
+    mkdir(path, 0755);
+    snprintf(path, FILENAME_MAX, "%s/.git/sharebox/peers", sharebox.reporoot);
+    mkdir(path, 0755);
+    if (sharebox.sync_content)
+        transfer_init(sharebox.reporoot, sharebox.transfers,
+                sharebox.peer_transfers);
+    return NULL;
+}
+
+static void peers_destroy(void *data)
+{
+    (void) data;
+    transfer_destroy();
+}
+
+void init_peers(dir *d)
+{
+    strcpy(d->name, PEERS_DIR);
+    (d->operations).getattr    = peers_getattr;
+    (d->operations).access     = peers_access;
+    (d->operations).readlink   = peers_readlink;
+    (d->operations).readdir    = peers_readdir;
+    (d->operations).mknod      = peers_mknod;
+    (d->operations).mkdir      = peers_mkdir;
+    (d->operations).symlink    = peers_symlink;
+    (d->operations).unlink     = peers_unlink;
+    (d->operations).rmdir      = peers_rmdir;
+    (d->operations).rename     = peers_rename;
+    (d->operations).chmod      = peers_chmod;
+    (d->operations).chown      = peers_chown;
+    (d->operations).truncate   = peers_truncate;
+    (d->operations).utimens    = peers_utimens;
+    (d->operations).open       = peers_open;
+    (d->operations).read       = peers_read;
+    (d->operations).write      = peers_write;
+    (d->operations).flush      = peers_flush;
+    (d->operations).release    = peers_release;
+    (d->operations).statfs     = peers_statfs;
+    (d->operations).init       = peers_init;
+    (d->operations).destroy    = peers_destroy;
+}
@@ -0,0 +1,9 @@
+/*
+ * peers.h
+ */
+
+#include "common.h"
+#include "git-annex.h"
+
+void init_peers(dir *);
+namelist *peer_repos(void);
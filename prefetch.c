@@ -0,0 +1,395 @@
+/*
+ * Prefetching of annexed siblings
+ *
+ * Browsing a directory of absent files (a photo album, a shell glob over
+ * a directory) opens them one after the other, and each open waits for a
+ * full git annex get. When the files of a directory are opened in order,
+ * or opened shortly after the directory was listed, the next siblings are
+ * fetched in the background by a pool of workers so that they are on disk
+ * by the time they are opened.
+ *
+ * The amount of fetched data that has not been opened yet is bounded by a
+ * budget. Fetches that are never opened are forgotten after PREFETCH_TTL
+ * seconds and counted as wasted.
+ */
+
+#include "prefetch.h"
+#include "git-annex.h"
+#include "store.h"
+#include "inventory.h"
+#include "qos.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+#define PREFETCH_DIRS   16  /* directories whose access pattern we follow */
+#define PREFETCH_TTL    300 /* seconds before an unopened fetch is dropped */
+#define PREFETCH_LISTED 30  /* seconds during which a readdir counts */
+#define PREFETCH_SCAN   8   /* siblings looked at per requested fetch */
+
+enum { QUEUED, FETCHING, DONE };
+
+typedef struct fetch fetch;
+struct fetch
+{
+    char path[FILENAME_MAX];
+    off_t size;
+    int state;
+    time_t done;
+    fetch *next;
+};
+
+typedef struct dirstate dirstate;
+struct dirstate
+{
+    char path[FILENAME_MAX];
+    char last[FILENAME_MAX];    /* last entry opened in this directory */
+    time_t listed;              /* last readdir */
+    time_t used;
+    struct dirent **entries;    /* sorted listing, refreshed on mtime */
+    int nentries;
+    struct timespec mtime;
+};
+
+static struct {
+    const char *repodir;
+    int depth;
+    off_t budget;
+    off_t pending;              /* bytes queued or fetched, not opened */
+    fetch *fetches;
+    dirstate dirs[PREFETCH_DIRS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a fetch was queued */
+    pthread_cond_t done;        /* a fetch completed */
+    pthread_t *workers;
+    bool stop;
+    unsigned long issued, hits, late_hits, misses, wasted;
+} pf;
+
+/*
+ * Helpers (called with pf.lock held)
+ */
+
+static void split(const char *fpath, char dirpath[FILENAME_MAX],
+        const char **name)
+{
+    char *p;
+    strncpy(dirpath, fpath, FILENAME_MAX - 1);
+    dirpath[FILENAME_MAX - 1] = '\0';
+    p = strrchr(dirpath, '/');
+    *p = '\0';
+    *name = fpath + (p - dirpath) + 1;
+}
+
+static int absent(const char *fpath)
+{
+    struct stat st;
+    return git_annexed(pf.repodir, fpath) && stat(fpath, &st) == -1
+        && store_holder(fpath) == NULL;
+}
+
+static void free_entries(dirstate *d)
+{
+    int i;
+    for (i = 0; i < d->nentries; i++)
+        free(d->entries[i]);
+    free(d->entries);
+    d->entries = NULL;
+    d->nentries = 0;
+}
+
+static int not_dots(const struct dirent *de)
+{
+    return strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0;
+}
+
+/* finds the state of a directory, recycling the least recently used */
+static dirstate *lookup_dir(const char *dirpath)
+{
+    int i;
+    dirstate *d, *lru;
+
+    lru = &pf.dirs[0];
+    for (i = 0; i < PREFETCH_DIRS; i++) {
+        d = &pf.dirs[i];
+        if (strcmp(d->path, dirpath) == 0)
+            return d;
+        if (d->used < lru->used)
+            lru = d;
+    }
+    free_entries(lru);
+    memset(lru, 0, sizeof(dirstate));
+    strncpy(lru->path, dirpath, FILENAME_MAX - 1);
+    return lru;
+}
+
+static void refresh_entries(dirstate *d)
+{
+    struct stat st;
+    int n;
+
+    if (stat(d->path, &st) == -1)
+        return;
+    if (d->entries && st.st_mtim.tv_sec == d->mtime.tv_sec
+            && st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+        return;
+    free_entries(d);
+    if ((n = scandir(d->path, &d->entries, not_dots, alphasort)) == -1) {
+        d->entries = NULL;
+        return;
+    }
+    d->nentries = n;
+    d->mtime = st.st_mtim;
+}
+
+static int entry_index(dirstate *d, const char *name)
+{
+    int i;
+    for (i = 0; i < d->nentries; i++)
+        if (strcmp(d->entries[i]->d_name, name) == 0)
+            return i;
+    return -1;
+}
+
+static fetch *find_fetch(const char *fpath)
+{
+    fetch *f;
+    for (f = pf.fetches; f != NULL; f = f->next)
+        if (strcmp(f->path, fpath) == 0)
+            return f;
+    return NULL;
+}
+
+static void remove_fetch(fetch *f)
+{
+    fetch **p;
+    for (p = &pf.fetches; *p != NULL; p = &(*p)->next) {
+        if (*p == f) {
+            *p = f->next;
+            pf.pending -= f->size;
+            free(f);
+            return;
+        }
+    }
+}
+
+/* forgets the fetches nobody opened */
+static void expire(time_t now)
+{
+    fetch *f, *next;
+    for (f = pf.fetches; f != NULL; f = next) {
+        next = f->next;
+        if (f->state == DONE && now - f->done > PREFETCH_TTL) {
+            pf.wasted++;
+            remove_fetch(f);
+        }
+    }
+}
+
+/* queues the absent siblings following entry i */
+static void schedule(dirstate *d, int i)
+{
+    int queued, scanned;
+    char path[FILENAME_MAX], key[FILENAME_MAX];
+    fetch *f, **tail;
+    off_t size;
+
+    for (tail = &pf.fetches; *tail != NULL; tail = &(*tail)->next)
+        ;
+    queued = scanned = 0;
+    for (i = i + 1; i < d->nentries; i++) {
+        if (queued >= pf.depth || scanned++ >= pf.depth * PREFETCH_SCAN)
+            break;
+        if (snprintf(path, FILENAME_MAX, "%s/%s", d->path,
+                    d->entries[i]->d_name) >= FILENAME_MAX)
+            continue;
+        if (find_fetch(path)) {
+            queued++;
+            continue;
+        }
+        if (!absent(path) || git_annex_key(path, key) == -1)
+            continue;
+        if ((size = git_annex_keysize(key)) < 0)
+            size = 0;
+        if (pf.pending + size > pf.budget)
+            break;
+        f = malloc(sizeof(fetch));
+        strcpy(f->path, path);
+        f->size = size;
+        f->state = QUEUED;
+        f->next = NULL;
+        *tail = f;
+        tail = &f->next;
+        pf.pending += size;
+        pf.issued++;
+        queued++;
+    }
+    pthread_cond_broadcast(&pf.work);
+}
+
+static void *worker(void *arg)
+{
+    fetch *f;
+    char path[FILENAME_MAX];
+    off_t size;
+    (void) arg;
+
+    pthread_mutex_lock(&pf.lock);
+    while (!pf.stop) {
+        for (f = pf.fetches; f != NULL && f->state != QUEUED; f = f->next)
+            ;
+        if (f == NULL) {
+            pthread_cond_wait(&pf.work, &pf.lock);
+            continue;
+        }
+        f->state = FETCHING;
+        strcpy(path, f->path);
+        size = f->size;
+        pthread_mutex_unlock(&pf.lock);
+
+        qos_wait(QOS_PREFETCH, size);
+        git_annex_get(pf.repodir, path, NULL);
+        inventory_update_link(path);
+
+        pthread_mutex_lock(&pf.lock);
+        /* the entry cannot go away while FETCHING */
+        f->state = DONE;
+        f->done = time(NULL);
+        pthread_cond_broadcast(&pf.done);
+    }
+    pthread_mutex_unlock(&pf.lock);
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+void prefetch_init(const char *repodir, int depth, off_t budget)
+{
+    int i;
+
+    memset(&pf, 0, sizeof(pf));
+    if (depth <= 0)
+        return;
+    pf.repodir = repodir;
+    pf.depth = depth;
+    pf.budget = budget;
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.work, NULL);
+    pthread_cond_init(&pf.done, NULL);
+    pf.workers = malloc(depth * sizeof(pthread_t));
+    for (i = 0; i < depth; i++)
+        pthread_create(&pf.workers[i], NULL, worker, NULL);
+}
+
+void prefetch_destroy(void)
+{
+    int i;
+    fetch *f, *next;
+
+    if (pf.depth <= 0)
+        return;
+    pthread_mutex_lock(&pf.lock);
+    pf.stop = true;
+    pthread_cond_broadcast(&pf.work);
+    pthread_mutex_unlock(&pf.lock);
+    for (i = 0; i < pf.depth; i++)
+        pthread_join(pf.workers[i], NULL);
+    free(pf.workers);
+
+    prefetch_stats(stdout);
+
+    for (f = pf.fetches; f != NULL; f = next) {
+        next = f->next;
+        free(f);
+    }
+    for (i = 0; i < PREFETCH_DIRS; i++)
+        free_entries(&pf.dirs[i]);
+    pf.depth = 0;
+}
+
+/*
+ * To be called when a directory is listed: the opens that follow are
+ * likely to walk through it.
+ */
+void prefetch_readdir(const char *fpath)
+{
+    dirstate *d;
+    if (pf.depth <= 0)
+        return;
+    pthread_mutex_lock(&pf.lock);
+    d = lookup_dir(fpath);
+    d->listed = d->used = time(NULL);
+    pthread_mutex_unlock(&pf.lock);
+}
+
+/*
+ * To be called before fetching an absent file on open. Waits for the
+ * file if it is being prefetched, and queues the siblings that are
+ * likely to be opened next. Returns 1 if the file was prefetched.
+ */
+int prefetch_open(const char *fpath)
+{
+    char dirpath[FILENAME_MAX];
+    const char *name;
+    dirstate *d;
+    fetch *f;
+    time_t now;
+    int i, res;
+    bool waited;
+
+    if (pf.depth <= 0)
+        return 0;
+
+    pthread_mutex_lock(&pf.lock);
+    now = time(NULL);
+    expire(now);
+
+    res = 0;
+    waited = false;
+    while ((f = find_fetch(fpath)) != NULL) {
+        if (f->state == DONE) {
+            if (waited)
+                pf.late_hits++;
+            else
+                pf.hits++;
+            remove_fetch(f);
+            res = 1;
+            break;
+        }
+        waited = true;
+        pthread_cond_wait(&pf.done, &pf.lock);
+    }
+    if (!res && !waited && absent(fpath))
+        pf.misses++;
+
+    split(fpath, dirpath, &name);
+    d = lookup_dir(dirpath);
+    refresh_entries(d);
+    if ((i = entry_index(d, name)) != -1) {
+        if ((i > 0 && strcmp(d->entries[i - 1]->d_name, d->last) == 0)
+                || now - d->listed < PREFETCH_LISTED)
+            schedule(d, i);
+    }
+    strncpy(d->last, name, FILENAME_MAX - 1);
+    d->used = now;
+
+    pthread_mutex_unlock(&pf.lock);
+    return res;
+}
+
+void prefetch_stats(FILE *out)
+{
+    unsigned long opened;
+
+    if (pf.depth <= 0)
+        return;
+    pthread_mutex_lock(&pf.lock);
+    opened = pf.hits + pf.late_hits + pf.misses;
+    fprintf(out, "prefetch: %lu issued, %lu hits, %lu late hits, "
+            "%lu misses, %lu wasted, hit ratio %.1f%%\n",
+            pf.issued, pf.hits, pf.late_hits, pf.misses, pf.wasted,
+            opened ? 100.0 * (pf.hits + pf.late_hits) / opened : 0.0);
+    pthread_mutex_unlock(&pf.lock);
+}
@@ -0,0 +1,11 @@
+/*
+ * prefetch.h
+ */
+
+#include "common.h"
+
+void prefetch_init(const char *repodir, int depth, off_t budget);
+void prefetch_destroy(void);
+void prefetch_readdir(const char *fpath);
+int prefetch_open(const char *fpath);
+void prefetch_stats(FILE *out);
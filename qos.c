@@ -0,0 +1,244 @@
+/*
+ * Scheduling of background work against foreground I/O
+ *
+ * Prefetching, replication, content transfers, pack compaction and the
+ * commits held back by atomicsave all compete with the reads and writes
+ * of the filesystem for the disk and the CPU. Background work asks here
+ * before each piece of it (a fetch, a segment, a commit), and is let
+ * through according to what the foreground is doing:
+ *
+ *  - while a read or a write is in progress, it waits: the foreground has
+ *    strict priority;
+ *  - while the 99th percentile of the latency of reads and writes over
+ *    the last QOS_WINDOW seconds is above -o qos_p99, it waits too;
+ *  - while the foreground was busy in the last QOS_IDLE milliseconds, each
+ *    class of work draws on a token bucket of -o background_rate bytes
+ *    per second, so that it can go on but slowly;
+ *  - otherwise the filesystem is idle, and it goes at full speed.
+ *
+ * Latencies are counted in a histogram of power of two microseconds.
+ */
+
+#include "qos.h"
+
+#include <time.h>
+
+#define QOS_WINDOW  2       /* seconds of latencies the p99 is taken over */
+#define QOS_IDLE    1000    /* ms without foreground I/O to be idle */
+#define QOS_SAMPLES 20      /* fewer latencies do not tell a p99 */
+#define QOS_POLL    50      /* ms between checks of a waiting request */
+#define QOS_BUCKETS 32
+
+static const char *names[QOS_CLASSES] = {
+    "prefetch", "replicate", "transfer", "compact", "commit"
+};
+
+typedef struct bucket bucket;
+struct bucket
+{
+    double tokens;          /* bytes, may go below zero */
+    long refilled;          /* ms */
+    unsigned long waits;    /* requests that had to wait */
+    unsigned long long bytes;
+};
+
+static struct {
+    bool started;
+    long p99_target;                /* us, 0 for none */
+    double rate;                    /* bytes per second, 0 for unlimited */
+    int inflight;                   /* foreground requests */
+    long last;                      /* ms, end of the last one */
+    /* latencies of the current and of the previous window */
+    unsigned long hist[2][QOS_BUCKETS];
+    long window;                    /* start of the current one (s) */
+    bucket buckets[QOS_CLASSES];
+    unsigned long paused;           /* checks that found the p99 too high */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;            /* no foreground request in progress */
+} qos = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER
+};
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* starts a new window when the current one is over (qos.lock held) */
+static void rotate(long now)
+{
+    long s = now / 1000000;
+    if (s - qos.window < QOS_WINDOW)
+        return;
+    if (s - qos.window < 2 * QOS_WINDOW)
+        memcpy(qos.hist[1], qos.hist[0], sizeof(qos.hist[0]));
+    else
+        memset(qos.hist[1], 0, sizeof(qos.hist[1]));
+    memset(qos.hist[0], 0, sizeof(qos.hist[0]));
+    qos.window = s;
+}
+
+/* upper bound of the 99th percentile latency (us), -1 without enough */
+static long p99(void)
+{
+    unsigned long n, seen;
+    int i;
+
+    n = 0;
+    for (i = 0; i < QOS_BUCKETS; i++)
+        n += qos.hist[0][i] + qos.hist[1][i];
+    if (n < QOS_SAMPLES)
+        return -1;
+    seen = 0;
+    for (i = 0; i < QOS_BUCKETS; i++) {
+        seen += qos.hist[0][i] + qos.hist[1][i];
+        if (seen * 100 >= n * 99)
+            break;
+    }
+    return 1L << i;
+}
+
+static void refill(bucket *b, long now_ms)
+{
+    b->tokens += qos.rate * (now_ms - b->refilled) / 1000;
+    /* a second worth of burst at most */
+    if (b->tokens > qos.rate)
+        b->tokens = qos.rate;
+    b->refilled = now_ms;
+}
+
+/*
+ * Interface
+ */
+
+void qos_init(int p99_target_ms, off_t rate)
+{
+    int i;
+
+    pthread_mutex_lock(&qos.lock);
+    qos.p99_target = p99_target_ms * 1000L;
+    qos.rate = rate;
+    qos.window = now_us() / 1000000;
+    for (i = 0; i < QOS_CLASSES; i++) {
+        memset(&qos.buckets[i], 0, sizeof(bucket));
+        qos.buckets[i].tokens = rate;
+        qos.buckets[i].refilled = now_us() / 1000;
+    }
+    qos.started = true;
+    pthread_mutex_unlock(&qos.lock);
+}
+
+/* lets everything through from now on, for the work done on unmount */
+void qos_destroy(void)
+{
+    qos_stats(stdout);
+    pthread_mutex_lock(&qos.lock);
+    qos.started = false;
+    pthread_cond_broadcast(&qos.idle);
+    pthread_mutex_unlock(&qos.lock);
+}
+
+/* To be called when a foreground request starts, returns its start */
+long qos_begin(void)
+{
+    pthread_mutex_lock(&qos.lock);
+    qos.inflight++;
+    pthread_mutex_unlock(&qos.lock);
+    return now_us();
+}
+
+/* To be called when the foreground request started at start is done */
+void qos_end(long start)
+{
+    long now, latency;
+    int i;
+
+    now = now_us();
+    latency = now - start;
+    for (i = 0; i < QOS_BUCKETS - 1 && (1L << i) < latency; i++)
+        ;
+    pthread_mutex_lock(&qos.lock);
+    rotate(now);
+    qos.hist[0][i]++;
+    qos.last = now / 1000;
+    if (--qos.inflight == 0)
+        pthread_cond_broadcast(&qos.idle);
+    pthread_mutex_unlock(&qos.lock);
+}
+
+/*
+ * Waits until background work of class cls may go on with about bytes
+ * worth of I/O (negative when it is not known).
+ */
+void qos_wait(int cls, off_t bytes)
+{
+    struct timespec ts;
+    bucket *b;
+    long now, late;
+    bool waited;
+
+    if (bytes < 0)
+        bytes = 0;
+    pthread_mutex_lock(&qos.lock);
+    b = &qos.buckets[cls];
+    waited = false;
+    while (qos.started) {
+        now = now_us();
+        rotate(now);
+        if (qos.inflight > 0) {
+            waited = true;
+            pthread_cond_wait(&qos.idle, &qos.lock);
+            continue;
+        }
+        late = qos.p99_target > 0 ? p99() : -1;
+        if (late > qos.p99_target)
+            qos.paused++;
+        else if (now / 1000 - qos.last >= QOS_IDLE || qos.rate == 0)
+            break;
+        else {
+            refill(b, now / 1000);
+            /* larger requests than the bucket go once it is full */
+            if (b->tokens >= (bytes < qos.rate ? bytes : qos.rate)) {
+                b->tokens -= bytes;
+                break;
+            }
+        }
+        waited = true;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += QOS_POLL * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&qos.idle, &qos.lock, &ts);
+    }
+    if (waited)
+        b->waits++;
+    b->bytes += bytes;
+    pthread_mutex_unlock(&qos.lock);
+}
+
+void qos_stats(FILE *out)
+{
+    long late;
+    int i;
+
+    pthread_mutex_lock(&qos.lock);
+    if (!qos.started) {
+        pthread_mutex_unlock(&qos.lock);
+        return;
+    }
+    late = p99();
+    if (late == -1)
+        fprintf(out, "qos: foreground p99 unknown, %lu pauses\n",
+                qos.paused);
+    else
+        fprintf(out, "qos: foreground p99 under %ld us, %lu pauses\n",
+                late, qos.paused);
+    for (i = 0; i < QOS_CLASSES; i++)
+        if (qos.buckets[i].bytes || qos.buckets[i].waits)
+            fprintf(out, "qos: %s: %llu bytes, %lu waits\n", names[i],
+                    qos.buckets[i].bytes, qos.buckets[i].waits);
+    pthread_mutex_unlock(&qos.lock);
+}
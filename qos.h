@@ -0,0 +1,16 @@
+/*
+ * qos.h
+ */
+
+#include "common.h"
+
+/* classes of background work */
+enum { QOS_PREFETCH, QOS_REPLICATE, QOS_TRANSFER, QOS_COMPACT, QOS_COMMIT,
+    QOS_CLASSES };
+
+void qos_init(int p99_target_ms, off_t rate);
+void qos_destroy(void);
+long qos_begin(void);
+void qos_end(long start);
+void qos_wait(int cls, off_t bytes);
+void qos_stats(FILE *out);
@@ -0,0 +1,100 @@
+/*
+ * Page cache hints for the files we serve
+ *
+ * Annex objects may live on disks much slower than what the users of the
+ * mount expect. Each handle follows its access pattern: as long as reads
+ * are contiguous, the range ahead of the cursor is announced to the kernel
+ * with a window that doubles each time the cursor reaches its second half.
+ * For very large files, what is far behind the cursor is dropped from the
+ * page cache so that a single stream does not evict everything else. A
+ * read anywhere else switches the handle back to random access.
+ */
+
+#include "readahead.h"
+
+#include <sys/stat.h>
+
+#define RA_MIN      (128 << 10)     /* first window */
+#define RA_MAX      (8 << 20)       /* largest window */
+#define RA_DROP     (1LL << 30)     /* files above this are dropped behind */
+#define RA_KEYS     256             /* slots remembering opened objects */
+
+void readahead_init(struct readahead *ra, int fd)
+{
+    struct stat st;
+
+    memset(ra, 0, sizeof(struct readahead));
+    if (fstat(fd, &st) != -1)
+        ra->size = st.st_size;
+    ra->window = RA_MIN;
+    ra->sequential = true;
+}
+
+void readahead_update(struct readahead *ra, int fd, off_t offset, size_t size)
+{
+    off_t end, start;
+
+    end = offset + size;
+    if (offset != ra->next) {
+        if (ra->sequential)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        ra->sequential = false;
+        ra->window = RA_MIN;
+        ra->advised = ra->dropped = end;
+        ra->next = end;
+        return;
+    }
+
+    if (!ra->sequential) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ra->sequential = true;
+    }
+    ra->next = end;
+
+    /* the cursor entered the second half of the window: move it forward */
+    if (end + ra->window / 2 >= ra->advised && ra->advised < ra->size) {
+        if (ra->advised > 0 && ra->window < RA_MAX)
+            ra->window *= 2;
+        start = ra->advised > end ? ra->advised : end;
+        posix_fadvise(fd, start, end + ra->window - start, POSIX_FADV_WILLNEED);
+        ra->advised = end + ra->window;
+    }
+
+    if (ra->size > RA_DROP && offset - ra->dropped > 2 * RA_MAX) {
+        posix_fadvise(fd, ra->dropped, offset - RA_MAX - ra->dropped,
+                POSIX_FADV_DONTNEED);
+        ra->dropped = offset - RA_MAX;
+    }
+}
+
+/*
+ * A locked annex object never changes, so the kernel may keep the pages it
+ * cached for a path as long as the path still points to the same key.
+ * Returns 1 if path was last opened with this key.
+ */
+int readahead_keep_cache(const char *fpath, const char *key)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct {
+        char path[FILENAME_MAX];
+        char key[FILENAME_MAX];
+    } opened[RA_KEYS];
+    unsigned long h;
+    const char *p;
+    int res;
+
+    h = 5381;
+    for (p = fpath; *p; p++)
+        h = h * 33 + (unsigned char) *p;
+    h %= RA_KEYS;
+
+    pthread_mutex_lock(&lock);
+    res = strcmp(opened[h].path, fpath) == 0
+        && strcmp(opened[h].key, key) == 0;
+    if (!res) {
+        strncpy(opened[h].path, fpath, FILENAME_MAX - 1);
+        strncpy(opened[h].key, key, FILENAME_MAX - 1);
+    }
+    pthread_mutex_unlock(&lock);
+    return res;
+}
@@ -0,0 +1,19 @@
+/*
+ * readahead.h
+ */
+
+#include "common.h"
+
+struct readahead
+{
+    off_t size;         /* of the file when it was opened */
+    off_t next;         /* where a sequential stream reads next */
+    off_t advised;      /* end of the range announced with WILLNEED */
+    off_t dropped;      /* start of the range still in the page cache */
+    off_t window;
+    bool sequential;
+};
+
+void readahead_init(struct readahead *ra, int fd);
+void readahead_update(struct readahead *ra, int fd, off_t offset, size_t size);
+int readahead_keep_cache(const char *fpath, const char *key);
@@ -0,0 +1,335 @@
+/*
+ * Deep replication (-o deep_replicate)
+ *
+ * Keeps a full copy of the content of every file, so that a laptop taken
+ * offline has everything. A pool of workers walks the tree and fetches
+ * what is absent, the same way an open would.
+ *
+ * The walk is a priority queue of directories and files rather than a
+ * plain traversal: a directory that is listed or has a file opened goes
+ * ahead of everything queued before it, its files before its
+ * subdirectories, so that what is being used gets complete first. Each
+ * fetch waits for its turn in the QoS scheduler (see qos.c), which lets
+ * the reads and writes of the filesystem go first.
+ *
+ * The walk starts at mount, and again after a sync brought in new files.
+ * Each directory is expanded once per walk, however many times it was
+ * queued: by the walk of its parent and then by each use of it.
+ */
+
+#include "replicate.h"
+#include "git-annex.h"
+#include "store.h"
+#include "stripe.h"
+#include "locations.h"
+#include "inventory.h"
+#include "qos.h"
+
+#include <sys/stat.h>
+
+#define REPLICATE_WORKERS 2
+#define REPLICATE_BUCKETS 4096
+
+typedef struct item item;
+struct item
+{
+    char *path;
+    long prio;          /* higher first */
+    unsigned long seq;  /* then first queued first */
+    bool dir;
+};
+
+typedef struct expanded expanded;
+struct expanded
+{
+    char *path;
+    expanded *next;
+};
+
+static struct {
+    const char *repodir;
+    item *heap;
+    size_t n, cap;
+    long clock;                 /* priority of the last used directory */
+    unsigned long seq;
+    expanded *expanded[REPLICATE_BUCKETS];  /* directories of this walk */
+    char used[FILENAME_MAX];    /* last used directory */
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* an item was queued */
+    pthread_t workers[REPLICATE_WORKERS];
+    int running;                /* workers holding an item */
+    bool stop, started;
+    unsigned long fetched, failed;
+} rp;
+
+/*
+ * Priority queue (called with rp.lock held)
+ */
+
+static bool before(const item *a, const item *b)
+{
+    return a->prio > b->prio || (a->prio == b->prio && a->seq < b->seq);
+}
+
+static void push(const char *path, long prio, bool dir)
+{
+    size_t i;
+    item it;
+
+    if (rp.n == rp.cap) {
+        rp.cap = rp.cap ? 2 * rp.cap : 256;
+        rp.heap = realloc(rp.heap, rp.cap * sizeof(item));
+    }
+    it.path = strdup(path);
+    it.prio = prio;
+    it.seq = rp.seq++;
+    it.dir = dir;
+    for (i = rp.n++; i > 0 && before(&it, &rp.heap[(i - 1) / 2]);
+            i = (i - 1) / 2)
+        rp.heap[i] = rp.heap[(i - 1) / 2];
+    rp.heap[i] = it;
+    pthread_cond_signal(&rp.work);
+}
+
+static item pop(void)
+{
+    size_t i, c;
+    item top, last;
+
+    top = rp.heap[0];
+    last = rp.heap[--rp.n];
+    for (i = 0; (c = 2 * i + 1) < rp.n; i = c) {
+        if (c + 1 < rp.n && before(&rp.heap[c + 1], &rp.heap[c]))
+            c++;
+        if (!before(&rp.heap[c], &last))
+            break;
+        rp.heap[i] = rp.heap[c];
+    }
+    rp.heap[i] = last;
+    return top;
+}
+
+/*
+ * Directories expanded during the walk (called with rp.lock held)
+ */
+
+static unsigned long hash(const char *path)
+{
+    unsigned long h = 5381;
+    for (; *path; path++)
+        h = h * 33 + (unsigned char) *path;
+    return h % REPLICATE_BUCKETS;
+}
+
+static bool was_expanded(const char *dirpath)
+{
+    expanded *e;
+    for (e = rp.expanded[hash(dirpath)]; e != NULL; e = e->next)
+        if (strcmp(e->path, dirpath) == 0)
+            return true;
+    return false;
+}
+
+/* false if dirpath was already expanded during this walk */
+static bool mark_expanded(const char *dirpath)
+{
+    expanded *e;
+
+    if (was_expanded(dirpath))
+        return false;
+    e = malloc(sizeof(expanded));
+    e->path = strdup(dirpath);
+    e->next = rp.expanded[hash(dirpath)];
+    rp.expanded[hash(dirpath)] = e;
+    return true;
+}
+
+/* forgets the directories expanded, for a new walk */
+static void forget_expanded(void)
+{
+    expanded *e, *next;
+    int i;
+
+    for (i = 0; i < REPLICATE_BUCKETS; i++) {
+        for (e = rp.expanded[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->path);
+            free(e);
+        }
+        rp.expanded[i] = NULL;
+    }
+}
+
+/*
+ * Work (called without the lock)
+ */
+
+/* queues the entries of dirpath: its files at prio, its directories below */
+static void expand(const char *dirpath, long prio)
+{
+    char path[FILENAME_MAX];
+    struct dirent **entries;
+    struct stat st;
+    bool first;
+    int n, i;
+
+    pthread_mutex_lock(&rp.lock);
+    first = mark_expanded(dirpath);
+    pthread_mutex_unlock(&rp.lock);
+    if (!first || (n = scandir(dirpath, &entries, NULL, alphasort)) == -1)
+        return;
+    pthread_mutex_lock(&rp.lock);
+    for (i = 0; i < n; i++) {
+        if (strcmp(entries[i]->d_name, ".") != 0
+                && strcmp(entries[i]->d_name, "..") != 0
+                && strcmp(entries[i]->d_name, ".git") != 0) {
+            snprintf(path, FILENAME_MAX, "%s/%s", dirpath,
+                    entries[i]->d_name);
+            if (lstat(path, &st) == -1)
+                ;
+            else if (S_ISDIR(st.st_mode))
+                push(path, prio - 1, true);
+            else if (S_ISLNK(st.st_mode))
+                push(path, prio, false);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    pthread_mutex_unlock(&rp.lock);
+}
+
+static bool absent(const char *fpath)
+{
+    struct stat st;
+    return git_annexed(rp.repodir, fpath) && stat(fpath, &st) == -1
+        && store_holder(fpath) == NULL;
+}
+
+static void replicate_file(const char *fpath)
+{
+    char key[FILENAME_MAX];
+    bool ok;
+
+    if (!absent(fpath))
+        return;
+    qos_wait(QOS_REPLICATE, git_annex_key(fpath, key) == 0
+            ? git_annex_keysize(key) : 0);
+    if (stripe_get(rp.repodir, fpath) == -1 && locations_get(fpath) == -1)
+        git_annex_get(rp.repodir, fpath, NULL);
+    inventory_update_link(fpath);
+    ok = !absent(fpath);
+    pthread_mutex_lock(&rp.lock);
+    if (ok)
+        rp.fetched++;
+    else
+        rp.failed++;
+    pthread_mutex_unlock(&rp.lock);
+}
+
+static void *worker(void *arg)
+{
+    item it;
+    (void) arg;
+
+    pthread_mutex_lock(&rp.lock);
+    while (!rp.stop) {
+        if (rp.n == 0) {
+            pthread_cond_wait(&rp.work, &rp.lock);
+            continue;
+        }
+        it = pop();
+        rp.running++;
+        pthread_mutex_unlock(&rp.lock);
+
+        if (it.dir)
+            expand(it.path, it.prio);
+        else
+            replicate_file(it.path);
+        free(it.path);
+
+        pthread_mutex_lock(&rp.lock);
+        if (--rp.running == 0 && rp.n == 0)
+            printf("replicate: walk done, %lu fetched, %lu failed\n",
+                    rp.fetched, rp.failed);
+    }
+    pthread_mutex_unlock(&rp.lock);
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+void replicate_init(const char *repodir, bool enabled)
+{
+    int i;
+
+    memset(&rp, 0, sizeof(rp));
+    if (!enabled)
+        return;
+    rp.repodir = repodir;
+    pthread_mutex_init(&rp.lock, NULL);
+    pthread_cond_init(&rp.work, NULL);
+    rp.started = true;
+    replicate_rescan();
+    for (i = 0; i < REPLICATE_WORKERS; i++)
+        pthread_create(&rp.workers[i], NULL, worker, NULL);
+}
+
+void replicate_destroy(void)
+{
+    int i;
+
+    if (!rp.started)
+        return;
+    pthread_mutex_lock(&rp.lock);
+    rp.stop = true;
+    pthread_cond_broadcast(&rp.work);
+    pthread_mutex_unlock(&rp.lock);
+    for (i = 0; i < REPLICATE_WORKERS; i++)
+        pthread_join(rp.workers[i], NULL);
+    while (rp.n > 0)
+        free(pop().path);
+    free(rp.heap);
+    forget_expanded();
+    printf("replicate: %lu fetched, %lu failed\n", rp.fetched, rp.failed);
+    rp.started = false;
+}
+
+/* walks the whole tree again, after what was used */
+void replicate_rescan(void)
+{
+    if (!rp.started)
+        return;
+    pthread_mutex_lock(&rp.lock);
+    forget_expanded();
+    push(rp.repodir, 0, true);
+    pthread_mutex_unlock(&rp.lock);
+}
+
+/*
+ * To be called when the directory or the file fpath is used: the
+ * directory (or the directory of the file) goes ahead of the walk.
+ */
+void replicate_touch(const char *fpath)
+{
+    char dirpath[FILENAME_MAX], *p;
+    struct stat st;
+
+    if (!rp.started)
+        return;
+    strncpy(dirpath, fpath, FILENAME_MAX - 1);
+    dirpath[FILENAME_MAX - 1] = '\0';
+    if (lstat(dirpath, &st) == 0 && !S_ISDIR(st.st_mode)
+            && (p = strrchr(dirpath, '/')) != NULL)
+        *p = '\0';
+    pthread_mutex_lock(&rp.lock);
+    /* a directory already expanded has its files queued or fetched */
+    if (strcmp(dirpath, rp.used) != 0 && !was_expanded(dirpath)) {
+        strcpy(rp.used, dirpath);
+        /* far enough above the previous one for its subdirectories */
+        rp.clock += 1 << 16;
+        push(dirpath, rp.clock, true);
+    }
+    pthread_mutex_unlock(&rp.lock);
+}
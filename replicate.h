@@ -0,0 +1,10 @@
+/*
+ * replicate.h
+ */
+
+#include "common.h"
+
+void replicate_init(const char *repodir, bool enabled);
+void replicate_destroy(void);
+void replicate_rescan(void);
+void replicate_touch(const char *fpath);
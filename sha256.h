@@ -0,0 +1,24 @@
+/*
+ * sha256.h
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct sha256 sha256;
+struct sha256
+{
+    uint32_t state[8];
+    uint64_t count;             /* bytes hashed so far */
+    unsigned char buf[64];      /* pending bytes, count % 64 of them */
+};
+
+void sha256_init(sha256 *ctx);
+void sha256_update(sha256 *ctx, const void *data, size_t len);
+void sha256_final(sha256 *ctx, unsigned char digest[32]);
+void sha256_hex(const sha256 *ctx, char hex[65]);
+
+#endif /*__SHA256_H__ */
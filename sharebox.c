@@ -4,6 +4,12 @@
 
 #include "common.h"
 #include "slash.h"
+#include "control.h"
+#include "peers.h"
+#include "import.h"
+#include "qos.h"
+
+#include <poll.h>
 
 /*
  * Options parsing
@@ -14,11 +20,30 @@
 enum {
     KEY_HELP,
     KEY_VERSION,
+    KEY_PREFETCH_BUDGET,
+    KEY_OVERLAY_MIN,
+    KEY_INLINE_MAX,
+    KEY_PACK_MAX,
+    KEY_CHUNK_MIN,
+    KEY_BACKGROUND_RATE,
 };
 
 static struct fuse_opt sharebox_opts[] = {
     SHAREBOX_OPT("deep_replicate",      deep_replicate, false),
     SHAREBOX_OPT("write_callback=%s",   write_callback, 0),
+    SHAREBOX_OPT("write_callback_delay=%d", write_callback_delay, 0),
+    SHAREBOX_OPT("prefetch=%d",         prefetch_depth, 0),
+    FUSE_OPT_KEY("prefetch_budget=",    KEY_PREFETCH_BUDGET),
+    FUSE_OPT_KEY("overlay_min=",        KEY_OVERLAY_MIN),
+    FUSE_OPT_KEY("inline_max=",         KEY_INLINE_MAX),
+    FUSE_OPT_KEY("pack_max=",           KEY_PACK_MAX),
+    FUSE_OPT_KEY("chunk_min=",          KEY_CHUNK_MIN),
+    SHAREBOX_OPT("compress",            compress, true),
+    SHAREBOX_OPT("sync_content",        sync_content, true),
+    SHAREBOX_OPT("transfers=%d",        transfers, 0),
+    SHAREBOX_OPT("peer_transfers=%d",   peer_transfers, 0),
+    SHAREBOX_OPT("qos_p99=%d",          qos_p99, 0),
+    FUSE_OPT_KEY("background_rate=",    KEY_BACKGROUND_RATE),
     FUSE_OPT_KEY("-V",                  KEY_VERSION),
     FUSE_OPT_KEY("--version",           KEY_VERSION),
     FUSE_OPT_KEY("-h",                  KEY_HELP),
@@ -31,7 +56,7 @@ static struct fuse_opt sharebox_opts[] = {
  *
  * sharebox-fs embeds more than one filesystem.
  *
- * "/.sharebox/remotes/" allows to manage the remotes
+ * "/.sharebox/peers/" allows to manage the peers, and to sync with them
  * "/.sharebox/revisions/" allows to browse the history
  * "/.sharebox/unreferenced/" allows to see what files you can trash
  * "/" contains the real versionning.
@@ -47,13 +72,24 @@ static struct fuse_opt sharebox_opts[] = {
 
 struct sharebox sharebox;
 
+/* whether path is the directory d or lies below it */
+static int matches(const dir *d, const char *path)
+{
+    size_t len = strlen(d->name);
+
+    if (strcmp(d->name, "/") == 0)
+        return 1;
+    return strncmp(path, d->name, len) == 0
+        && (path[len] == '/' || path[len] == '\0');
+}
+
 static int sharebox_getattr(const char *path, struct stat *stbuf)
 {
     dirlist *l;
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.getattr(path, stbuf);
     }
     return -EACCES;
@@ -65,7 +101,7 @@ static int sharebox_access(const char *path, int mask)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.access(path, mask);
     }
     return -EACCES;
@@ -77,7 +113,7 @@ static int sharebox_readlink(const char *path, char *buf, size_t size)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.readlink(path, buf, size);
     }
     return -EACCES;
@@ -91,7 +127,7 @@ static int sharebox_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.readdir(path, buf, filler, offset, fi);
     }
     return -EACCES;
@@ -103,7 +139,7 @@ static int sharebox_mknod(const char *path, mode_t mode, dev_t rdev)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.mknod(path, mode, rdev);
     }
     return -EACCES;
@@ -115,7 +151,7 @@ static int sharebox_mkdir(const char *path, mode_t mode)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.mkdir(path, mode);
     }
     return -EACCES;
@@ -127,7 +163,7 @@ static int sharebox_unlink(const char *path)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.unlink(path);
     }
     return -EACCES;
@@ -139,7 +175,7 @@ static int sharebox_rmdir(const char *path)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.rmdir(path);
     }
     return -EACCES;
@@ -151,7 +187,7 @@ static int sharebox_symlink(const char *target, const char *linkname)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(linkname, d->name, strlen(d->name)) == 0)
+        if (matches(d, linkname))
             return d->operations.symlink(target, linkname);
     }
     return -EACCES;
@@ -164,8 +200,8 @@ static int sharebox_rename(const char *from, const char *to)
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
         /* /!\ we only accept renaming inside the same fs */
-        if ((strncmp(from, d->name, strlen(d->name)) == 0) &&
-            (strncmp(to, d->name, strlen(d->name) == 0)))
+        if ((matches(d, from)) &&
+            (matches(d, to)))
             return d->operations.rename(from, to);
     }
     return -EACCES;
@@ -177,7 +213,7 @@ static int sharebox_chmod(const char *path, mode_t mode)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.chmod(path, mode);
     }
     return -EACCES;
@@ -189,7 +225,7 @@ static int sharebox_chown(const char *path, uid_t uid, gid_t gid)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.chown(path, uid, gid);
     }
     return -EACCES;
@@ -201,7 +237,7 @@ static int sharebox_truncate(const char *path, off_t size)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.truncate(path, size);
     }
     return -EACCES;
@@ -213,7 +249,7 @@ static int sharebox_utimens(const char *path, const struct timespec ts[2])
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.utimens(path, ts);
     }
     return -EACCES;
@@ -225,7 +261,7 @@ static int sharebox_open(const char *path, struct fuse_file_info *fi)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.open(path, fi);
     }
     return -EACCES;
@@ -238,7 +274,7 @@ static int sharebox_read(const char *path, char *buf, size_t size, off_t offset,
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.read(path, buf, size, offset, fi);
     }
     return -EACCES;
@@ -251,19 +287,51 @@ static int sharebox_write(const char *path, const char *buf, size_t size,
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.write(path, buf, size, offset, fi);
     }
     return -EACCES;
 }
 
+static int sharebox_flush(const char *path, struct fuse_file_info *fi)
+{
+    dirlist *l;
+    dir *d;
+    for (l = sharebox.dirs; l != NULL; l = l->next) {
+        d = l->dir;
+        if (matches(d, path))
+            return d->operations.flush ? d->operations.flush(path, fi) : 0;
+    }
+    return 0;
+}
+
+static int sharebox_poll(const char *path, struct fuse_file_info *fi,
+        struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+    dirlist *l;
+    dir *d;
+    for (l = sharebox.dirs; l != NULL; l = l->next) {
+        d = l->dir;
+        if (matches(d, path)) {
+            if (d->operations.poll)
+                return d->operations.poll(path, fi, ph, reventsp);
+            break;
+        }
+    }
+    /* regular files are always ready */
+    if (ph)
+        fuse_pollhandle_destroy(ph);
+    *reventsp |= POLLIN | POLLOUT;
+    return 0;
+}
+
 static int sharebox_release(const char *path, struct fuse_file_info *fi)
 {
     dirlist *l;
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.release(path, fi);
     }
     return 0;
@@ -275,12 +343,38 @@ static int sharebox_statfs(const char *path, struct statvfs *stbuf)
     dir *d;
     for (l = sharebox.dirs; l != NULL; l = l->next) {
         d = l->dir;
-        if (strncmp(path, d->name, strlen(d->name)) == 0)
+        if (matches(d, path))
             return d->operations.statfs(path, stbuf);
     }
     return -EACCES;
 }
 
+static void *sharebox_init(struct fuse_conn_info *conn)
+{
+    dirlist *l;
+    dir *d;
+    qos_init(sharebox.qos_p99, sharebox.background_rate);
+    for (l = sharebox.dirs; l != NULL; l = l->next) {
+        d = l->dir;
+        if (d->operations.init)
+            d->operations.init(conn);
+    }
+    return NULL;
+}
+
+static void sharebox_destroy(void *data)
+{
+    dirlist *l;
+    dir *d;
+    /* unmounting waits for no one */
+    qos_destroy();
+    for (l = sharebox.dirs; l != NULL; l = l->next) {
+        d = l->dir;
+        if (d->operations.destroy)
+            d->operations.destroy(data);
+    }
+}
+
 static struct fuse_operations sharebox_oper = {
     .getattr    = sharebox_getattr,
     .access     = sharebox_access,
@@ -299,14 +393,18 @@ static struct fuse_operations sharebox_oper = {
     .open       = sharebox_open,
     .read       = sharebox_read,
     .write      = sharebox_write,
+    .flush      = sharebox_flush,
     .release    = sharebox_release,
+    .poll       = sharebox_poll,
     .statfs     = sharebox_statfs,
+    .init       = sharebox_init,
+    .destroy    = sharebox_destroy,
 };
 
 static dirlist *init_dirlist()
 {
-    dirlist *l;
-    dir *slash;
+    dirlist *l, *c, *p;
+    dir *slash, *control, *peers;
 
     l = malloc(sizeof (dirlist));
     slash = malloc (sizeof (dir));
@@ -315,7 +413,60 @@ static dirlist *init_dirlist()
     l->dir = slash;
     l->next = NULL;
 
-    return l;
+    /* "/" matches everything, the control dir has to come first */
+    c = malloc(sizeof (dirlist));
+    control = malloc (sizeof (dir));
+    memset(control, 0, sizeof (dir));
+    init_control(control);
+
+    c->dir = control;
+    c->next = l;
+
+    /* and the peers before the control dir they are in */
+    p = malloc(sizeof (dirlist));
+    peers = malloc (sizeof (dir));
+    memset(peers, 0, sizeof (dir));
+    init_peers(peers);
+
+    p->dir = peers;
+    p->next = c;
+
+    return p;
+}
+
+/*
+ * Parses sizes such as "512m" or "16k"; returns -1 on garbage.
+ */
+static off_t parse_size(const char *s)
+{
+    char *end;
+    off_t size;
+
+    size = strtoll(s, &end, 10);
+    if (end == s || size < 0)
+        return -1;
+    switch (*end) {
+        case 'g': case 'G':
+            size <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            size <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            size <<= 10;
+            end++;
+    }
+    if (*end != '\0')
+        return -1;
+    return size;
+}
+
+static void size_opt(off_t *size, const char *arg)
+{
+    if ((*size = parse_size(strchr(arg, '=') + 1)) == -1) {
+        fprintf(stderr, "bad size: %s\n", arg);
+        exit(1);
+    }
 }
 
 static int
@@ -328,6 +479,7 @@ sharebox_opt_proc
         case KEY_HELP:
             fprintf(stderr,
                     "usage: %s <fsdir> <mountpoint> [options]\n"
+                    "       %s import <srcdir> <fsdir>/files/<dest>\n"
                     "\n"
                     "general options:\n"
                     "    -o opt,[opt...]        mount options\n"
@@ -335,9 +487,22 @@ sharebox_opt_proc
                     "    -V   --version         print version\n"
                     "\n"
                     "sharebox options:\n"
-                    "    -o deep_replicate      replicate deeply\n"
-                    "    -o write_callback      program to call when a file has been written\n"
-                    "\n", outargs->argv[0]);
+                    "    -o deep_replicate      fetch the content of every file in the background\n"
+                    "    -o write_callback=P    program given the paths written, on stdin\n"
+                    "    -o write_callback_delay=MS  quiet period before calling it (1000)\n"
+                    "    -o prefetch=N          fetch the next N absent files of a directory\n"
+                    "    -o prefetch_budget=S   max size of prefetched unopened files (256m)\n"
+                    "    -o overlay_min=S       write large annexed files through an overlay (64m)\n"
+                    "    -o inline_max=S        store files up to S in git rather than the annex\n"
+                    "    -o pack_max=S          pack annexed objects up to S in segment files\n"
+                    "    -o chunk_min=S         store annexed objects from S as shared chunks\n"
+                    "    -o compress            store compressible annexed objects compressed\n"
+                    "    -o sync_content        fetch the content of what a sync brings in\n"
+                    "    -o transfers=N         concurrent content transfers (4)\n"
+                    "    -o peer_transfers=N    concurrent content transfers per peer (2)\n"
+                    "    -o qos_p99=MS          pause background work above this read/write p99 (50)\n"
+                    "    -o background_rate=S   background I/O per second while in use (16m)\n"
+                    "\n", outargs->argv[0], outargs->argv[0]);
             fuse_opt_add_arg(outargs, "-ho");
             fuse_main(outargs->argc, outargs->argv, &sharebox_oper, NULL);
             exit(1);
@@ -346,6 +511,24 @@ sharebox_opt_proc
             fuse_opt_add_arg(outargs, "--version");
             fuse_main(outargs->argc, outargs->argv, &sharebox_oper, NULL);
             exit(0);
+        case KEY_PREFETCH_BUDGET:
+            size_opt(&sharebox.prefetch_budget, arg);
+            return 0;
+        case KEY_OVERLAY_MIN:
+            size_opt(&sharebox.overlay_min, arg);
+            return 0;
+        case KEY_INLINE_MAX:
+            size_opt(&sharebox.inline_max, arg);
+            return 0;
+        case KEY_PACK_MAX:
+            size_opt(&sharebox.pack_max, arg);
+            return 0;
+        case KEY_CHUNK_MIN:
+            size_opt(&sharebox.chunk_min, arg);
+            return 0;
+        case KEY_BACKGROUND_RATE:
+            size_opt(&sharebox.background_rate, arg);
+            return 0;
         case FUSE_OPT_KEY_NONOPT:
             if (!sharebox.reporoot) {
                 if (stat(arg, &st) == -1){
@@ -374,8 +557,19 @@ sharebox_opt_proc
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (argc == 4 && strcmp(argv[1], "import") == 0)
+        return import_main(argv[2], argv[3]);
     memset(&sharebox, 0, sizeof(sharebox));
+    sharebox.prefetch_budget = 256 << 20;
+    sharebox.overlay_min = 64 << 20;
+    sharebox.transfers = 4;
+    sharebox.peer_transfers = 2;
+    sharebox.write_callback_delay = 1000;
+    sharebox.qos_p99 = 50;
+    sharebox.background_rate = 16 << 20;
     fuse_opt_parse(&args, &sharebox, sharebox_opts, sharebox_opt_proc);
+    /* have O_TRUNC passed to open() rather than turned into truncate() */
+    fuse_opt_add_arg(&args, "-oatomic_o_trunc");
     umask(0);
     return fuse_main(args.argc, args.argv, &sharebox_oper, NULL);
 }
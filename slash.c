@@ -4,9 +4,57 @@
 
 #include "slash.h"
 #include "git-annex.h"
+#include "prefetch.h"
+#include "readahead.h"
+#include "overlay.h"
+#include "sha256.h"
+#include "hashstate.h"
+#include "metadata.h"
+#include "atomicsave.h"
+#include "store.h"
+#include "stripe.h"
+#include "inventory.h"
+#include "locations.h"
+#include "replicate.h"
+#include "qos.h"
+#include "notify.h"
+#include "events.h"
 
 // TODO: fix the errnos (save them as soon as they happen)
 
+/*
+ * State of an open file, kept in fi->fh
+ */
+
+typedef struct handle handle;
+struct handle
+{
+    char fpath[FILENAME_MAX];
+    int fd;                     /* -1 when reading from a store */
+    store *st;
+    char key[FILENAME_MAX];
+    char restored[FILENAME_MAX];    /* object taken out of a store */
+    struct readahead ra;
+    overlay *ov;                /* writes to large annexed files */
+    sha256 hash;                /* of the content, while written in order */
+    bool hashing;
+    bool written;
+    bool writer;                /* opened for writing */
+    handle *next;
+};
+
+/* open handles, protected by sharebox.rwlock */
+static handle *handles;
+
+/* files created and not opened yet, protected by sharebox.rwlock */
+typedef struct created created;
+struct created
+{
+    char *fpath;
+    created *next;
+};
+static created *creations;
+
 /*
  * Helpers
  */
@@ -24,6 +72,210 @@ static int ondisk(const char *lnk)
     return (stat(lnk, &st) != -1);
 }
 
+/*
+ * The hash a handle computes while a new file is written is only worth
+ * something if nothing else touched the file in the meantime.
+ */
+static void invalidate_hashes(const char *fpath, handle *except)
+{
+    handle *h;
+    for (h = handles; h != NULL; h = h->next)
+        if (h != except && strcmp(h->fpath, fpath) == 0)
+            h->hashing = false;
+}
+
+/* whether fpath has open handles (called with sharebox.rwlock held) */
+static bool opened(const char *fpath)
+{
+    handle *h;
+    for (h = handles; h != NULL; h = h->next)
+        if (strcmp(h->fpath, fpath) == 0)
+            return true;
+    return false;
+}
+
+/* creating a file changes it as much as writing it */
+static void created_add(const char *fpath)
+{
+    created *c = malloc(sizeof(created));
+    c->fpath = strdup(fpath);
+    c->next = creations;
+    creations = c;
+}
+
+/* whether fpath was created since it was last opened */
+static bool created_take(const char *fpath)
+{
+    created **p, *c;
+    for (p = &creations; *p != NULL; p = &(*p)->next) {
+        if (strcmp((*p)->fpath, fpath) == 0) {
+            c = *p;
+            *p = c->next;
+            free(c->fpath);
+            free(c);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Adds fpath under the key of the given hash of its content. Returns -1
+ * if the hash does not describe the file.
+ */
+static int annex_add_hashed(const char *fpath, sha256 *hash)
+{
+    struct stat st;
+    char hex[65], key[FILENAME_MAX];
+
+    if (hash == NULL || hash->count == 0)
+        return -1;
+    if (lstat(fpath, &st) == -1 || !S_ISREG(st.st_mode)
+            || (uint64_t) st.st_size != hash->count)
+        return -1;
+    sha256_hex(hash, hex);
+    git_annex_mkkey(key, fpath, st.st_size, hex);
+    if (git_annex_setkey(sharebox.reporoot, fpath, key) != 0)
+        return -1;
+    hashstate_save(fpath, key, hash);
+    return 0;
+}
+
+/*
+ * Adds the content of fpath, as a plain git blob up to inline_max bytes
+ * and to the annex (under the given hash of it, if known) above.
+ */
+static void add_content(const char *fpath, sha256 *hash)
+{
+    struct stat st;
+
+    if (sharebox.inline_max > 0 && lstat(fpath, &st) == 0
+            && S_ISREG(st.st_mode) && st.st_size <= sharebox.inline_max) {
+        hashstate_remove(fpath);
+        git_add(sharebox.reporoot, fpath);
+        return;
+    }
+    if (annex_add_hashed(fpath, hash) != 0) {
+        /* the state saved for the previous content is of no use */
+        hashstate_remove(fpath);
+        git_annex_add(sharebox.reporoot, fpath);
+    }
+    inventory_update_link(fpath);
+    store_absorb(fpath);
+}
+
+/*
+ * Adds and commits the content of a released file (called with
+ * sharebox.rwlock held). It is told as a change if it was written.
+ */
+static void commit_released(const char *path, sha256 *hash, bool written)
+{
+    char fpath[FILENAME_MAX];
+    fullpath(fpath, path);
+
+    /* an overlay is committed once compacted, see commit_compacted */
+    if (overlay_find(fpath) != NULL)
+        return;
+    if (!git_ignored(sharebox.reporoot, fpath)){
+        add_content(fpath, hash);
+        git_commit(sharebox.reporoot, "released %s", path+1);
+        if (written)
+            events_record('M', path);
+    }
+}
+
+/* commits a release the atomic save detector held back */
+static void commit_held_back(const char *path, sha256 *hash, bool written)
+{
+    char fpath[FILENAME_MAX];
+    struct stat st;
+    fullpath(fpath, path);
+    qos_wait(QOS_COMMIT, lstat(fpath, &st) == 0 ? st.st_size : 0);
+    pthread_mutex_lock(&sharebox.rwlock);
+    commit_released(path, hash, written);
+    pthread_mutex_unlock(&sharebox.rwlock);
+    if (written)
+        notify_changed(path);
+}
+
+/* commits the content an overlay was compacted to (sharebox.rwlock held) */
+static void commit_compacted(const char *fpath)
+{
+    const char *path = fpath + strlen(sharebox.reporoot) + strlen("/files");
+
+    if (!git_ignored(sharebox.reporoot, fpath)){
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "released %s", path+1);
+        events_record('M', path);
+    }
+    notify_changed(path);
+}
+
+/*
+ * The attributes of annexed files are recorded instead of applied, so the
+ * rules the kernel applies to chmod, chown and utimens are checked here,
+ * against the owner the file is presented with.
+ */
+
+/* the attributes slash_getattr presents the annexed file fpath with */
+static void annexed_attrs(const char *path, const char *fpath,
+        struct stat *st)
+{
+    if (stat(fpath, st) == -1 && lstat(fpath, st) == -1)
+        memset(st, 0, sizeof(struct stat));
+    st->st_mode |= S_IWUSR;
+    metadata_apply(path, st);
+}
+
+/* whether the caller is root or the owner of st */
+static bool caller_owns(const struct stat *st)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    return ctx->uid == 0 || ctx->uid == st->st_uid;
+}
+
+/* whether gid is the group or one of the supplementary groups of the
+   caller */
+static bool caller_in_group(gid_t gid)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    char status[64], line[4096], *p, *end;
+    unsigned long g;
+    bool found;
+    FILE *f;
+
+    if (ctx->gid == gid)
+        return true;
+    sprintf(status, "/proc/%d/status", (int) ctx->pid);
+    if ((f = fopen(status, "r")) == NULL)
+        return false;
+    found = false;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "Groups:", 7) != 0)
+            continue;
+        for (p = line + 7; !found; p = end) {
+            g = strtoul(p, &end, 10);
+            if (end == p)
+                break;
+            found = g == gid;
+        }
+        break;
+    }
+    fclose(f);
+    return found;
+}
+
+/* whether the permissions of st let the caller write */
+static bool writable(const struct stat *st)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx->uid == st->st_uid)
+        return st->st_mode & S_IWUSR;
+    if (caller_in_group(st->st_gid))
+        return st->st_mode & S_IWGRP;
+    return st->st_mode & S_IWOTH;
+}
+
 /*
  * FS Operations
  */
@@ -31,6 +283,7 @@ static int ondisk(const char *lnk)
 static int slash_getattr(const char *path, struct stat *stbuf)
 {
     int res;
+    char key[FILENAME_MAX];
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
@@ -38,12 +291,16 @@ static int slash_getattr(const char *path, struct stat *stbuf)
     if (git_annexed(sharebox.reporoot, fpath)) {
         if (ondisk(fpath)) {
             res = stat(fpath, stbuf);
+            overlay_size(fpath, &stbuf->st_size);
         } else {
             stbuf->st_mode &= ~S_IFMT;
             stbuf->st_mode |= S_IFREG; /* fake regular file */
             stbuf->st_size = 0;        /* fake size = 0 */
+            if (store_holder(fpath) && git_annex_key(fpath, key) == 0)
+                stbuf->st_size = git_annex_keysize(key);
         }
         stbuf->st_mode |= S_IWUSR;     /* fake writable */
+        metadata_apply(path, stbuf);
     }
     if (res == -1)
         return -errno;
@@ -54,15 +311,21 @@ static int slash_getattr(const char *path, struct stat *stbuf)
 static int slash_access(const char *path, int mask)
 {
     int res;
+    struct stat st;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
     if (git_annexed(sharebox.reporoot, fpath)) {
-        if (ondisk(fpath))
+        if (ondisk(fpath)) {
             res = access(fpath, mask & ~W_OK);
-        else
+        } else if (store_holder(fpath)) {
+            /* a store serves the content as slash_getattr presents it */
+            annexed_attrs(path, fpath, &st);
+            res = (mask & X_OK) && !(st.st_mode & 0111) ? -EACCES : 0;
+        } else {
             res = -EACCES;
+        }
     }
     else
         res = access(fpath, mask);
@@ -110,6 +373,13 @@ static int slash_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     }
     closedir(dp);
 
+    /* the control directory is handled elsewhere */
+    if (strcmp(path, "/") == 0)
+        filler(buf, ".sharebox", NULL, 0);
+
+    prefetch_readdir(fpath);
+    replicate_touch(fpath);
+
     /* We then list conflicting files */
     /*
     namelist *branch, *b;
@@ -155,6 +425,11 @@ static int slash_mknod(const char *path, mode_t mode, dev_t rdev)
     else
         res = mknod(fpath, mode, rdev);
 
+    if (res != -1 && S_ISREG(mode)) {
+        atomicsave_created(path);
+        created_add(fpath);
+    }
+
     pthread_mutex_unlock(&sharebox.rwlock);
 
     if (res == -1)
@@ -181,16 +456,30 @@ static int slash_unlink(const char *path)
     pthread_mutex_lock(&sharebox.rwlock);
 
     int res;
+    int held;
+    bool hashed;
+    sha256 hash;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
     res = unlink(fpath);
 
-    if (!git_ignored(sharebox.reporoot, fpath)){
+    /* a temporary file that never made it to the history */
+    held = atomicsave_take(path, &hash, &hashed);
+
+    if (res != -1) {
+        metadata_remove(path);
+        hashstate_remove(fpath);
+        overlay_remove(fpath);
+    }
+    if (!held && !git_ignored(sharebox.reporoot, fpath)){
         git_rm(sharebox.reporoot, fpath);
         git_commit(sharebox.reporoot, "removed %s", path + 1);
+        events_record('D', path);
     }
+    if (res != -1 && !held)
+        notify_changed(path);
 
     pthread_mutex_unlock(&sharebox.rwlock);
 
@@ -228,6 +517,7 @@ static int slash_symlink(const char *target, const char *linkname)
     if (!git_ignored(sharebox.reporoot, flinkname)){
         git_add(sharebox.reporoot, flinkname);
         git_commit(sharebox.reporoot, "created symlink %s->%s", linkname + 1, target);
+        events_record('M', linkname);
     }
 
     pthread_mutex_unlock(&sharebox.rwlock);
@@ -245,6 +535,8 @@ static int slash_rename(const char *from, const char *to)
     int res;
     bool from_ignored;
     bool to_ignored;
+    bool hashed;
+    sha256 hash;
 
     char ffrom[FILENAME_MAX];
     char fto[FILENAME_MAX];
@@ -252,17 +544,41 @@ static int slash_rename(const char *from, const char *to)
     fullpath(ffrom, from);
     fullpath(fto, to);
 
+    /* the end of an atomic save: what was written in from is the new
+       content of to, from itself never makes it to the history */
+    if (atomicsave_take(from, &hash, &hashed)) {
+        res = rename(ffrom, fto);
+        if (res != -1) {
+            overlay_remove(fto);
+            metadata_remove(from);
+            metadata_content_changed(to);
+            if (!git_ignored(sharebox.reporoot, fto)){
+                add_content(fto, hashed ? &hash : NULL);
+                git_add(sharebox.reporoot, fto);
+                git_commit(sharebox.reporoot, "saved %s", to+1);
+                events_record('M', to);
+            }
+            notify_changed(to);
+        }
+        pthread_mutex_unlock(&sharebox.rwlock);
+        return res == -1 ? -errno : 0;
+    }
+
     /* proceed to rename */
     from_ignored = git_ignored(sharebox.reporoot, ffrom);
     res = rename(ffrom, fto);
     to_ignored = git_ignored(sharebox.reporoot, fto);
 
     if (res != -1) {
+        metadata_rename(from, to);
+        hashstate_rename(ffrom, fto);
+        overlay_rename(ffrom, fto);
+
         /* moved ignored to ignored (nothing) */
 
         /* moved ignored to non ignored*/
         if (from_ignored && !to_ignored){
-            git_annex_add(sharebox.reporoot, fto);
+            add_content(fto, NULL);
             git_add(sharebox.reporoot, fto); /* this ensures links will be added too */
         }
         /* moved non ignored to ignored */
@@ -275,6 +591,12 @@ static int slash_rename(const char *from, const char *to)
         }
 
         git_commit(sharebox.reporoot, "moved %s to %s", from+1, to+1);
+        if (!from_ignored)
+            events_record('D', from);
+        if (!to_ignored)
+            events_record('M', to);
+        notify_changed(from);
+        notify_changed(to);
     }
 
     pthread_mutex_unlock(&sharebox.rwlock);
@@ -290,16 +612,37 @@ static int slash_chmod(const char *path, mode_t mode)
     pthread_mutex_lock(&sharebox.rwlock);
 
     int res;
+    struct stat st;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
-    git_annex_unlock(sharebox.reporoot, fpath);
+    /* held back files are committed later, the content of annexed
+       files is left alone */
+    if (atomicsave_pending(path)) {
+        res = chmod(fpath, mode);
+    } else if (git_annexed(sharebox.reporoot, fpath)) {
+        annexed_attrs(path, fpath, &st);
+        if (caller_owns(&st)) {
+            /* as the kernel does, the setgid bit is dropped when the
+               caller is not in the group of the file */
+            if (fuse_get_context()->uid != 0
+                    && !caller_in_group(st.st_gid))
+                mode &= ~S_ISGID;
+            metadata_chmod(path, mode);
+            res = 0;
+        } else {
+            errno = EPERM;
+            res = -1;
+        }
+    } else {
+        git_annex_unlock(sharebox.reporoot, fpath);
 
-    res = chmod(fpath, mode);
+        res = chmod(fpath, mode);
 
-    git_annex_add(sharebox.reporoot, fpath);
-    git_commit(sharebox.reporoot, "chmoded %s to %o", path+1, mode);
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "chmoded %s to %o", path+1, mode);
+    }
 
     pthread_mutex_unlock(&sharebox.rwlock);
 
@@ -314,16 +657,36 @@ static int slash_chown(const char *path, uid_t uid, gid_t gid)
     pthread_mutex_lock(&sharebox.rwlock);
 
     int res;
+    bool root;
+    struct stat st;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
-    git_annex_unlock(sharebox.reporoot, fpath);
+    if (atomicsave_pending(path)) {
+        res = lchown(fpath, uid, gid);
+    } else if (git_annexed(sharebox.reporoot, fpath)) {
+        /* only root gives files away, owners may change the group to
+           one they are in */
+        annexed_attrs(path, fpath, &st);
+        root = fuse_get_context()->uid == 0;
+        if ((uid != (uid_t) -1 && uid != st.st_uid && !root)
+                || (gid != (gid_t) -1 && gid != st.st_gid && !root
+                    && (!caller_owns(&st) || !caller_in_group(gid)))) {
+            errno = EPERM;
+            res = -1;
+        } else {
+            metadata_chown(path, uid, gid);
+            res = 0;
+        }
+    } else {
+        git_annex_unlock(sharebox.reporoot, fpath);
 
-    res = lchown(fpath, uid, gid);
+        res = lchown(fpath, uid, gid);
 
-    git_annex_add(sharebox.reporoot, fpath);
-    git_commit(sharebox.reporoot, "chmown on %s", path+1);
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "chmown on %s", path+1);
+    }
 
     pthread_mutex_unlock(&sharebox.rwlock);
 
@@ -338,16 +701,39 @@ static int slash_truncate(const char *path, off_t size)
     pthread_mutex_lock(&sharebox.rwlock);
 
     int res;
+    overlay *ov;
+    store *held;
+    char object[FILENAME_MAX];
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
-    git_annex_unlock(sharebox.reporoot, fpath);
+    /* an overlay is committed once compacted */
+    invalidate_hashes(fpath, NULL);
+    if (atomicsave_pending(path)) {
+        res = truncate(fpath, size);
+    } else if ((ov = overlay_find(fpath)) != NULL) {
+        res = overlay_truncate(ov, size);
+    } else if (size == 0 && git_annexed(sharebox.reporoot, fpath)) {
+        /* no need to copy what is thrown away */
+        res = git_annex_unlock_empty(sharebox.reporoot, fpath);
+        metadata_content_changed(path);
+
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "truncated on %s", path+1);
+    } else {
+        object[0] = '\0';
+        if ((held = store_holder(fpath)) != NULL)
+            store_restore(held, fpath, object);
+        git_annex_unlock(sharebox.reporoot, fpath);
+        if (object[0])
+            store_absorb_object(object);
 
-    res = truncate(fpath, size);
+        res = truncate(fpath, size);
 
-    git_annex_add(sharebox.reporoot, fpath);
-    git_commit(sharebox.reporoot, "truncated on %s", path+1);
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "truncated on %s", path+1);
+    }
 
     pthread_mutex_unlock(&sharebox.rwlock);
 
@@ -362,22 +748,39 @@ static int slash_utimens(const char *path, const struct timespec ts[2])
     pthread_mutex_lock(&sharebox.rwlock);
 
     int res;
-    struct timeval tv[2];
+    bool now;
+    struct stat st;
     char fpath[FILENAME_MAX];
 
-    tv[0].tv_sec = ts[0].tv_sec;
-    tv[0].tv_usec = ts[0].tv_nsec / 1000;
-    tv[1].tv_sec = ts[1].tv_sec;
-    tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
     fullpath(fpath, path);
 
-    git_annex_unlock(sharebox.reporoot, fpath);
+    /* utimensat() understands UTIME_NOW and UTIME_OMIT, utimes() does
+       not */
+    if (atomicsave_pending(path)) {
+        res = utimensat(AT_FDCWD, fpath, ts, AT_SYMLINK_NOFOLLOW);
+    } else if (git_annexed(sharebox.reporoot, fpath)) {
+        /* setting the times to now only takes write permission, setting
+           them to anything else takes the owner */
+        annexed_attrs(path, fpath, &st);
+        now = ((ts[0].tv_nsec == UTIME_NOW
+                    || ts[0].tv_nsec == UTIME_OMIT)
+                && (ts[1].tv_nsec == UTIME_NOW
+                    || ts[1].tv_nsec == UTIME_OMIT));
+        if (caller_owns(&st) || (now && writable(&st))) {
+            metadata_utimens(path, ts);
+            res = 0;
+        } else {
+            errno = now ? EACCES : EPERM;
+            res = -1;
+        }
+    } else {
+        git_annex_unlock(sharebox.reporoot, fpath);
 
-    res = utimes(fpath, tv);
+        res = utimensat(AT_FDCWD, fpath, ts, AT_SYMLINK_NOFOLLOW);
 
-    git_annex_add(sharebox.reporoot, fpath);
-    git_commit(sharebox.reporoot, "utimens on %s", path+1);
+        add_content(fpath, NULL);
+        git_commit(sharebox.reporoot, "utimens on %s", path+1);
+    }
 
     pthread_mutex_unlock(&sharebox.rwlock);
 
@@ -387,30 +790,138 @@ static int slash_utimens(const char *path, const struct timespec ts[2])
     return 0;
 }
 
+/* opens for reading a file whose content is held by a store */
+static int open_held(const char *fpath, store *held,
+        struct fuse_file_info *fi)
+{
+    handle *h;
+
+    h = malloc(sizeof(handle));
+    strcpy(h->fpath, fpath);
+    if (git_annex_key(fpath, h->key) == -1) {
+        free(h);
+        return -EACCES;
+    }
+    h->fd = -1;
+    h->st = held;
+    h->restored[0] = '\0';
+    h->ov = NULL;
+    sha256_init(&h->hash);
+    h->hashing = false;
+    h->written = false;
+    h->writer = false;
+    fi->keep_cache = readahead_keep_cache(fpath, h->key);
+    fi->fh = (uint64_t) (uintptr_t) h;
+
+    pthread_mutex_lock(&sharebox.rwlock);
+    h->next = handles;
+    handles = h;
+    pthread_mutex_unlock(&sharebox.rwlock);
+
+    return 0;
+}
+
 static int slash_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
+    int fd;
     int flags;
+    handle *h;
+    overlay *ov;
+    store *held;
+    struct stat st;
+    char key[FILENAME_MAX], restored[FILENAME_MAX];
+    bool pending, haskey;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
+    replicate_touch(fpath);
 
     flags=fi->flags;
+    ov = NULL;
+    held = NULL;
+    haskey = false;
+    restored[0] = '\0';
+
+    /* rewritten from scratch: neither fetch nor copy the old content */
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        pthread_mutex_lock(&sharebox.rwlock);
+        invalidate_hashes(fpath, NULL);
+        if ((ov = overlay_find(fpath)) != NULL)
+            overlay_truncate(ov, 0);
+        else if (git_annexed(sharebox.reporoot, fpath))
+            git_annex_unlock_empty(sharebox.reporoot, fpath);
+        metadata_content_changed(path);
+        pthread_mutex_unlock(&sharebox.rwlock);
+        ov = NULL;
+    }
 
-    if (git_annexed(sharebox.reporoot, fpath))
-        /* Get the file on the fly, remove W_OK if it was requested */
-        if (!ondisk(fpath))
-            git_annex_get(sharebox.reporoot, fpath, NULL);
-        if (!ondisk(fpath))
+    if (git_annexed(sharebox.reporoot, fpath)) {
+        /* Get the file on the fly, open the object read only: writing
+           will unlock it first, or go to an overlay for large files */
+        prefetch_open(fpath);
+        if (!ondisk(fpath) && (held = store_holder(fpath)) != NULL
+                && (flags & O_ACCMODE) != O_RDONLY) {
+            /* writes go to the loose object */
+            store_restore(held, fpath, restored);
+            held = NULL;
+        }
+        if (held)
+            return open_held(fpath, held, fi);
+        if (!ondisk(fpath)) {
+            if (stripe_get(sharebox.reporoot, fpath) == -1
+                    && locations_get(fpath) == -1)
+                git_annex_get(sharebox.reporoot, fpath, NULL);
+            inventory_update_link(fpath);
+        }
+        if (stat(fpath, &st) == -1)
             return -EACCES;
-        flags &= ~W_OK;
-
-    res = open(fpath, flags);
+        /* with a pending overlay, the content is no longer the key's */
+        pending = overlay_find(fpath) != NULL;
+        haskey = !pending && git_annex_key(fpath, key) == 0;
+        if (pending || ((flags & O_ACCMODE) != O_RDONLY
+                    && sharebox.overlay_min > 0
+                    && st.st_size >= sharebox.overlay_min))
+            ov = overlay_open(sharebox.reporoot, fpath);
+        /* the object is shared by every version: never truncate it,
+           a truncation was given to the overlay above */
+        flags = (flags & ~(O_ACCMODE | O_TRUNC | O_CREAT | O_EXCL))
+            | O_RDONLY;
+        if (!ov && haskey)
+            fi->keep_cache = readahead_keep_cache(fpath, key);
+    }
 
-    if (res == 1)
+    if ((fd = open(fpath, flags)) == -1) {
+        if (ov)
+            overlay_release(ov, sharebox.reporoot);
         return -errno;
+    }
+
+    h = malloc(sizeof(handle));
+    strcpy(h->fpath, fpath);
+    h->fd = fd;
+    h->st = NULL;
+    strcpy(h->restored, restored);
+    h->ov = ov;
+    readahead_init(&h->ra, fd);
+    /* a file written from scratch can be hashed on the fly, and so can
+       be a file appended to if we saved the state at the end of its key */
+    sha256_init(&h->hash);
+    h->hashing = false;
+    h->written = false;
+    h->writer = (fi->flags & O_ACCMODE) != O_RDONLY;
+    if (h->writer && fstat(fd, &st) != -1) {
+        if (st.st_size == 0)
+            h->hashing = !ov;
+        else if (haskey && hashstate_load(key, &h->hash) == 0)
+            h->hashing = h->hash.count == (uint64_t) st.st_size;
+    }
+    fi->fh = (uint64_t) (uintptr_t) h;
 
-    close(res);
+    pthread_mutex_lock(&sharebox.rwlock);
+    h->written = created_take(fpath);
+    h->next = handles;
+    handles = h;
+    pthread_mutex_unlock(&sharebox.rwlock);
 
     return 0;
 }
@@ -418,22 +929,24 @@ static int slash_open(const char *path, struct fuse_file_info *fi)
 static int slash_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
+    long start = qos_begin();
     pthread_mutex_lock(&sharebox.rwlock);
 
-    int fd;
     int res;
-    (void) fi;
-
-    char fpath[FILENAME_MAX];
-    fullpath(fpath, path);
+    handle *h = (handle *) (uintptr_t) fi->fh;
+    (void) path;
 
-    if ((fd = open(fpath, O_RDONLY)) != -1)
-        if ((res = pread(fd, buf, size, offset)) != -1)
-            close(fd);
+    if (h->st)
+        res = h->st->read(h->key, buf, size, offset);
+    else if (h->ov)
+        res = overlay_read(h->ov, buf, size, offset);
+    else if ((res = pread(h->fd, buf, size, offset)) != -1)
+        readahead_update(&h->ra, h->fd, offset, res);
 
     pthread_mutex_unlock(&sharebox.rwlock);
+    qos_end(start);
 
-    if (fd == -1 || res == -1)
+    if (res == -1)
         return -errno;
     return res;
 }
@@ -441,25 +954,46 @@ static int slash_read(const char *path, char *buf, size_t size, off_t offset,
 static int slash_write(const char *path, const char *buf, size_t size,
              off_t offset, struct fuse_file_info *fi)
 {
+    long start = qos_begin();
     pthread_mutex_lock(&sharebox.rwlock);
 
     int fd;
     int res;
-    (void) fi;
+    handle *h = (handle *) (uintptr_t) fi->fh;
 
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
-    if (git_annexed(sharebox.reporoot, fpath))
-        git_annex_unlock(sharebox.reporoot, fpath);
+    if (h->ov) {
+        res = overlay_write(h->ov, buf, size, offset);
+    } else {
+        /* the handle points to the locked object: replace it with the
+           unlocked copy */
+        if (git_annexed(sharebox.reporoot, fpath)) {
+            git_annex_unlock(sharebox.reporoot, fpath);
+            if ((fd = open(fpath, O_RDWR)) != -1) {
+                close(h->fd);
+                h->fd = fd;
+                readahead_init(&h->ra, fd);
+            }
+        }
+
+        res = pwrite(h->fd, buf, size, offset);
+    }
 
-    if ((fd = open(fpath, O_WRONLY)) != -1)
-        if((res = pwrite(fd, buf, size, offset)) != -1)
-            close(fd);
+    if (res != -1) {
+        h->written = true;
+        invalidate_hashes(fpath, h);
+        if (h->hashing && (uint64_t) offset == h->hash.count)
+            sha256_update(&h->hash, buf, res);
+        else
+            h->hashing = false;
+    }
 
     pthread_mutex_unlock(&sharebox.rwlock);
+    qos_end(start);
 
-    if (fd == -1 || res == -1)
+    if (res == -1)
         return -errno;
     return res;
 }
@@ -468,14 +1002,34 @@ static int slash_release(const char *path, struct fuse_file_info *fi)
 {
     pthread_mutex_lock(&sharebox.rwlock);
 
+    handle *h = (handle *) (uintptr_t) fi->fh;
+    handle **p;
+
     char fpath[FILENAME_MAX];
     fullpath(fpath, path);
 
-    if (!git_ignored(sharebox.reporoot, fpath)){
-        git_annex_add(sharebox.reporoot, fpath);
-        git_commit(sharebox.reporoot, "released %s", path+1);
+    if (h->fd != -1)
+        close(h->fd);
+    if (h->ov)
+        overlay_release(h->ov, sharebox.reporoot);
+    for (p = &handles; *p != h; p = &(*p)->next)
+        ;
+    *p = h->next;
+
+    if (h->written)
+        metadata_content_changed(path);
+    if (!atomicsave_defer(path, h->hashing ? &h->hash : NULL, h->written)) {
+        commit_released(path, h->hashing ? &h->hash : NULL, h->written);
+        if (h->written)
+            notify_changed(path);
     }
 
+    /* the old content went back to its loose object for this handle */
+    if (h->restored[0] && !opened(fpath))
+        store_absorb_object(h->restored);
+
+    free(h);
+
     pthread_mutex_unlock(&sharebox.rwlock);
 
     return 0;
@@ -495,6 +1049,65 @@ static int slash_statfs(const char *path, struct statvfs *stbuf)
     return 0;
 }
 
+static void *slash_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+    prefetch_init(sharebox.reporoot, sharebox.prefetch_depth,
+            sharebox.prefetch_budget);
+    hashstate_init(sharebox.reporoot);
+    metadata_init(sharebox.reporoot);
+    atomicsave_init(commit_held_back);
+    overlay_init(sharebox.reporoot, commit_compacted);
+    store_init(sharebox.reporoot);
+    inventory_init(sharebox.reporoot);
+    locations_init(sharebox.reporoot);
+    replicate_init(sharebox.reporoot, sharebox.deep_replicate);
+    notify_init(sharebox.write_callback, sharebox.write_callback_delay);
+    events_init();
+    git_batch_start(sharebox.reporoot, &sharebox.rwlock, events_publish);
+    return NULL;
+}
+
+static void slash_destroy(void *data)
+{
+    created *c, *next;
+    (void) data;
+    overlay_destroy();
+    events_destroy();
+    replicate_destroy();
+    prefetch_destroy();
+    atomicsave_destroy();
+    locations_destroy();
+    notify_destroy();
+    inventory_destroy();
+    store_destroy();
+    hashstate_destroy();
+    metadata_destroy();
+    git_batch_stop();
+    for (c = creations; c != NULL; c = next) {
+        next = c->next;
+        free(c->fpath);
+        free(c);
+    }
+    creations = NULL;
+}
+
+/*
+ * Whether fpath has changes the filesystem did not commit yet: an overlay,
+ * or a handle open for writing (called with sharebox.rwlock held).
+ */
+bool slash_uncommitted(const char *fpath)
+{
+    handle *h;
+
+    if (overlay_find(fpath) != NULL)
+        return true;
+    for (h = handles; h != NULL; h = h->next)
+        if (h->writer && strcmp(h->fpath, fpath) == 0)
+            return true;
+    return false;
+}
+
 void init_slash(dir *d)
 {
     strcpy(d->name, "/");
@@ -517,4 +1130,6 @@ void init_slash(dir *d)
     (d->operations).write      = slash_write;
     (d->operations).release    = slash_release;
     (d->operations).statfs     = slash_statfs;
+    (d->operations).init       = slash_init;
+    (d->operations).destroy    = slash_destroy;
 }
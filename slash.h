@@ -1,3 +1,4 @@
 #include "common.h"
 
 void init_slash(dir *);
+bool slash_uncommitted(const char *fpath);
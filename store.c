@@ -0,0 +1,206 @@
+/*
+ * Alternative stores of annexed content
+ *
+ * Once a file is annexed, its loose object can be handed over to one of
+ * the stores enabled at mount time, which keeps the content in a form of
+ * its own. The link then dangles as far as the filesystem is concerned,
+ * and opens read the content through the store that holds it. Writing to
+ * such a file first writes the content back to its loose object.
+ *
+ * Stores are tried in order, the first that accepts an object keeps it.
+ *
+ * git-annex cannot serve content it has no loose object for: when a store
+ * takes an object, the location log says this repository lost it, so that
+ * peers get it from elsewhere, and it gets it back when the loose object
+ * is restored. Objects are only taken when the location log records a copy
+ * elsewhere, so that it never tells that the content is nowhere.
+ */
+
+#include "store.h"
+#include "git-annex.h"
+#include "pack.h"
+#include "chunks.h"
+#include "compress.h"
+#include "inventory.h"
+#include "locations.h"
+
+#include <sys/stat.h>
+#include <libgen.h>
+
+static storelist *stores;
+static char uuid[64];       /* of this repository, "" if unknown */
+
+static void add_store(store *s)
+{
+    storelist *l, **p;
+    if (s == NULL)
+        return;
+    for (p = &stores; *p != NULL; p = &(*p)->next)
+        ;
+    l = malloc(sizeof(storelist));
+    l->store = s;
+    l->next = NULL;
+    *p = l;
+}
+
+/* where the loose object of the link fpath is, present or not */
+static int objectpath(const char *fpath, char object[FILENAME_MAX])
+{
+    char target[FILENAME_MAX], dir[FILENAME_MAX];
+    ssize_t n;
+
+    if ((n = readlink(fpath, target, FILENAME_MAX - 1)) == -1)
+        return -1;
+    target[n] = '\0';
+    if (target[0] == '/') {
+        strcpy(object, target);
+        return 0;
+    }
+    strcpy(dir, fpath);
+    if (snprintf(object, FILENAME_MAX, "%s/%s", dirname(dir), target)
+            >= FILENAME_MAX)
+        return -1;
+    return 0;
+}
+
+/*
+ * git-annex write protects the directory of each object: lifts that
+ * protection while f runs on the object.
+ */
+static int in_object_dir(const char *object, int (*f)(const char *, void *),
+        void *arg)
+{
+    char dir[FILENAME_MAX];
+    struct stat st;
+    int res;
+
+    strcpy(dir, object);
+    dirname(dir);
+    if (stat(dir, &st) == -1)
+        return -1;
+    chmod(dir, st.st_mode | S_IWUSR);
+    res = f(object, arg);
+    chmod(dir, st.st_mode);
+    return res;
+}
+
+static int drop_object(const char *object, void *arg)
+{
+    (void) arg;
+    return unlink(object);
+}
+
+static int get_object(const char *object, void *arg)
+{
+    store *s = arg;
+    /* objects are named after their key */
+    return s->get(strrchr(object, '/') + 1, object);
+}
+
+/*
+ * Interface
+ */
+
+void store_init(const char *repodir)
+{
+    if (git_annex_uuid(repodir, uuid) == -1)
+        uuid[0] = '\0';
+    add_store(pack_store(repodir, sharebox.pack_max));
+    add_store(chunks_store(repodir, sharebox.chunk_min));
+    add_store(compress_store(repodir, sharebox.compress));
+}
+
+void store_destroy(void)
+{
+    storelist *l, *next;
+    for (l = stores; l != NULL; l = next) {
+        next = l->next;
+        l->store->destroy();
+        free(l);
+    }
+    stores = NULL;
+}
+
+/*
+ * Hands the loose object over to the first store that takes it. Returns
+ * -1 if none did, or if no other repository is known to have the key.
+ */
+int store_absorb_object(const char *object)
+{
+    const char *key;
+    struct stat st;
+    storelist *l;
+
+    key = strrchr(object, '/') + 1;
+    if (stores == NULL || stat(object, &st) == -1
+            || locations_copies(key) == 0)
+        return -1;
+    for (l = stores; l != NULL; l = l->next) {
+        if (l->store->put(key, object, st.st_size) == 0) {
+            in_object_dir(object, drop_object, NULL);
+            inventory_update(object);
+            if (uuid[0])
+                git_annex_setpresentkey(sharebox.reporoot, key, uuid, 0);
+            printf("%s kept in the %s store\n", key, l->store->name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Same as store_absorb_object, for the object of the annexed file fpath.
+ */
+int store_absorb(const char *fpath)
+{
+    char object[FILENAME_MAX];
+
+    if (stores == NULL || !git_annexed(sharebox.reporoot, fpath)
+            || objectpath(fpath, object) == -1)
+        return -1;
+    return store_absorb_object(object);
+}
+
+/* whether a store holds the content of key */
+int store_has_key(const char *key)
+{
+    storelist *l;
+    for (l = stores; l != NULL; l = l->next)
+        if (l->store->has(key))
+            return 1;
+    return 0;
+}
+
+/*
+ * Returns the store holding the content of the annexed file fpath, or
+ * NULL if it is loose or absent.
+ */
+store *store_holder(const char *fpath)
+{
+    char key[FILENAME_MAX];
+    storelist *l;
+
+    if (stores == NULL || git_annex_key(fpath, key) == -1)
+        return NULL;
+    for (l = stores; l != NULL; l = l->next)
+        if (l->store->has(key))
+            return l->store;
+    return NULL;
+}
+
+/*
+ * Writes the content of fpath held by s back to its loose object, whose
+ * path is given in object. Once the loose object is no longer needed,
+ * store_absorb_object() takes it back.
+ */
+int store_restore(store *s, const char *fpath, char object[FILENAME_MAX])
+{
+    if (objectpath(fpath, object) == -1
+            || in_object_dir(object, get_object, s) == -1)
+        return -1;
+    inventory_update(object);
+    if (uuid[0])
+        git_annex_setpresentkey(sharebox.reporoot, strrchr(object, '/') + 1,
+                uuid, 1);
+    return 0;
+}
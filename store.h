@@ -0,0 +1,42 @@
+/*
+ * store.h
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include "common.h"
+
+/*
+ * A place annexed content can be kept in, instead of its loose object
+ * under .git/annex/objects.
+ */
+typedef struct store store;
+struct store
+{
+    const char *name;
+    /* copies the loose object of key in, returns -1 if not wanted */
+    int (*put)(const char *key, const char *object, off_t size);
+    int (*has)(const char *key);
+    ssize_t (*read)(const char *key, char *buf, size_t size, off_t offset);
+    /* writes the content of key to the new file object, and forgets it */
+    int (*get)(const char *key, const char *object);
+    void (*destroy)(void);
+};
+
+typedef struct storelist storelist;
+struct storelist
+{
+    store *store;
+    storelist *next;
+};
+
+void store_init(const char *repodir);
+void store_destroy(void);
+int store_absorb_object(const char *object);
+int store_absorb(const char *fpath);
+int store_has_key(const char *key);
+store *store_holder(const char *fpath);
+int store_restore(store *s, const char *fpath, char object[FILENAME_MAX]);
+
+#endif /* __STORE_H__ */
@@ -0,0 +1,386 @@
+/*
+ * Striped download of large objects from several peers
+ *
+ * git annex get pulls an object from a single remote. When a large object
+ * is opened and more than one peer that is reachable as a local path
+ * (same machine, or a mounted share) holds it, the object is split into
+ * blocks of STRIPE_BLOCK bytes and each of those peers copies blocks into
+ * the partial file in .git/annex/tmp, taking the next one as soon as it
+ * is done with its own: faster peers end up with more blocks. Once no
+ * block is left to start, an idle peer duplicates a block that has been
+ * running for STRIPE_SLOW times the average block time, and the first
+ * copy to complete wins.
+ *
+ * Completed blocks are synced then marked in a map kept next to the
+ * partial file, so that an interrupted download resumes from where it
+ * stopped. The object only replaces the partial file once its hash
+ * matches its key: keys of other backends than SHA256 are left to git
+ * annex get, which knows how to check them.
+ */
+
+#include "stripe.h"
+#include "peers.h"
+#include "sha256.h"
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <libgen.h>
+#include <time.h>
+
+#define STRIPE_MIN     (64 << 20)   /* objects below are fetched whole */
+#define STRIPE_BLOCK   (8 << 20)
+#define STRIPE_IO      (1 << 20)    /* copied between checks for a winner */
+#define STRIPE_SOURCES 8
+#define STRIPE_SLOW    3
+
+enum { TODO, BUSY, DONE };
+
+typedef struct stripe stripe;
+struct stripe
+{
+    int fd;                     /* the partial file */
+    int mapfd;                  /* one byte per block, '1' once it is done */
+    off_t size;
+    uint32_t nblocks, left;
+    unsigned char *state;
+    unsigned char *owners;
+    struct timespec *started;
+    double seconds;             /* spent on the completed blocks */
+    unsigned long completed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+typedef struct source source;
+struct source
+{
+    char path[FILENAME_MAX];
+    int fd;
+    stripe *s;
+    unsigned long blocks;
+    off_t bytes;
+};
+
+static double elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* where the object of the link fpath goes, and its path in any annex */
+static int object_paths(const char *fpath, char object[FILENAME_MAX],
+        const char **relative)
+{
+    char target[FILENAME_MAX], dir[FILENAME_MAX];
+    ssize_t n;
+
+    if ((n = readlink(fpath, target, FILENAME_MAX - 1)) == -1)
+        return -1;
+    target[n] = '\0';
+    strcpy(dir, fpath);
+    if (target[0] == '/')
+        strcpy(object, target);
+    else if (snprintf(object, FILENAME_MAX, "%s/%s", dirname(dir), target)
+            >= FILENAME_MAX)
+        return -1;
+    if ((*relative = strstr(object, ".git/annex/objects/")) == NULL)
+        return -1;
+    *relative += strlen(".git/annex/objects/");
+    return 0;
+}
+
+/*
+ * Picks a block for a source to copy (called with s->lock held): the next
+ * one nobody started, or else a straggler. Returns -1 when there is
+ * nothing left to do.
+ */
+static int64_t pick(stripe *s)
+{
+    double average, slowest, t;
+    int64_t i, straggler;
+    struct timespec timeout;
+
+    for (;;) {
+        if (s->left == 0)
+            return -1;
+        for (i = 0; i < s->nblocks; i++)
+            if (s->state[i] == TODO)
+                return i;
+        straggler = -1;
+        if (s->completed > 0) {
+            average = s->seconds / s->completed;
+            slowest = STRIPE_SLOW * average;
+            for (i = 0; i < s->nblocks; i++) {
+                if (s->state[i] != BUSY || s->owners[i] > 1)
+                    continue;
+                if ((t = elapsed(&s->started[i])) > slowest) {
+                    slowest = t;
+                    straggler = i;
+                }
+            }
+        }
+        if (straggler != -1)
+            return straggler;
+        /* blocks become stragglers with time alone */
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 100 * 1000 * 1000;
+        if (timeout.tv_nsec >= 1000 * 1000 * 1000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&s->changed, &s->lock, &timeout);
+    }
+}
+
+static void *copy_blocks(void *arg)
+{
+    source *src = arg;
+    stripe *s = src->s;
+    char *buf;
+    int64_t i;
+    off_t off, end;
+    ssize_t n;
+    bool lost;
+
+    buf = malloc(STRIPE_IO);
+    pthread_mutex_lock(&s->lock);
+    while ((i = pick(s)) != -1) {
+        if (s->owners[i]++ == 0) {
+            s->state[i] = BUSY;
+            clock_gettime(CLOCK_MONOTONIC, &s->started[i]);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        off = i * (off_t) STRIPE_BLOCK;
+        end = off + STRIPE_BLOCK < s->size ? off + STRIPE_BLOCK : s->size;
+        lost = false;
+        n = 0;
+        while (off < end && !lost) {
+            n = pread(src->fd, buf,
+                    end - off < STRIPE_IO ? end - off : STRIPE_IO, off);
+            if (n <= 0 || pwrite(s->fd, buf, n, off) != n) {
+                n = -1;
+                break;
+            }
+            off += n;
+            src->bytes += n;
+            pthread_mutex_lock(&s->lock);
+            lost = s->state[i] == DONE;
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (n != -1 && !lost)
+            fdatasync(s->fd);
+
+        pthread_mutex_lock(&s->lock);
+        s->owners[i]--;
+        if (n == -1) {
+            /* this peer is of no more use, its block goes back */
+            if (s->owners[i] == 0 && s->state[i] != DONE)
+                s->state[i] = TODO;
+            pthread_cond_broadcast(&s->changed);
+            break;
+        }
+        if (s->state[i] != DONE) {
+            s->state[i] = DONE;
+            pwrite(s->mapfd, "1", 1, i);
+            s->left--;
+            s->completed++;
+            s->seconds += elapsed(&s->started[i]);
+            src->blocks++;
+        }
+        pthread_cond_broadcast(&s->changed);
+    }
+    pthread_mutex_unlock(&s->lock);
+    free(buf);
+    return NULL;
+}
+
+/* the sha256 in hex of the content of key, NULL for other backends */
+static const char *key_hash(const char *key)
+{
+    const char *p;
+
+    if (strncmp(key, "SHA256-", strlen("SHA256-")) != 0
+            && strncmp(key, "SHA256E-", strlen("SHA256E-")) != 0)
+        return NULL;
+    if ((p = strstr(key, "--")) == NULL || strspn(p + 2,
+                "0123456789abcdef") < 64)
+        return NULL;
+    return p + 2;
+}
+
+/* whether the partial file is the content of key */
+static int verify(int fd, const char *key, off_t size)
+{
+    char hex[65], *buf;
+    const char *p;
+    sha256 h;
+    off_t off;
+    ssize_t n;
+
+    if ((p = key_hash(key)) == NULL)
+        return -1;
+    buf = malloc(STRIPE_IO);
+    sha256_init(&h);
+    for (off = 0; off < size; off += n) {
+        if ((n = pread(fd, buf, STRIPE_IO, off)) <= 0)
+            break;
+        sha256_update(&h, buf, n);
+    }
+    free(buf);
+    sha256_hex(&h, hex);
+    return off == size && strncmp(p, hex, 64) == 0 ? 0 : -1;
+}
+
+/* records that we have key now */
+static void set_present(const char *repodir, const char *key)
+{
+    char uuid[64], list[FILENAME_MAX];
+    FILE *f;
+    int fd;
+
+    if (git_annex_uuid(repodir, uuid) == -1)
+        return;
+    snprintf(list, FILENAME_MAX, "%s/.git/annex/tmp/present.XXXXXX", repodir);
+    if ((fd = mkstemp(list)) == -1 || (f = fdopen(fd, "w")) == NULL)
+        return;
+    fprintf(f, "%s %s 1\n", key, uuid);
+    fclose(f);
+    pthread_mutex_lock(&sharebox.rwlock);
+    git_annex_setpresentkeys(repodir, list);
+    pthread_mutex_unlock(&sharebox.rwlock);
+    unlink(list);
+}
+
+/*
+ * Fetches the object of the annexed file fpath from all the local peers
+ * that have it. Returns -1 if it did not (too small, less than two
+ * peers, or failed), leaving it to git annex get.
+ */
+int stripe_get(const char *repodir, const char *fpath)
+{
+    char object[FILENAME_MAX], partial[FILENAME_MAX];
+    char map[FILENAME_MAX + 8], key[FILENAME_MAX], *done, *p;
+    const char *relative;
+    source sources[STRIPE_SOURCES];
+    pthread_t threads[STRIPE_SOURCES];
+    namelist *repos, *r;
+    struct stat st;
+    struct timespec start;
+    double seconds;
+    stripe s;
+    int n, i, res;
+
+    if (git_annex_key(fpath, key) == -1 || key_hash(key) == NULL
+            || git_annex_keysize(key) < STRIPE_MIN
+            || object_paths(fpath, object, &relative) == -1)
+        return -1;
+
+    repos = peer_repos();
+    n = 0;
+    for (r = repos; r != NULL && n < STRIPE_SOURCES; r = r->next) {
+        if (snprintf(sources[n].path, FILENAME_MAX,
+                    "%s/.git/annex/objects/%s", r->name, relative)
+                < FILENAME_MAX
+                && (sources[n].fd = open(sources[n].path, O_RDONLY)) != -1)
+            n++;
+    }
+    free_namelist(repos);
+    if (n < 2) {
+        while (n-- > 0)
+            close(sources[n].fd);
+        return -1;
+    }
+
+    memset(&s, 0, sizeof(stripe));
+    s.size = git_annex_keysize(key);
+    s.nblocks = (s.size + STRIPE_BLOCK - 1) / STRIPE_BLOCK;
+    res = -1;
+    s.fd = -1;
+    s.mapfd = -1;
+    /* not git annex's own partial file, which it expects to be a prefix */
+    if (snprintf(partial, FILENAME_MAX, "%s/.git/annex/tmp/%s.stripe",
+                repodir, key) >= FILENAME_MAX)
+        goto out;
+    snprintf(map, sizeof map, "%s.map", partial);
+    if ((s.mapfd = open(map, O_RDWR | O_CREAT, 0644)) == -1)
+        goto out;
+    /* a concurrent open of the same file waits, then finds the object */
+    flock(s.mapfd, LOCK_EX);
+    if (stat(object, &st) == 0) {
+        res = 0;
+        goto out;
+    }
+    if ((s.fd = open(partial, O_RDWR | O_CREAT, 0644)) == -1
+            || ftruncate(s.fd, s.size) == -1)
+        goto out;
+
+    /* resume: the blocks of the map are known to be on disk */
+    done = calloc(s.nblocks, 1);
+    if (pread(s.mapfd, done, s.nblocks, 0) == -1)
+        memset(done, 0, s.nblocks);
+    s.state = calloc(s.nblocks, 1);
+    s.owners = calloc(s.nblocks, 1);
+    s.started = calloc(s.nblocks, sizeof(struct timespec));
+    for (i = 0; i < (int) s.nblocks; i++) {
+        s.state[i] = done[i] == '1' ? DONE : TODO;
+        if (s.state[i] == TODO)
+            s.left++;
+    }
+    free(done);
+    printf("%s: %u of %u blocks from %d peers\n", key, s.left, s.nblocks, n);
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        sources[i].s = &s;
+        sources[i].blocks = 0;
+        sources[i].bytes = 0;
+        pthread_create(&threads[i], NULL, copy_blocks, &sources[i]);
+    }
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    seconds = elapsed(&start);
+    for (i = 0; i < n; i++)
+        printf("  %s: %lu blocks, %.1f MB/s\n", sources[i].path,
+                sources[i].blocks, seconds > 0
+                ? sources[i].bytes / seconds / 1e6 : 0);
+    free(s.state);
+    free(s.owners);
+    free(s.started);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.changed);
+
+    /* every peer failed: keep what we have for the next attempt */
+    if (s.left > 0)
+        goto out;
+    if (verify(s.fd, key, s.size) == -1) {
+        fprintf(stderr, "%s: hash mismatch, discarding\n", key);
+        unlink(partial);
+        unlink(map);
+        goto out;
+    }
+    /* the hash directories and the directory of the key */
+    for (p = strstr(object, ".git/annex/"); (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        mkdir(object, 0755);
+        *p = '/';
+    }
+    fchmod(s.fd, 0444);
+    if (rename(partial, object) == 0) {
+        unlink(map);
+        set_present(repodir, key);
+        res = 0;
+    }
+
+out:
+    if (s.fd != -1)
+        close(s.fd);
+    if (s.mapfd != -1)
+        close(s.mapfd);
+    for (i = 0; i < n; i++)
+        close(sources[i].fd);
+    return res;
+}
@@ -0,0 +1,7 @@
+/*
+ * stripe.h
+ */
+
+#include "common.h"
+
+int stripe_get(const char *repodir, const char *fpath);
@@ -0,0 +1,521 @@
+/*
+ * Transfers of annexed content from peers
+ *
+ * A sync brings in links to content we do not have, and each of them used
+ * to wait for its own git annex get. With -o sync_content the keys a sync
+ * introduces are handed instead to a pool of transfer workers:
+ *
+ * - the smallest keys go first, so that most files are usable early;
+ * - a peer gets at most peer_transfers workers at a time, so that one
+ *   slow peer does not hold all of them;
+ * - from peers that are local repositories, objects are copied directly
+ *   (reflinked when the filesystem allows it) and their presence recorded
+ *   in a single setpresentkey run once the whole batch is in. Other peers
+ *   go through git annex get.
+ *
+ * Each batch reports its throughput when its last key has landed. What
+ * is queued are the keys the links changed by the sync point to; for a
+ * local peer, comparing inventories (see inventory.c) narrows them down to
+ * those it holds and we do not, without asking git-annex where each one
+ * lives.
+ */
+
+#include "transfer.h"
+#include "git-annex.h"
+#include "clone.h"
+#include "inventory.h"
+#include "locations.h"
+#include "qos.h"
+#include "store.h"
+
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+
+typedef struct job job;
+struct job
+{
+    char key[FILENAME_MAX];
+    char object[FILENAME_MAX];  /* relative to .git/annex/objects */
+    off_t size;                 /* -1 when the key does not tell */
+};
+
+/* the keys of a sync, sorted, to pick from an inventory difference */
+typedef struct wanted wanted;
+struct wanted
+{
+    struct batch *b;
+    char **keys;
+    size_t n;
+};
+
+typedef struct batch batch;
+struct batch
+{
+    char peer[NAME_MAX + 1];
+    char repo[FILENAME_MAX];    /* path of the peer when it is local */
+    bool local;
+    job **heap;                 /* queued jobs, smallest first */
+    size_t n;
+    size_t running;
+    unsigned long done, failed;
+    off_t bytes;
+    FILE *present;              /* "key uuid 1" lines of what was copied */
+    struct timespec start;
+    batch *next;
+};
+
+static struct {
+    const char *repodir;
+    int nworkers;
+    int per_peer;
+    batch *batches;
+    struct peercount {
+        char name[NAME_MAX + 1];
+        int running;
+    } *peers;                   /* one more than there are workers */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t *workers;
+    bool stop;
+    unsigned long long bytes;
+    unsigned long done, failed;
+    double seconds;
+} tr;
+
+/*
+ * Helpers (called with tr.lock held)
+ */
+
+/* keys of unknown size go last */
+static off_t order(const job *j)
+{
+    return j->size < 0 ? LLONG_MAX : j->size;
+}
+
+static void heap_push(batch *b, job *j)
+{
+    size_t i, parent;
+    job *tmp;
+
+    b->heap = realloc(b->heap, (b->n + 1) * sizeof(job *));
+    b->heap[b->n] = j;
+    for (i = b->n++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (order(b->heap[parent]) <= order(b->heap[i]))
+            break;
+        tmp = b->heap[parent];
+        b->heap[parent] = b->heap[i];
+        b->heap[i] = tmp;
+    }
+}
+
+static job *heap_pop(batch *b)
+{
+    size_t i, child;
+    job *top, *tmp;
+
+    top = b->heap[0];
+    b->heap[0] = b->heap[--b->n];
+    for (i = 0; (child = 2 * i + 1) < b->n; i = child) {
+        if (child + 1 < b->n
+                && order(b->heap[child + 1]) < order(b->heap[child]))
+            child++;
+        if (order(b->heap[i]) <= order(b->heap[child]))
+            break;
+        tmp = b->heap[i];
+        b->heap[i] = b->heap[child];
+        b->heap[child] = tmp;
+    }
+    return top;
+}
+
+/* transfers running from peer, as a counter to update */
+static int *running(const char *peer)
+{
+    int i, free_slot;
+
+    free_slot = -1;
+    for (i = 0; i <= tr.nworkers; i++) {
+        if (strcmp(tr.peers[i].name, peer) == 0)
+            return &tr.peers[i].running;
+        if (free_slot == -1 && tr.peers[i].running == 0)
+            free_slot = i;
+    }
+    /* no more peers than workers can be running: one slot is free */
+    strcpy(tr.peers[free_slot].name, peer);
+    return &tr.peers[free_slot].running;
+}
+
+/* the smallest queued job of a peer that may start another transfer */
+static batch *next_batch(void)
+{
+    batch *b, *best;
+
+    best = NULL;
+    for (b = tr.batches; b != NULL; b = b->next) {
+        if (b->n == 0 || *running(b->peer) >= tr.per_peer)
+            continue;
+        if (best == NULL || order(b->heap[0]) < order(best->heap[0]))
+            best = b;
+    }
+    return best;
+}
+
+static void unlink_batch(batch *b)
+{
+    batch **p;
+    for (p = &tr.batches; *p != NULL; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            return;
+        }
+    }
+}
+
+/*
+ * Transfers (called without tr.lock)
+ */
+
+static int copy_object(batch *b, job *j)
+{
+    char src[FILENAME_MAX], dst[FILENAME_MAX], tmp[FILENAME_MAX];
+    char *p;
+    struct stat st;
+
+    if (snprintf(src, FILENAME_MAX, "%s/.git/annex/objects/%s", b->repo,
+                j->object) >= FILENAME_MAX
+            || snprintf(dst, FILENAME_MAX, "%s/.git/annex/objects/%s",
+                tr.repodir, j->object) >= FILENAME_MAX
+            || snprintf(tmp, FILENAME_MAX, "%s/.git/annex/tmp/%s",
+                tr.repodir, j->key) >= FILENAME_MAX)
+        return -1;
+    unlink(tmp);
+    if (clone_file(src, tmp, 0444) == -1)
+        return -1;
+    if (stat(tmp, &st) == -1 || (j->size >= 0 && st.st_size != j->size)) {
+        unlink(tmp);
+        return -1;
+    }
+    /* the hash directories and the directory of the key */
+    for (p = dst + strlen(tr.repodir) + 1; (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        mkdir(dst, 0755);
+        *p = '/';
+    }
+    if (rename(tmp, dst) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    j->size = st.st_size;
+    return 0;
+}
+
+/* records where the batch copied to, and reports on it */
+static void finish(batch *b)
+{
+    char uuid[64], list[FILENAME_MAX], key[FILENAME_MAX];
+    struct timespec end;
+    double seconds;
+    FILE *f;
+    int fd;
+
+    if (b->local && b->done > 0 && git_annex_uuid(tr.repodir, uuid) == 0) {
+        snprintf(list, FILENAME_MAX, "%s/.git/annex/tmp/present.XXXXXX",
+                tr.repodir);
+        if ((fd = mkstemp(list)) != -1 && (f = fdopen(fd, "w")) != NULL) {
+            rewind(b->present);
+            while (fscanf(b->present, "%s\n", key) == 1)
+                fprintf(f, "%s %s 1\n", key, uuid);
+            fclose(f);
+            pthread_mutex_lock(&sharebox.rwlock);
+            git_annex_setpresentkeys(tr.repodir, list);
+            pthread_mutex_unlock(&sharebox.rwlock);
+            unlink(list);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - b->start.tv_sec)
+        + (end.tv_nsec - b->start.tv_nsec) / 1e9;
+    printf("%s: %lu keys, %lld bytes in %.2fs (%.1f MB/s), %lu failed\n",
+            b->peer, b->done, (long long) b->bytes, seconds,
+            seconds > 0 ? b->bytes / seconds / 1e6 : 0, b->failed);
+
+    pthread_mutex_lock(&tr.lock);
+    tr.bytes += b->bytes;
+    tr.done += b->done;
+    tr.failed += b->failed;
+    tr.seconds += seconds;
+    pthread_mutex_unlock(&tr.lock);
+
+    if (b->present)
+        fclose(b->present);
+    free(b->heap);
+    free(b);
+}
+
+static void *worker(void *arg)
+{
+    struct timespec start, end;
+    batch *b;
+    job *j;
+    int res;
+    (void) arg;
+
+    pthread_mutex_lock(&tr.lock);
+    while (!tr.stop) {
+        if ((b = next_batch()) == NULL) {
+            pthread_cond_wait(&tr.work, &tr.lock);
+            continue;
+        }
+        j = heap_pop(b);
+        b->running++;
+        (*running(b->peer))++;
+        pthread_mutex_unlock(&tr.lock);
+
+        qos_wait(QOS_TRANSFER, j->size);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (b->local)
+            res = copy_object(b, j);
+        else
+            res = git_annex_get_key(tr.repodir, j->key, b->peer);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (res == 0)
+            locations_record(b->peer, j->size, (end.tv_sec - start.tv_sec)
+                    + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+        pthread_mutex_lock(&tr.lock);
+        (*running(b->peer))--;
+        b->running--;
+        if (res == 0) {
+            inventory_update(j->object);
+            b->done++;
+            b->bytes += j->size > 0 ? j->size : 0;
+            if (b->local)
+                fprintf(b->present, "%s\n", j->key);
+        } else {
+            b->failed++;
+        }
+        free(j);
+        /* a peer below its limit may have work for a waiting worker */
+        pthread_cond_broadcast(&tr.work);
+        if (b->n == 0 && b->running == 0) {
+            unlink_batch(b);
+            pthread_mutex_unlock(&tr.lock);
+            finish(b);
+            pthread_mutex_lock(&tr.lock);
+        }
+    }
+    pthread_mutex_unlock(&tr.lock);
+    return NULL;
+}
+
+/*
+ * Interface
+ */
+
+void transfer_init(const char *repodir, int workers, int per_peer)
+{
+    int i;
+
+    memset(&tr, 0, sizeof(tr));
+    if (workers <= 0)
+        return;
+    tr.repodir = repodir;
+    tr.nworkers = workers;
+    tr.per_peer = per_peer > 0 ? per_peer : workers;
+    pthread_mutex_init(&tr.lock, NULL);
+    pthread_cond_init(&tr.work, NULL);
+    tr.peers = calloc(workers + 1, sizeof(struct peercount));
+    tr.workers = malloc(workers * sizeof(pthread_t));
+    for (i = 0; i < workers; i++)
+        pthread_create(&tr.workers[i], NULL, worker, NULL);
+}
+
+void transfer_destroy(void)
+{
+    batch *b, *next;
+    int i;
+
+    if (tr.nworkers <= 0)
+        return;
+    pthread_mutex_lock(&tr.lock);
+    tr.stop = true;
+    pthread_cond_broadcast(&tr.work);
+    pthread_mutex_unlock(&tr.lock);
+    for (i = 0; i < tr.nworkers; i++)
+        pthread_join(tr.workers[i], NULL);
+    free(tr.workers);
+
+    for (b = tr.batches; b != NULL; b = next) {
+        next = b->next;
+        while (b->n > 0)
+            free(heap_pop(b));
+        b->next = NULL;
+        finish(b);
+    }
+    transfer_stats(stdout);
+    free(tr.peers);
+    tr.nworkers = 0;
+}
+
+/* queues key, whose object is at the path relative to .git/annex/objects */
+static void queue(batch *b, const char *key, const char *object)
+{
+    char path[FILENAME_MAX];
+    job *j;
+
+    /* held already, loose or in a store */
+    if (snprintf(path, FILENAME_MAX, "%s/.git/annex/objects/%s", tr.repodir,
+                object) >= FILENAME_MAX
+            || access(path, F_OK) == 0 || store_has_key(key))
+        return;
+    j = malloc(sizeof(job));
+    strcpy(j->key, key);
+    strcpy(j->object, object);
+    j->size = git_annex_keysize(key);
+    heap_push(b, j);
+}
+
+/* queues what the links changed between from and to point to */
+static void queue_changed(batch *b, const char *from, const char *to)
+{
+    char keys[FILENAME_MAX], object[FILENAME_MAX], key[FILENAME_MAX];
+    FILE *list, *objects;
+    int fd;
+
+    snprintf(keys, FILENAME_MAX, "%s/.git/annex/tmp/keys.XXXXXX", tr.repodir);
+    if ((fd = mkstemp(keys)) == -1 || (list = fdopen(fd, "w+")) == NULL)
+        return;
+    if (git_added_keys(tr.repodir, from, to, list) > 0) {
+        fflush(list);
+        if ((objects = git_annex_objectpaths(tr.repodir, keys)) != NULL) {
+            /* examinekey answers in the order of the list */
+            rewind(list);
+            while (fscanf(list, "%s\n", key) == 1
+                    && fgets(object, sizeof object, objects) != NULL) {
+                object[strcspn(object, "\n")] = '\0';
+                queue(b, key, object);
+            }
+            pclose(objects);
+        }
+    }
+    fclose(list);
+    unlink(keys);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* reads the keys the links changed between from and to point to */
+static void range_keys(wanted *w, const char *from, const char *to)
+{
+    char key[FILENAME_MAX];
+    size_t cap;
+    FILE *list;
+
+    w->keys = NULL;
+    w->n = cap = 0;
+    if ((list = tmpfile()) == NULL)
+        return;
+    if (git_added_keys(tr.repodir, from, to, list) > 0) {
+        rewind(list);
+        while (fgets(key, sizeof key, list) != NULL) {
+            key[strcspn(key, "\n")] = '\0';
+            if (w->n == cap) {
+                cap = cap ? 2 * cap : 64;
+                w->keys = realloc(w->keys, cap * sizeof(char *));
+            }
+            w->keys[w->n++] = strdup(key);
+        }
+    }
+    fclose(list);
+    qsort(w->keys, w->n, sizeof(char *), compare_keys);
+}
+
+/* queues what a local peer holds and we do not, if the sync wants it */
+static void queue_missing(const char *object, bool theirs, void *arg)
+{
+    wanted *w = arg;
+    const char *key = strrchr(object, '/') + 1;
+
+    if (theirs && bsearch(&key, w->keys, w->n, sizeof(char *),
+                compare_keys) != NULL)
+        queue(w->b, key, object);
+}
+
+/*
+ * Queues the content to transfer from peer after a sync that brought in
+ * the commits between from and to (all of to when from is NULL): what
+ * the links they changed point to. repo is where the peer is: when it is
+ * a local directory whose inventory can be compared with ours, only the
+ * keys it holds and we do not are queued. Returns the number of keys
+ * queued.
+ */
+long transfer_keys(const char *peer, const char *repo, const char *from,
+        const char *to)
+{
+    char path[FILENAME_MAX];
+    struct stat st;
+    wanted w;
+    batch *b;
+    size_t i;
+    long n;
+
+    if (tr.nworkers <= 0)
+        return 0;
+    b = calloc(1, sizeof(batch));
+    strncpy(b->peer, peer, NAME_MAX);
+    strncpy(b->repo, repo, FILENAME_MAX - 1);
+    snprintf(path, FILENAME_MAX, "%s/.git/annex/objects", repo);
+    b->local = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+
+    /* the batch is not shared until it is queued */
+    n = -1;
+    if (b->local) {
+        w.b = b;
+        range_keys(&w, from, to);
+        n = w.n > 0 ? inventory_diff(repo, queue_missing, &w) : 0;
+        for (i = 0; i < w.n; i++)
+            free(w.keys[i]);
+        free(w.keys);
+    }
+    if (n == -1)
+        queue_changed(b, from, to);
+    n = b->n;
+    printf("%s: %ld keys to transfer\n", peer, n);
+    if (n == 0) {
+        free(b->heap);
+        free(b);
+        return 0;
+    }
+    if (b->local)
+        b->present = tmpfile();
+    pthread_mutex_lock(&tr.lock);
+    b->next = tr.batches;
+    tr.batches = b;
+    pthread_cond_broadcast(&tr.work);
+    pthread_mutex_unlock(&tr.lock);
+    return n;
+}
+
+void transfer_stats(FILE *out)
+{
+    unsigned long queued;
+    batch *b;
+
+    if (tr.nworkers <= 0)
+        return;
+    pthread_mutex_lock(&tr.lock);
+    queued = 0;
+    for (b = tr.batches; b != NULL; b = b->next)
+        queued += b->n + b->running;
+    fprintf(out, "transfers: %lu keys, %llu bytes, %lu failed, "
+            "%lu queued, %.1f MB/s\n", tr.done, tr.bytes, tr.failed,
+            queued, tr.seconds > 0 ? tr.bytes / tr.seconds / 1e6 : 0);
+    pthread_mutex_unlock(&tr.lock);
+}
@@ -0,0 +1,11 @@
+/*
+ * transfer.h
+ */
+
+#include "common.h"
+
+void transfer_init(const char *repodir, int workers, int per_peer);
+void transfer_destroy(void);
+long transfer_keys(const char *peer, const char *repo, const char *from,
+        const char *to);
+void transfer_stats(FILE *out);